@@ -1,6 +1,8 @@
 ﻿using System;
+using System.Buffers.Binary;
 using System.Collections.Generic;
 using System.Linq;
+using System.Numerics;
 using System.Reflection.PortableExecutable;
 using System.Text;
 using System.Threading.Tasks;
@@ -8,8 +10,10 @@ using System.Threading.Tasks;
 namespace Oxygen
 {
     /// <summary>
-    /// Performs compression by calculating the difference between two sets of data and then
-    /// performing run length encoding.
+    /// Performs compression by copying the ranges of the initial data found in the new data,
+    /// or when the two are the same size by calculating the difference between them and then
+    /// performing run length encoding. The format is shared with libOxygen/DeltaCompress.cpp,
+    /// which describes it. Deltas in the original format, without the version byte, still decode.
     /// </summary>
     /// <example>
     /// <code>
@@ -25,56 +29,125 @@ namespace Oxygen
     {
         private const byte UNCOMPRESSED_BLOCK = 0;
         private const byte DELTA_COMPRESSED_BLOCK = 1;
+        private const byte COPY_BLOCK = 2;
+        private const byte CHUNK_INDEX_BLOCK = 3;
 
-        private static byte[] CalculateDeltas(byte[] initialData, byte[] newData, int length, int initialDataOffset, int newDataOffset)
+        // A versioned delta starts with a byte with the top bit set, the first byte of the
+        // original format is always a block type.
+        private const byte VERSIONED_FORMAT = 0x80;
+        private const byte FORMAT_VERSION = 3;
+
+        // The oldest versioned format which still decodes, it has no chunk index.
+        private const byte MIN_FORMAT_VERSION = 2;
+
+        // Equal sized payloads are encoded this many bytes at a time.
+        private const int DELTA_WINDOW = 64 * 1024;
+
+        // Larger payloads are split into chunks of this many bytes, which are encoded and
+        // decoded on their own and in parallel.
+        private const int CHUNK_SIZE = 1024 * 1024;
+
+        // Copies are found by indexing each block of this many bytes of the initial data.
+        private const int MATCH_BLOCK_SIZE = 16;
+        private const uint HASH_MULTIPLIER = 0x01000193;
+
+        // The index stops growing at 4 MB, larger initial data only keeps the first block for each bucket.
+        private const int MAX_TABLE_BITS = 20;
+
+        private static void CalculateDeltas(byte[] initialData, byte[] newData, int offset, int length, byte[] delta)
         {
-            byte[] delta = new byte[length];
-            for (int i = 0; i < newData.Length; i++)
+            int i = 0;
+            if (Vector.IsHardwareAccelerated)
             {
-                delta[i] = (byte)(initialData[i + initialDataOffset] - newData[i + newDataOffset]);
+                for (; i + Vector<byte>.Count <= length; i += Vector<byte>.Count)
+                {
+                    Vector<byte> a = new Vector<byte>(initialData, offset + i);
+                    Vector<byte> b = new Vector<byte>(newData, offset + i);
+                    (a - b).CopyTo(delta, i);
+                }
             }
 
-            return delta;
+            for (; i < length; i++)
+            {
+                delta[i] = (byte)(initialData[offset + i] - newData[offset + i]);
+            }
         }
 
-        private static void WriteBlock(MemoryStream ms, byte[] data, byte flags, int offset, int length)
+        private static void WriteVarint(MemoryStream ms, uint value)
         {
-            ms.WriteByte(flags);
+            while (value >= 0x80)
+            {
+                ms.WriteByte((byte)(value | 0x80));
+                value >>= 7;
+            }
+            ms.WriteByte((byte)value);
+        }
 
-            if (flags == DELTA_COMPRESSED_BLOCK)
+        private static int VarintSize(uint value)
+        {
+            int size = 1;
+            while (value >= 0x80)
             {
-                ms.WriteByte((byte)(data.Length & 0xFF));
-                ms.WriteByte((byte)((data.Length >> 8) & 0xFF));
+                value >>= 7;
+                size++;
+            }
+            return size;
+        }
 
-                // Then run length encode the data.
-                byte value = data[0];
-                short count = 1;
-                for (int i = 1; i < data.Length; i++)
-                {
-                    if (data[i] == value)
-                    {
-                        count++;
-                    }
-                    else
-                    {
-                        ms.WriteByte(value);
-                        ms.WriteByte((byte)(count & 0xFF));
-                        ms.WriteByte((byte)((count >> 8) & 0xFF));
+        /// <summary>
+        /// Run length encodes the differences of a window, a window which changed too much
+        /// to be smaller that way is inserted as it is instead.
+        /// </summary>
+        private static void WriteDeltaWindow(MemoryStream ms, byte[] initialData, byte[] newData, int offset, int length, byte[] window)
+        {
+            long start = ms.Length;
+            long limit = start + 1 + VarintSize((uint)length) + length;
 
-                        value = data[i];
-                        count = 1;
-                    }
+            CalculateDeltas(initialData, newData, offset, length, window);
+
+            ms.WriteByte(DELTA_COMPRESSED_BLOCK);
+            WriteVarint(ms, (uint)length);
+
+            // The end of each run is found with a vectorized search.
+            int i = 0;
+            while (i < length && ms.Length < limit)
+            {
+                byte value = window[i];
+                int count = window.AsSpan(i, length - i).IndexOfAnyExcept(value);
+                if (count < 0)
+                {
+                    count = length - i;
                 }
 
                 ms.WriteByte(value);
-                ms.WriteByte((byte)(count & 0xFF));
-                ms.WriteByte((byte)((count >> 8) & 0xFF));
+                WriteVarint(ms, (uint)count);
+
+                i += count;
+            }
+
+            if (i < length || ms.Length > limit)
+            {
+                ms.SetLength(start);
+                WriteInsert(ms, newData, offset, length);
+            }
+        }
+
+        private static void WriteChunk(MemoryStream ms, int[]? table, int bits, byte[] initialData, byte[] newData, int begin, int end)
+        {
+            if (initialData.Length == newData.Length)
+            {
+                // The layout is unchanged, so the differences are mostly zero and run length encode well.
+                // Each window is encoded on its own, so only a window of differences is held.
+                byte[] window = new byte[Math.Min(end - begin, DELTA_WINDOW)];
+                for (int offset = begin; offset < end; offset += DELTA_WINDOW)
+                {
+                    WriteDeltaWindow(ms, initialData, newData, offset, Math.Min(end - offset, DELTA_WINDOW), window);
+                }
             }
-            else if (flags == UNCOMPRESSED_BLOCK)
+            else
             {
-                ms.WriteByte((byte)(length & 0xFF));
-                ms.WriteByte((byte)((length >> 8) & 0xFF));
-                ms.Write(data, offset, length);
+                // Bytes inserted or removed in the middle leave the rest to be copied from the initial data.
+                WriteMatches(ms, table, bits, initialData, newData, begin, end);
             }
         }
 
@@ -82,78 +155,207 @@ namespace Oxygen
         {
             using (MemoryStream ms = new MemoryStream())
             {
-                if (initialData.Length > newData.Length)
+                ms.WriteByte(VERSIONED_FORMAT | FORMAT_VERSION);
+
+                // The initial data is indexed once, the chunks only read the index.
+                int[]? table = null;
+                int bits = 0;
+                if (initialData.Length != newData.Length && newData.Length >= MATCH_BLOCK_SIZE)
                 {
-                    //int offset = FindSubArray(initialData, newData);
-                    //if (offset > -1)
-                    //{
-                    //    WriteData(ms, initialData, newData, offset);
-                    //}
-                    //else
-                    {
-                        WriteBlock(ms, newData, UNCOMPRESSED_BLOCK, 0, newData.Length);
-                    }
+                    table = BuildMatchTable(initialData, out bits);
                 }
-                else if (newData.Length > initialData.Length)
+
+                if (newData.Length <= CHUNK_SIZE)
                 {
-                    int offset = FindSubArray(newData, initialData);
-                    if (offset > -1)
-                    {
-                        WriteData(ms, newData, initialData, offset);
-                    }
-                    else
+                    WriteChunk(ms, table, bits, initialData, newData, 0, newData.Length);
+                    return ms.ToArray();
+                }
+
+                int numChunks = (newData.Length + CHUNK_SIZE - 1) / CHUNK_SIZE;
+                byte[][] chunks = new byte[numChunks][];
+                Parallel.For(0, numChunks, i =>
+                {
+                    int begin = i * CHUNK_SIZE;
+                    using (MemoryStream chunk = new MemoryStream())
                     {
-                        WriteBlock(ms, newData, UNCOMPRESSED_BLOCK, 0, newData.Length);
+                        WriteChunk(chunk, table, bits, initialData, newData, begin, begin + Math.Min(newData.Length - begin, CHUNK_SIZE));
+                        chunks[i] = chunk.ToArray();
                     }
+                });
+
+                ms.WriteByte(CHUNK_INDEX_BLOCK);
+                WriteVarint(ms, (uint)numChunks);
+                for (int i = 0; i < numChunks; i++)
+                {
+                    WriteVarint(ms, (uint)Math.Min(newData.Length - i * CHUNK_SIZE, CHUNK_SIZE));
+                    WriteVarint(ms, (uint)chunks[i].Length);
                 }
-                else
+
+                foreach (byte[] chunk in chunks)
                 {
-                    byte[] delta;
-                    delta = CalculateDeltas(initialData, newData, initialData.Length, 0, 0);
-                    WriteBlock(ms, delta, DELTA_COMPRESSED_BLOCK, 0, initialData.Length);
+                    ms.Write(chunk, 0, chunk.Length);
                 }
 
                 return ms.ToArray();
             }
         }
 
-        private static void WriteData(MemoryStream ms, byte[] longer, byte[] shorter, int offset)
+        private static void WriteInsert(MemoryStream ms, byte[] data, int offset, int length)
         {
-            int length = shorter.Length;
-            byte[] delta = CalculateDeltas(longer, shorter, length, offset, 0);
+            if (length == 0)
+            {
+                return;
+            }
+
+            ms.WriteByte(UNCOMPRESSED_BLOCK);
+            WriteVarint(ms, (uint)length);
+            ms.Write(data, offset, length);
+        }
+
+        private static void WriteCopy(MemoryStream ms, int offset, int length)
+        {
+            ms.WriteByte(COPY_BLOCK);
+            WriteVarint(ms, (uint)offset);
+            WriteVarint(ms, (uint)length);
+        }
+
+        private static uint BlockHash(byte[] data, int offset)
+        {
+            uint hash = 0;
+            for (int i = 0; i < MATCH_BLOCK_SIZE; i++)
+            {
+                hash = hash * HASH_MULTIPLIER + data[offset + i];
+            }
+            return hash;
+        }
+
+        private static int Bucket(uint hash, int bits)
+        {
+            return (int)((hash * 2654435761u) >> (32 - bits));
+        }
 
-            if (offset > 0)
+        /// <summary>
+        /// Each block of the initial data is indexed by its hash. The first block with a hash
+        /// is kept, a match is extended past it anyway. Returns null if there are no blocks.
+        /// </summary>
+        private static int[]? BuildMatchTable(byte[] initialData, out int bits)
+        {
+            bits = 0;
+
+            int numBlocks = initialData.Length / MATCH_BLOCK_SIZE;
+            if (numBlocks == 0)
             {
-                int uncompressedLength = offset;
-                WriteBlock(ms, longer, UNCOMPRESSED_BLOCK, 0, uncompressedLength);
+                return null;
             }
 
-            WriteBlock(ms, delta, DELTA_COMPRESSED_BLOCK, offset, length);
+            bits = 4;
+            while ((1 << bits) < numBlocks * 2 && bits < MAX_TABLE_BITS)
+            {
+                bits++;
+            }
 
-            if (offset + length < longer.Length)
+            int[] table = new int[1 << bits];
+            Array.Fill(table, -1);
+            for (int i = 0; i < numBlocks; i++)
             {
-                int uncompressedLength = offset + length;
-                WriteBlock(ms, longer, UNCOMPRESSED_BLOCK, uncompressedLength, longer.Length - uncompressedLength);
+                int bucket = Bucket(BlockHash(initialData, i * MATCH_BLOCK_SIZE), bits);
+                if (table[bucket] < 0)
+                {
+                    table[bucket] = i * MATCH_BLOCK_SIZE;
+                }
             }
+            return table;
         }
 
-        private static void ReadBlock(MemoryStream ms, List<byte> newData, byte[] initialData, byte[] delta, ref int pos)
+        /// <summary>
+        /// The same hash is rolled over the new data from begin to end a byte at a time. A hit
+        /// is checked and extended both ways into a copy, the bytes in between are inserted as
+        /// they are. Runs in linear time and reads nothing of the new data outside the range.
+        /// </summary>
+        private static void WriteMatches(MemoryStream ms, int[]? table, int bits, byte[] initialData, byte[] newData, int begin, int end)
+        {
+            if (table == null || end - begin < MATCH_BLOCK_SIZE)
+            {
+                WriteInsert(ms, newData, begin, end - begin);
+                return;
+            }
+
+            // Removes the byte leaving the window from the hash.
+            uint outFactor = 1;
+            for (int i = 1; i < MATCH_BLOCK_SIZE; i++)
+            {
+                outFactor *= HASH_MULTIPLIER;
+            }
+
+            int literal = begin;
+            int pos = begin;
+            uint hash = BlockHash(newData, pos);
+            while (pos + MATCH_BLOCK_SIZE <= end)
+            {
+                int candidate = table[Bucket(hash, bits)];
+                if (candidate >= 0 && initialData.AsSpan(candidate, MATCH_BLOCK_SIZE).SequenceEqual(newData.AsSpan(pos, MATCH_BLOCK_SIZE)))
+                {
+                    int start = pos;
+                    int source = candidate;
+                    int length = MATCH_BLOCK_SIZE;
+                    while (start + length < end && source + length < initialData.Length &&
+                        newData[start + length] == initialData[source + length])
+                    {
+                        length++;
+                    }
+
+                    while (start > literal && source > 0 && newData[start - 1] == initialData[source - 1])
+                    {
+                        start--;
+                        source--;
+                        length++;
+                    }
+
+                    WriteInsert(ms, newData, literal, start - literal);
+                    WriteCopy(ms, source, length);
+
+                    pos = start + length;
+                    literal = pos;
+                    if (pos + MATCH_BLOCK_SIZE <= end)
+                    {
+                        hash = BlockHash(newData, pos);
+                    }
+                    continue;
+                }
+
+                if (pos + MATCH_BLOCK_SIZE < end)
+                {
+                    hash = (hash - newData[pos] * outFactor) * HASH_MULTIPLIER + newData[pos + MATCH_BLOCK_SIZE];
+                }
+                pos++;
+            }
+
+            WriteInsert(ms, newData, literal, end - literal);
+        }
+
+        /// <summary>
+        /// Reads a block of the original format, whose lengths are two bytes and copies four.
+        /// </summary>
+        private static void ReadBlock(List<byte> newData, byte[] initialData, byte[] delta, ref int pos)
         {
             int flags = delta[pos++];
             if (flags == UNCOMPRESSED_BLOCK)
             {
+                CheckRemaining(delta, pos, 2);
+
                 int countLo = delta[pos++];
                 int countHi = delta[pos++];
 
                 int count = countLo | (countHi << 8);
+                CheckRemaining(delta, pos, count);
 
-                for (int i = 0; i < count; i++)
-                {
-                    newData.Add(delta[pos++]);
-                }
+                newData.AddRange(new ArraySegment<byte>(delta, pos, count));
+                pos += count;
             }
             else if (flags == DELTA_COMPRESSED_BLOCK)
             {
+                CheckRemaining(delta, pos, 2);
+
                 int dataLength;
                 {
                     int countLo = delta[pos++];
@@ -167,11 +369,17 @@ namespace Oxygen
                 int end = newData.Count + dataLength;
                 while (newData.Count < end)
                 {
+                    CheckRemaining(delta, pos, 3);
+
                     int value = delta[pos++];
                     int countLo = delta[pos++];
                     int countHi = delta[pos++];
 
                     int count = countLo | (countHi << 8);
+                    if (count > end - newData.Count)
+                    {
+                        throw new InvalidDataException("Malformed delta.");
+                    }
 
                     for (int j = 0; j < count; j++)
                     {
@@ -179,62 +387,232 @@ namespace Oxygen
                     }
                 }
 
+                if (dataLength < initialData.Length)
+                {
+                    throw new InvalidDataException("Malformed delta.");
+                }
+
                 // Decode the deltas.
                 for (int i = 0; i < initialData.Length; i++)
                 {
                     newData[i + offset] = (byte)(initialData[i] - newData[i + offset]);
                 }
             }
+            else if (flags == COPY_BLOCK)
+            {
+                CheckRemaining(delta, pos, 8);
+
+                int offset = BinaryPrimitives.ReadInt32LittleEndian(delta.AsSpan(pos));
+                int length = BinaryPrimitives.ReadInt32LittleEndian(delta.AsSpan(pos + 4));
+                pos += 8;
+
+                if (offset < 0 || length < 0 || offset > initialData.Length - length)
+                {
+                    throw new InvalidDataException("Malformed delta.");
+                }
+
+                newData.AddRange(new ArraySegment<byte>(initialData, offset, length));
+            }
+            else
+            {
+                throw new InvalidDataException("Malformed delta.");
+            }
         }
 
-        public static byte[] Decompress(byte[] initialData, byte[] delta)
+        private static int ReadVarint(byte[] delta, ref int pos)
         {
-            List<byte> newData = new List<byte>();
-            using (MemoryStream ms = new MemoryStream())
+            // Values are at most five bytes and must fit in an int.
+            uint result = 0;
+            for (int shift = 0; shift < 35; shift += 7)
             {
-                int pos = 0;
-                while (pos < delta.Length)
+                CheckRemaining(delta, pos, 1);
+
+                byte value = delta[pos++];
+                if (shift == 28 && value > 0x07)
                 {
-                    ReadBlock(ms, newData, initialData, delta, ref pos);
+                    break;
+                }
+
+                result |= (uint)(value & 0x7F) << shift;
+                if ((value & 0x80) == 0)
+                {
+                    return (int)result;
                 }
             }
 
-            return newData.ToArray();
+            throw new InvalidDataException("Malformed delta.");
+        }
+
+        /// <summary>
+        /// As ReadBlock, for the versioned format whose lengths, offsets and counts are varints.
+        /// A delta block applies to the initial data at the position it is decoded to.
+        /// </summary>
+        private static void ReadVersionedBlock(List<byte> newData, int origin, byte[] initialData, byte[] delta, ref int pos)
+        {
+            int flags = delta[pos++];
+            if (flags == UNCOMPRESSED_BLOCK)
+            {
+                int count = ReadVarint(delta, ref pos);
+                CheckRemaining(delta, pos, count);
+
+                newData.AddRange(new ArraySegment<byte>(delta, pos, count));
+                pos += count;
+            }
+            else if (flags == DELTA_COMPRESSED_BLOCK)
+            {
+                int dataLength = ReadVarint(delta, ref pos);
+                int offset = origin + newData.Count;
+                if (dataLength > initialData.Length - offset)
+                {
+                    throw new InvalidDataException("Malformed delta.");
+                }
+
+                int filled = 0;
+                while (filled < dataLength)
+                {
+                    CheckRemaining(delta, pos, 1);
+
+                    byte value = delta[pos++];
+                    int count = ReadVarint(delta, ref pos);
+                    if (count == 0 || count > dataLength - filled)
+                    {
+                        throw new InvalidDataException("Malformed delta.");
+                    }
+
+                    for (int j = 0; j < count; j++)
+                    {
+                        newData.Add((byte)(initialData[offset + filled + j] - value));
+                    }
+                    filled += count;
+                }
+            }
+            else if (flags == COPY_BLOCK)
+            {
+                int offset = ReadVarint(delta, ref pos);
+                int length = ReadVarint(delta, ref pos);
+                if (offset > initialData.Length - length)
+                {
+                    throw new InvalidDataException("Malformed delta.");
+                }
+
+                newData.AddRange(new ArraySegment<byte>(initialData, offset, length));
+            }
+            else
+            {
+                throw new InvalidDataException("Malformed delta.");
+            }
+        }
+
+        private static void CheckRemaining(byte[] delta, int pos, int count)
+        {
+            if (delta.Length - pos < count)
+            {
+                throw new InvalidDataException("Malformed delta.");
+            }
         }
 
         /// <summary>
-        /// Searches for the shorter array in the longer array.
+        /// Reads the chunk index at pos, then decodes the chunks in parallel. Each must decode
+        /// to exactly its size from exactly its bytes, as it is only placed by the ones before it.
         /// </summary>
-        /// <param name="longer">The longer array.</param>
-        /// <param name="shorter">The shorter array.</param>
-        /// <exception cref="ArgumentException">Throws if the parameters are invalid.</exception>
-        /// <returns>Returns the index of where the sub array is located, or -1 if the sub array could not be found.</returns>
-        private static int FindSubArray(byte[] longer, byte[] shorter)
+        private static byte[] DecompressChunks(byte[] initialData, byte[] delta, int pos)
         {
-            if (longer.Length <= shorter.Length)
+            pos++;
+            int numChunks = ReadVarint(delta, ref pos);
+            if (numChunks <= 0 || numChunks > delta.Length)
             {
-                throw new ArgumentException($"Invalid arguments '{nameof(longer)}' should be a longer array than '{nameof(shorter)}'.");
+                throw new InvalidDataException("Malformed delta.");
             }
 
-            for (int i = 0; i < longer.Length; i++)
+            int[] sizes = new int[numChunks];
+            int[] offsets = new int[numChunks];
+            int[] deltaSizes = new int[numChunks];
+            int[] deltaOffsets = new int[numChunks];
+            long size = 0;
+            long deltaSize = 0;
+            for (int i = 0; i < numChunks; i++)
             {
-                bool success = true;
-                for (int j = 0; j < shorter.Length; j++)
+                sizes[i] = ReadVarint(delta, ref pos);
+                deltaSizes[i] = ReadVarint(delta, ref pos);
+                offsets[i] = (int)Math.Min(size, int.MaxValue);
+                deltaOffsets[i] = (int)Math.Min(deltaSize, int.MaxValue);
+                size += sizes[i];
+                deltaSize += deltaSizes[i];
+            }
+
+            if (size > int.MaxValue || deltaSize != delta.Length - pos)
+            {
+                throw new InvalidDataException("Malformed delta.");
+            }
+
+            byte[] newData = new byte[size];
+            ParallelLoopResult result = Parallel.For(0, numChunks, (i, state) =>
+            {
+                try
                 {
-                    if (longer[i + j] != shorter[j])
+                    byte[] chunkDelta = delta.AsSpan(pos + deltaOffsets[i], deltaSizes[i]).ToArray();
+                    List<byte> chunk = new List<byte>(sizes[i]);
+
+                    int chunkPos = 0;
+                    while (chunkPos < chunkDelta.Length && chunk.Count <= sizes[i])
+                    {
+                        ReadVersionedBlock(chunk, offsets[i], initialData, chunkDelta, ref chunkPos);
+                    }
+
+                    if (chunk.Count != sizes[i])
                     {
-                        success = false;
-                        break;
+                        state.Stop();
+                        return;
                     }
+                    chunk.CopyTo(newData, offsets[i]);
                 }
+                catch (InvalidDataException)
+                {
+                    state.Stop();
+                }
+            });
 
-                if (success)
+            if (!result.IsCompleted)
+            {
+                throw new InvalidDataException("Malformed delta.");
+            }
+            return newData;
+        }
+
+        /// <exception cref="InvalidDataException">Throws if the delta is malformed.</exception>
+        public static byte[] Decompress(byte[] initialData, byte[] delta)
+        {
+            List<byte> newData = new List<byte>();
+
+            if (delta.Length > 0 && (delta[0] & VERSIONED_FORMAT) != 0)
+            {
+                int version = delta[0] & ~VERSIONED_FORMAT;
+                if (version < MIN_FORMAT_VERSION || version > FORMAT_VERSION)
                 {
-                    return i;
+                    throw new InvalidDataException("Unsupported delta version.");
+                }
+
+                int pos = 1;
+                if (version >= 3 && pos < delta.Length && delta[pos] == CHUNK_INDEX_BLOCK)
+                {
+                    return DecompressChunks(initialData, delta, pos);
+                }
+
+                while (pos < delta.Length)
+                {
+                    ReadVersionedBlock(newData, 0, initialData, delta, ref pos);
+                }
+            }
+            else
+            {
+                int pos = 0;
+                while (pos < delta.Length)
+                {
+                    ReadBlock(newData, initialData, delta, ref pos);
                 }
             }
 
-            return -1;
+            return newData.ToArray();
         }
     }
 }
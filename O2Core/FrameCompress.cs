@@ -0,0 +1,356 @@
+﻿using System.Buffers.Binary;
+
+namespace Oxygen
+{
+    /// <summary>
+    /// Frame compression negotiated with a client, the format is described in libOxygen/FrameCompress.h.
+    /// Matches reach back into the frames compressed before, so each direction of a connection
+    /// has its own compressor or decompressor which must see the frames in the order they are sent.
+    /// </summary>
+    internal static class FrameCompression
+    {
+        /// <summary>
+        /// Set in the length word of a frame whose payload is compressed.
+        /// </summary>
+        public const uint CompressedFrame = 0x80000000;
+
+        /// <summary>
+        /// Capabilities offered in the connection handshake.
+        /// </summary>
+        public const int CapabilityCompression = 1;
+
+        internal const uint StoredPayload = 0x80000000;
+        internal const int MaxRawSize = 256 * 1024 * 1024;
+        internal const int MaxOffset = 65535;
+        internal const int MinMatch = 4;
+        internal const int HistoryLimit = 4 * 65536;
+        internal const int HashBits = 12;
+        internal const int SkipShift = 6;
+
+        /// <summary>
+        /// Cuts the history back to the window once it has grown past the limit, returns the number of bytes removed.
+        /// </summary>
+        internal static int Slide(byte[] history, ref int length)
+        {
+            if (length <= HistoryLimit)
+            {
+                return 0;
+            }
+
+            int removed = length - MaxOffset;
+            Buffer.BlockCopy(history, removed, history, 0, MaxOffset);
+            length = MaxOffset;
+            return removed;
+        }
+
+        internal static void Append(ref byte[] history, ref int length, int count)
+        {
+            if (length + count > history.Length)
+            {
+                Array.Resize(ref history, Math.Max(history.Length * 2, length + count));
+            }
+
+            length += count;
+        }
+    }
+
+    /// <summary>
+    /// The frames the server has compressed for one node/message pair.
+    /// </summary>
+    public class CompressionStats
+    {
+        public string NodeName { get; }
+        public string MessageName { get; }
+        public long Frames { get; set; }
+        public long UncompressedBytes { get; set; }
+        public long CompressedBytes { get; set; }
+
+        public double Ratio => CompressedBytes > 0 ? (double)UncompressedBytes / CompressedBytes : 1.0;
+
+        public CompressionStats(string nodeName, string messageName)
+        {
+            NodeName = nodeName;
+            MessageName = messageName;
+        }
+
+        internal CompressionStats Clone()
+        {
+            return (CompressionStats)MemberwiseClone();
+        }
+    }
+
+    internal class FrameCompressor
+    {
+        private byte[] history = new byte[FrameCompression.HistoryLimit];
+        private int length;
+        private uint position;
+        private readonly uint[] table = new uint[1 << FrameCompression.HashBits];
+
+        /// <summary>
+        /// Returns the compressed payload, the raw bytes are stored when they do not compress.
+        /// </summary>
+        public byte[] Compress(ReadOnlySpan<byte> data)
+        {
+            // Positions in the table are offsets into the whole stream, so stay valid as the history slides.
+            this.position += (uint)FrameCompression.Slide(this.history, ref this.length);
+
+            int start = this.length;
+            FrameCompression.Append(ref this.history, ref this.length, data.Length);
+            data.CopyTo(this.history.AsSpan(start));
+
+            byte[] dst = new byte[data.Length + 4];
+            int written = Encode(start, dst.AsSpan(4), data.Length);
+            if (written == 0)
+            {
+                BinaryPrimitives.WriteUInt32LittleEndian(dst, (uint)data.Length | FrameCompression.StoredPayload);
+                data.CopyTo(dst.AsSpan(4));
+                return dst;
+            }
+
+            BinaryPrimitives.WriteUInt32LittleEndian(dst, (uint)data.Length);
+            Array.Resize(ref dst, written + 4);
+            return dst;
+        }
+
+        private static uint Hash(uint value)
+        {
+            return (value * 2654435761u) >> (32 - FrameCompression.HashBits);
+        }
+
+        private static int LengthBytes(int length)
+        {
+            return length >= 15 ? (length - 15) / 255 + 1 : 0;
+        }
+
+        private static void WriteLength(Span<byte> dst, ref int op, int length)
+        {
+            if (length < 15)
+            {
+                return;
+            }
+
+            length -= 15;
+            while (length >= 255)
+            {
+                dst[op++] = 255;
+                length -= 255;
+            }
+            dst[op++] = (byte)length;
+        }
+
+        private int Encode(int start, Span<byte> dst, int limit)
+        {
+            // Returns zero if the sequences would take limit bytes or more.
+            ReadOnlySpan<byte> buffer = this.history.AsSpan(0, this.length);
+            int end = this.length;
+
+            int ip = start;
+            int anchor = start;
+            int op = 0;
+
+            while (ip + FrameCompression.MinMatch <= end)
+            {
+                uint value = BinaryPrimitives.ReadUInt32LittleEndian(buffer.Slice(ip));
+                uint position = this.position + (uint)ip;
+                uint hash = Hash(value);
+                uint distance = position - this.table[hash];
+                this.table[hash] = position;
+
+                if (distance == 0 || distance > FrameCompression.MaxOffset || distance > ip ||
+                    BinaryPrimitives.ReadUInt32LittleEndian(buffer.Slice(ip - (int)distance)) != value)
+                {
+                    // Skips ahead faster the longer nothing has matched, so incompressible data is cheap.
+                    ip += 1 + ((ip - anchor) >> FrameCompression.SkipShift);
+                    continue;
+                }
+
+                int match = ip - (int)distance;
+                int matchLength = FrameCompression.MinMatch;
+                while (ip + matchLength < end && buffer[match + matchLength] == buffer[ip + matchLength])
+                {
+                    matchLength++;
+                }
+
+                while (ip > anchor && match > 0 && buffer[ip - 1] == buffer[match - 1])
+                {
+                    ip--;
+                    match--;
+                    matchLength++;
+                }
+
+                int literals = ip - anchor;
+                int required = 1 + LengthBytes(literals) + literals + 2 + LengthBytes(matchLength - FrameCompression.MinMatch);
+                if (op + required >= limit)
+                {
+                    return 0;
+                }
+
+                dst[op++] = (byte)((Math.Min(literals, 15) << 4) | Math.Min(matchLength - FrameCompression.MinMatch, 15));
+                WriteLength(dst, ref op, literals);
+                buffer.Slice(anchor, literals).CopyTo(dst.Slice(op));
+                op += literals;
+                dst[op++] = (byte)(distance & 0xFF);
+                dst[op++] = (byte)(distance >> 8);
+                WriteLength(dst, ref op, matchLength - FrameCompression.MinMatch);
+
+                ip += matchLength;
+                anchor = ip;
+
+                // The end of a match often starts the next one.
+                if (ip + 2 <= end && ip >= 2)
+                {
+                    this.table[Hash(BinaryPrimitives.ReadUInt32LittleEndian(buffer.Slice(ip - 2)))] = this.position + (uint)(ip - 2);
+                }
+            }
+
+            int remaining = end - anchor;
+            if (remaining > 0)
+            {
+                if (op + 1 + LengthBytes(remaining) + remaining >= limit)
+                {
+                    return 0;
+                }
+
+                dst[op++] = (byte)(Math.Min(remaining, 15) << 4);
+                WriteLength(dst, ref op, remaining);
+                buffer.Slice(anchor, remaining).CopyTo(dst.Slice(op));
+                op += remaining;
+            }
+
+            return op;
+        }
+    }
+
+    internal class FrameDecompressor
+    {
+        private byte[] history = new byte[FrameCompression.HistoryLimit];
+        private int length;
+
+        /// <summary>
+        /// Returns the decompressed payload, or null if it is malformed after which
+        /// the stream can not be decompressed any further.
+        /// </summary>
+        public byte[]? Decompress(ReadOnlySpan<byte> data)
+        {
+            if (data.Length < 4)
+            {
+                return null;
+            }
+
+            uint header = BinaryPrimitives.ReadUInt32LittleEndian(data);
+            int rawSize = (int)(header & ~FrameCompression.StoredPayload);
+            if (rawSize > FrameCompression.MaxRawSize)
+            {
+                return null;
+            }
+
+            FrameCompression.Slide(this.history, ref this.length);
+
+            int start = this.length;
+            int end = start + rawSize;
+            FrameCompression.Append(ref this.history, ref this.length, rawSize);
+            Span<byte> buffer = this.history.AsSpan(0, end);
+
+            if ((header & FrameCompression.StoredPayload) != 0)
+            {
+                if (data.Length - 4 != rawSize)
+                {
+                    return null;
+                }
+
+                data.Slice(4).CopyTo(buffer.Slice(start));
+                return data.Slice(4).ToArray();
+            }
+
+            int ip = 4;
+            int op = start;
+            while (op < end)
+            {
+                if (ip >= data.Length)
+                {
+                    return null;
+                }
+
+                byte token = data[ip++];
+
+                int literals = token >> 4;
+                if (literals == 15 && !ReadLength(data, ref ip, ref literals))
+                {
+                    return null;
+                }
+
+                if (literals > data.Length - ip || literals > end - op)
+                {
+                    return null;
+                }
+
+                data.Slice(ip, literals).CopyTo(buffer.Slice(op));
+                ip += literals;
+                op += literals;
+
+                if (op == end)
+                {
+                    break;
+                }
+
+                if (data.Length - ip < 2)
+                {
+                    return null;
+                }
+
+                int distance = data[ip] | (data[ip + 1] << 8);
+                ip += 2;
+
+                int matchLength = token & 15;
+                if (matchLength == 15 && !ReadLength(data, ref ip, ref matchLength))
+                {
+                    return null;
+                }
+                matchLength += FrameCompression.MinMatch;
+
+                if (distance == 0 || distance > op || matchLength > end - op)
+                {
+                    return null;
+                }
+
+                // The match may overlap the bytes it produces, which repeats them.
+                if (distance >= matchLength)
+                {
+                    buffer.Slice(op - distance, matchLength).CopyTo(buffer.Slice(op));
+                }
+                else
+                {
+                    for (int i = 0; i < matchLength; i++)
+                    {
+                        buffer[op + i] = buffer[op - distance + i];
+                    }
+                }
+                op += matchLength;
+            }
+
+            if (ip != data.Length)
+            {
+                return null;
+            }
+
+            return buffer.Slice(start, rawSize).ToArray();
+        }
+
+        private static bool ReadLength(ReadOnlySpan<byte> data, ref int ip, ref int length)
+        {
+            byte value;
+            do
+            {
+                if (ip >= data.Length || length > FrameCompression.MaxRawSize)
+                {
+                    return false;
+                }
+
+                value = data[ip++];
+                length += value;
+            } while (value == 255);
+
+            return true;
+        }
+    }
+}
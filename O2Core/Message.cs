@@ -13,12 +13,39 @@ namespace Oxygen
 
         internal int Id { get; set; }
 
-        public Message(byte[] data)
+        /// <summary>
+        /// The number of bytes taken by the node and message names at the start of the data.
+        /// </summary>
+        internal int NamesLength { get; private set; }
+
+        public Message(byte[] data) : this(data, null)
+        {
+        }
+
+        internal Message(byte[] data, RouteTable? routes)
         {
             this.stream = new MemoryStream(data);
             this.reader = new BinaryReader(stream);
-            this.NodeName = this.ReadString();
-            this.MessageName = this.ReadString();
+
+            int route = this.ReadInt();
+            if (route < 0)
+            {
+                // A negotiated client sends the route id in place of the names.
+                if (routes == null || !routes.TryGetNames(-route - 1, out string nodeName, out string messageName))
+                {
+                    throw new Exception("Malformed message.");
+                }
+
+                this.NodeName = nodeName;
+                this.MessageName = messageName;
+            }
+            else
+            {
+                this.stream.Position = 0;
+                this.NodeName = this.ReadString();
+                this.MessageName = this.ReadString();
+                this.NamesLength = (int)this.stream.Position;
+            }
         }
 
         public Message(string nodeName, string messageName)
@@ -30,6 +57,7 @@ namespace Oxygen
             this.writer = new BinaryWriter(this.stream);
             this.WriteString(nodeName);
             this.WriteString(messageName);
+            this.NamesLength = (int)this.stream.Position;
         }
 
         public long Length
@@ -0,0 +1,46 @@
+﻿namespace Oxygen
+{
+    /// <summary>
+    /// The node/message pairs a client has negotiated to send as an id in place of the names.
+    /// </summary>
+    internal class RouteTable
+    {
+        private readonly List<(string NodeName, string MessageName)> routes = new List<(string, string)>();
+        private readonly Dictionary<(string, string), int> ids = new Dictionary<(string, string), int>();
+
+        public static RouteTable Read(Message msg)
+        {
+            var table = new RouteTable();
+
+            int count = msg.ReadInt();
+            for (int i = 0; i < count; i++)
+            {
+                string nodeName = msg.ReadString();
+                string messageName = msg.ReadString();
+
+                table.routes.Add((nodeName, messageName));
+                table.ids.TryAdd((nodeName, messageName), i);
+            }
+
+            return table;
+        }
+
+        public bool TryGetRoute(string nodeName, string messageName, out int route)
+        {
+            return this.ids.TryGetValue((nodeName, messageName), out route);
+        }
+
+        public bool TryGetNames(int route, out string nodeName, out string messageName)
+        {
+            if (route >= 0 && route < this.routes.Count)
+            {
+                (nodeName, messageName) = this.routes[route];
+                return true;
+            }
+
+            nodeName = string.Empty;
+            messageName = string.Empty;
+            return false;
+        }
+    }
+}
@@ -0,0 +1,64 @@
+﻿using System.Text;
+
+namespace Oxygen
+{
+    /// <summary>
+    /// Hashes of the fixed size payload layouts, which clients send during the
+    /// connection handshake so that a mismatched client can be detected.
+    /// The hash must match Oxygen::Schema in libOxygen.
+    /// </summary>
+    public static class Schema
+    {
+        public const byte Int32 = 1;
+        public const byte Double = 2;
+
+        private static readonly object schemaLock = new object();
+        private static readonly Dictionary<string, uint> schemas = new Dictionary<string, uint>();
+
+        public static uint Hash(string name, params (byte Type, int Count)[] fields)
+        {
+            // FNV-1a over the name followed by the type and count of each field.
+            uint hash = 2166136261u;
+            void Mix(byte value)
+            {
+                hash ^= value;
+                hash *= 16777619u;
+            }
+
+            foreach (byte c in Encoding.UTF8.GetBytes(name))
+            {
+                Mix(c);
+            }
+
+            foreach (var field in fields)
+            {
+                Mix(field.Type);
+                Mix((byte)(field.Count & 0xFF));
+                Mix((byte)((field.Count >> 8) & 0xFF));
+                Mix((byte)((field.Count >> 16) & 0xFF));
+                Mix((byte)((field.Count >> 24) & 0xFF));
+            }
+
+            return hash;
+        }
+
+        public static void Register(string name, params (byte Type, int Count)[] fields)
+        {
+            lock (schemaLock)
+            {
+                schemas[name] = Hash(name, fields);
+            }
+        }
+
+        /// <summary>
+        /// Returns false if the schema is registered with a different layout.
+        /// </summary>
+        internal static bool Verify(string name, uint hash)
+        {
+            lock (schemaLock)
+            {
+                return !schemas.TryGetValue(name, out uint expected) || expected == hash;
+            }
+        }
+    }
+}
@@ -1,4 +1,5 @@
-﻿using System.Diagnostics;
+﻿using System.Buffers.Binary;
+using System.Diagnostics;
 using System.Net.Sockets;
 
 namespace Oxygen
@@ -132,15 +133,31 @@ namespace Oxygen
         private class ClientConnection
         {
             public bool Running { get; set; }
-            public TcpClient Connection { get; private set; }
+
+            /// <summary>
+            /// A TCP or Unix socket stream, or the rings of a shared memory connection.
+            /// </summary>
+            public Stream Stream { get; private set; }
             public Client Client { get; private set; }
             public ClientWaitHandle MsgHandle { get; private set; }
             public Queue<Message> Messages { get; private set; }
             public object MsgLock { get; private set; }
 
-            public ClientConnection(TcpClient connection, Client client, ClientWaitHandle msgHandle, object msgLock, Queue<Message> messages)
+            /// <summary>
+            /// Set by the read thread once the client has negotiated compact routes.
+            /// </summary>
+            public RouteTable? Routes { get; set; }
+
+            /// <summary>
+            /// Set once the client has negotiated frame compression, the compressor is only
+            /// used by the write thread and the decompressor by the read thread.
+            /// </summary>
+            public FrameCompressor? Compressor { get; set; }
+            public FrameDecompressor? Decompressor { get; set; }
+
+            public ClientConnection(Stream stream, Client client, ClientWaitHandle msgHandle, object msgLock, Queue<Message> messages)
             {
-                Connection = connection;
+                Stream = stream;
                 Client = client;
                 MsgHandle = msgHandle;
                 MsgLock = msgLock;
@@ -161,6 +178,10 @@ namespace Oxygen
         }
 
         private int port;
+        private readonly List<string> unixSocketPaths = new List<string>();
+        private readonly List<string> sharedMemorySocketPaths = new List<string>();
+        private readonly List<FileStream> unixSocketLocks = new List<FileStream>();
+        private long clientID = 0;
         private bool running;
         private object clientLock = new object();
         private object eventLock = new object();
@@ -172,12 +193,56 @@ namespace Oxygen
 
         private readonly GaugeMetric peakEventTime = new GaugeMetric("oxygen_server_peak_event_time", string.Empty);
         private readonly CounterMetric eventsProcessed = new CounterMetric("oxygen_server_events_processed_counter", string.Empty);
+        private readonly CounterMetric uncompressedBytes = new CounterMetric("oxygen_server_uncompressed_bytes_counter", string.Empty);
+        private readonly CounterMetric compressedBytes = new CounterMetric("oxygen_server_compressed_bytes_counter", string.Empty);
+
+        private readonly object compressionLock = new object();
+        private readonly Dictionary<(string, string), CompressionStats> compressionStats = new Dictionary<(string, string), CompressionStats>();
+
+        /// <summary>
+        /// Whether clients which offer frame compression are accepted.
+        /// </summary>
+        public bool CompressFrames { get; set; } = true;
+
+        /// <summary>
+        /// Smaller payloads are sent uncompressed so their latency is unchanged.
+        /// </summary>
+        public int CompressionThreshold { get; set; } = 512;
 
         public Server(int port)
         {
             this.port = port;
         }
 
+        /// <summary>
+        /// Also accepts clients on a Unix domain socket, connected to with unix://path. A socket
+        /// left at the path by a previous run is replaced, any other file is not. The server
+        /// holds path.lock while it runs.
+        /// </summary>
+        public void AddUnixListener(string path)
+        {
+            if (running)
+            {
+                throw new InvalidOperationException();
+            }
+
+            this.unixSocketPaths.Add(path);
+        }
+
+        /// <summary>
+        /// Also accepts shared memory clients, connected to with shm://path. The Unix domain
+        /// socket at the path is used to set up each connection and wake the other side.
+        /// </summary>
+        public void AddSharedMemoryListener(string path)
+        {
+            if (running)
+            {
+                throw new InvalidOperationException();
+            }
+
+            this.sharedMemorySocketPaths.Add(path);
+        }
+
         public void AddNode(Node node)
         {
             if (running)
@@ -199,6 +264,39 @@ namespace Oxygen
 
             node.AddMetric(peakEventTime);
             node.AddMetric(eventsProcessed);
+            node.AddMetric(uncompressedBytes);
+            node.AddMetric(compressedBytes);
+        }
+
+        /// <summary>
+        /// The frames sent compressed so far, one entry per node/message pair.
+        /// </summary>
+        public List<CompressionStats> GetCompressionStats()
+        {
+            lock (this.compressionLock)
+            {
+                return this.compressionStats.Values.Select(stats => stats.Clone()).ToList();
+            }
+        }
+
+        private void RecordCompression(Message response, int rawSize, int compressedSize)
+        {
+            lock (this.compressionLock)
+            {
+                var key = (response.NodeName, response.MessageName);
+                if (!this.compressionStats.TryGetValue(key, out CompressionStats? stats))
+                {
+                    stats = new CompressionStats(response.NodeName, response.MessageName);
+                    this.compressionStats.Add(key, stats);
+                }
+
+                stats.Frames++;
+                stats.UncompressedBytes += rawSize;
+                stats.CompressedBytes += compressedSize;
+
+                uncompressedBytes.Value += rawSize;
+                compressedBytes.Value += compressedSize;
+            }
         }
 
         private void OnTimer(object? state)
@@ -237,7 +335,7 @@ namespace Oxygen
             }
         }
 
-        private int ReadFromStream(ClientConnection cli, NetworkStream stream, byte[] buffer, int index, int size)
+        private int ReadFromStream(ClientConnection cli, Stream stream, byte[] buffer, int index, int size)
         {
             bool success = true;
 
@@ -248,7 +346,7 @@ namespace Oxygen
                     int count = 0;
                     try
                     {
-                        count = stream.Read(buffer, index, size);
+                        count = stream.Read(buffer, index, size - index);
                     }
                     catch (Exception)
                     {
@@ -256,6 +354,13 @@ namespace Oxygen
                         OnDisconnect(cli);
                     }
 
+                    if (success && count == 0)
+                    {
+                        // The client closed the connection.
+                        success = false;
+                        OnDisconnect(cli);
+                    }
+
                     index += count;
                 }
             }
@@ -263,11 +368,16 @@ namespace Oxygen
             return success ? index : -1;
         }
 
-        private void WriteToStream(ClientConnection cli, NetworkStream stream, byte[] buffer)
+        private void WriteToStream(ClientConnection cli, Stream stream, byte[] buffer)
+        {
+            WriteToStream(cli, stream, buffer, 0);
+        }
+
+        private void WriteToStream(ClientConnection cli, Stream stream, byte[] buffer, int offset)
         {
             try
             {
-                stream.Write(buffer, 0, buffer.Length);
+                stream.Write(buffer, offset, buffer.Length - offset);
             }
             catch (Exception)
             {
@@ -288,6 +398,7 @@ namespace Oxygen
         }
 
         const int INCOMING_HEADER_SIZE = 8;
+        const int MAX_FRAME_SIZE = 64 * 1024 * 1024;
 
         private void ClientReadThread(object? state)
         {
@@ -296,7 +407,7 @@ namespace Oxygen
             if (cli != null)
             {
                 cli.MsgHandle.AddRef();
-                var stream = cli.Connection.GetStream();
+                var stream = cli.Stream;
 
                 byte[] buffer = new byte[2048 * 32];
                 while (cli.Running)
@@ -314,17 +425,26 @@ namespace Oxygen
                         //}
                         //Log(bufferString);
 
-                        int len = buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | (buffer[3] << 24);
+                        uint length = BinaryPrimitives.ReadUInt32LittleEndian(buffer);
+                        bool compressed = (length & FrameCompression.CompressedFrame) != 0;
+                        int len = (int)(length & ~FrameCompression.CompressedFrame);
                         int id = buffer[4] | (buffer[5] << 8) | (buffer[6] << 16) | (buffer[7] << 24);
-                        index -= INCOMING_HEADER_SIZE;
-                        if (index <= len && len <= buffer.Length)
+
+                        if (len > MAX_FRAME_SIZE)
                         {
-                            Array.Copy(buffer, INCOMING_HEADER_SIZE, buffer, 0, len - INCOMING_HEADER_SIZE);
+                            Log("Client {0} sent a frame of {1} bytes", cli.Client.ID, len);
+                            OnDisconnect(cli);
+                            break;
+                        }
 
-                            index = ReadFromStream(cli, stream, buffer, index, len - index);
-                            //Log($"Index {index}");
+                        if (len > buffer.Length)
+                        {
+                            buffer = new byte[len];
                         }
 
+                        index = ReadFromStream(cli, stream, buffer, 0, len);
+                        //Log($"Index {index}");
+
                         if (index > 0)
                         {
                             //string bufferString = string.Empty;
@@ -336,11 +456,45 @@ namespace Oxygen
 
                             //Log(bufferString);
 
-                            byte[] copy = new byte[len];
-                            Array.Copy(buffer, copy, len);
+                            byte[]? copy;
+                            if (compressed)
+                            {
+                                copy = cli.Decompressor?.Decompress(buffer.AsSpan(0, len));
+                                if (copy == null)
+                                {
+                                    // Without the frame the rest of the compressed stream can not be followed.
+                                    Log("Client {0} sent a malformed compressed frame", cli.Client.ID);
+                                    OnDisconnect(cli);
+                                    break;
+                                }
+
+                                len = copy.Length;
+                            }
+                            else
+                            {
+                                copy = new byte[len];
+                                Array.Copy(buffer, copy, len);
+                            }
+
+                            Message msg;
+                            try
+                            {
+                                msg = new Message(copy, cli.Routes);
+                            }
+                            catch (Exception e)
+                            {
+                                Log("Dropped message: {0}", e.Message);
+                                continue;
+                            }
 
-                            Message msg = new Message(copy);
                             msg.Id = id;
+
+                            if (msg.NodeName == "CONNECTION" && msg.MessageName == "NEGOTIATE")
+                            {
+                                Negotiate(cli, msg);
+                                continue;
+                            }
+
                             Request request = new Request(msg, cli.Client);
 
                             string name = msg.NodeName;
@@ -351,11 +505,56 @@ namespace Oxygen
                     }
                 }
 
+                // Closing the stream also ends a write in progress.
+                stream.Dispose();
+
                 cli.ExitClientThread();
                 Log("Client disconnected");
             }
         }
 
+        private void Negotiate(ClientConnection cli, Message msg)
+        {
+            // The handshake is answered here so the nodes only ever see named messages.
+            cli.Routes = RouteTable.Read(msg);
+
+            // Older clients do not send the schemas.
+            if (msg.Position < msg.Length)
+            {
+                int numSchemas = msg.ReadInt();
+                for (int i = 0; i < numSchemas; i++)
+                {
+                    string name = msg.ReadString();
+                    uint hash = (uint)msg.ReadInt();
+                    if (!Schema.Verify(name, hash))
+                    {
+                        Log("Client {0} has a mismatched {1} schema", cli.Client.ID, name);
+                    }
+                }
+            }
+
+            // Then the capabilities, the reply holds those accepted.
+            int capabilities = msg.Position < msg.Length ? msg.ReadInt() : 0;
+            int accepted = this.CompressFrames ? capabilities & FrameCompression.CapabilityCompression : 0;
+
+            bool compress = (accepted & FrameCompression.CapabilityCompression) != 0;
+            if (compress)
+            {
+                cli.Decompressor = new FrameDecompressor();
+            }
+
+            Message response = Response.Ack("CONNECTION", "NEGOTIATE");
+            response.WriteInt(accepted);
+            response.Id = msg.Id;
+            cli.Client.Send(response);
+
+            // The client decompresses any frame which is flagged, so the reply itself may be compressed.
+            if (compress)
+            {
+                cli.Compressor = new FrameCompressor();
+            }
+        }
+
         private void ClientWriteThread(object? state)
         {
             var cli = state as ClientConnection;
@@ -363,7 +562,7 @@ namespace Oxygen
             if (cli != null)
             {
                 cli.MsgHandle.AddRef();
-                var stream = cli.Connection.GetStream();
+                var stream = cli.Stream;
                 var messages = cli.Messages;
 
                 while (cli.Running)
@@ -383,9 +582,21 @@ namespace Oxygen
                         }
                         byte[] payload = response.GetData();
 
-                        int payloadSize = payload.Length;
+                        // Known pairs are sent to a negotiated client as the route id instead of the names.
+                        int route = 0;
+                        bool compact = cli.Routes != null && cli.Routes.TryGetRoute(response.NodeName, response.MessageName, out route);
+                        int offset = compact ? response.NamesLength : 0;
+
+                        int payloadSize = payload.Length - offset + (compact ? 4 : 0);
                         int id = response.Id;
 
+                        FrameCompressor? compressor = cli.Compressor;
+                        if (compressor != null && payloadSize >= this.CompressionThreshold)
+                        {
+                            WriteCompressed(cli, stream, compressor, response, payload, compact ? route : -1, offset, id);
+                            continue;
+                        }
+
                         WriteToStream(cli, stream, new byte[]
                         {
                             (byte)(payloadSize & 0xFF),
@@ -400,7 +611,18 @@ namespace Oxygen
                             (byte)((id >> 16) & 0xFF),
                             (byte)((id >> 24) & 0xFF)
                         });
-                        WriteToStream(cli, stream, payload);
+                        if (compact)
+                        {
+                            int value = -route - 1;
+                            WriteToStream(cli, stream, new byte[]
+                            {
+                                (byte)(value & 0xFF),
+                                (byte)((value >> 8) & 0xFF),
+                                (byte)((value >> 16) & 0xFF),
+                                (byte)((value >> 24) & 0xFF)
+                            });
+                        }
+                        WriteToStream(cli, stream, payload, offset);
                     }
                 }
 
@@ -408,6 +630,58 @@ namespace Oxygen
             }
         }
 
+        private void WriteCompressed(ClientConnection cli, Stream stream, FrameCompressor compressor, Message response, byte[] payload, int route, int offset, int id)
+        {
+            byte[] raw = payload;
+            if (route >= 0)
+            {
+                raw = new byte[payload.Length - offset + 4];
+                BinaryPrimitives.WriteInt32LittleEndian(raw, -route - 1);
+                Array.Copy(payload, offset, raw, 4, payload.Length - offset);
+            }
+
+            byte[] compressed = compressor.Compress(raw);
+            RecordCompression(response, raw.Length, compressed.Length);
+
+            byte[] header = new byte[8];
+            BinaryPrimitives.WriteUInt32LittleEndian(header, (uint)compressed.Length | FrameCompression.CompressedFrame);
+            BinaryPrimitives.WriteInt32LittleEndian(header.AsSpan(4), id);
+
+            WriteToStream(cli, stream, header);
+            WriteToStream(cli, stream, compressed);
+        }
+
+        private void StartClient(Stream stream, string address)
+        {
+            var msgs = new Queue<Message>();
+            var handle = new ClientWaitHandle(false, EventResetMode.AutoReset);
+            var msgLock = new object();
+            ClientConnection cli = new ClientConnection(stream,
+                new Client(msgs, msgLock, handle, Interlocked.Increment(ref clientID) - 1),
+                handle,
+                msgLock,
+                msgs)
+            {
+                Running = true
+            };
+
+            Log("Client connected {0}", address);
+
+            var read = new Thread(ClientReadThread);
+            read.Name = "ReadThread";
+
+            var write = new Thread(ClientWriteThread);
+            write.Name = "WriteThread";
+
+            lock (clientLock)
+            {
+                this.clients.Add(cli);
+            }
+
+            read.Start(cli);
+            write.Start(cli);
+        }
+
         private void Listen()
         {
             var listener = TcpListener.Create(this.port);
@@ -421,44 +695,109 @@ namespace Oxygen
                 throw new ServerException("Failed to start the TcpListener.", ex);
             }
 
-            long clientID = 0;
             while (this.running)
             {
                 TcpClient client = listener.AcceptTcpClient();
-                var msgs = new Queue<Message>();
-                var handle = new ClientWaitHandle(false, EventResetMode.AutoReset);
-                var msgLock = new object();
-                ClientConnection cli = new ClientConnection(client,
-                    new Client(msgs, msgLock, handle, clientID++),
-                    handle,
-                    msgLock,
-                    msgs)
-                {
-                    Running = true
-                };
-
                 string address = client.Client.LocalEndPoint?.ToString() ?? "Unknown";
 
-                Log("Client connected {0}", address);
-
                 client.GetStream().ReadTimeout = 60000;
 
-                var read = new Thread(ClientReadThread);
-                read.Name = "ReadThread";
+                StartClient(client.GetStream(), address);
+            }
+
+            listener.Stop();
+        }
+
+        private Socket BindUnixSocket(string path)
+        {
+            // A lock file next to the socket is held while the server runs and records when the
+            // socket was bound. A file at the path last written then is the socket a previous run
+            // left behind, which would fail the bind, so it is removed. Any other file is left and
+            // the bind fails.
+            FileStream lockFile;
+            try
+            {
+                lockFile = new FileStream(path + ".lock", FileMode.OpenOrCreate, FileAccess.ReadWrite, FileShare.None);
+            }
+            catch (IOException ex)
+            {
+                throw new ServerException($"{path} is in use by another server.", ex);
+            }
+            this.unixSocketLocks.Add(lockFile);
+
+            if (lockFile.Length == sizeof(long))
+            {
+                byte[] bound = new byte[sizeof(long)];
+                lockFile.ReadExactly(bound);
+                if (File.Exists(path) && File.GetLastWriteTimeUtc(path).Ticks == BitConverter.ToInt64(bound) && !IsListening(path))
+                {
+                    File.Delete(path);
+                }
+            }
 
-                var write = new Thread(ClientWriteThread);
-                write.Name = "WriteThread";
+            var socket = new Socket(AddressFamily.Unix, SocketType.Stream, ProtocolType.Unspecified);
+            try
+            {
+                socket.Bind(new UnixDomainSocketEndPoint(path));
+                socket.Listen(100);
+            }
+            catch (SocketException ex)
+            {
+                socket.Dispose();
+                throw new ServerException($"Failed to listen on {path}.", ex);
+            }
+
+            lockFile.SetLength(0);
+            lockFile.Write(BitConverter.GetBytes(File.GetLastWriteTimeUtc(path).Ticks));
+            lockFile.Flush();
+
+            Log("Listening on {0}", path);
+            return socket;
+        }
 
-                lock (clientLock)
+        private static bool IsListening(string path)
+        {
+            using (var probe = new Socket(AddressFamily.Unix, SocketType.Stream, ProtocolType.Unspecified))
+            {
+                try
+                {
+                    probe.Connect(new UnixDomainSocketEndPoint(path));
+                    return true;
+                }
+                catch (SocketException)
                 {
-                    this.clients.Add(cli);
+                    return false;
                 }
+            }
+        }
 
-                read.Start(cli);
-                write.Start(cli);
+        private void ListenUnix(object? state)
+        {
+            var listener = (Socket)state!;
+            while (this.running)
+            {
+                Socket socket = listener.Accept();
+                StartClient(new NetworkStream(socket, true), "unix");
             }
+        }
 
-            listener.Stop();
+        private void ListenSharedMemory(object? state)
+        {
+            var listener = (Socket)state!;
+            while (this.running)
+            {
+                Socket socket = listener.Accept();
+
+                // The handshake waits on the client, so it is kept off the accept loop.
+                new Thread(() =>
+                {
+                    var stream = SharedMemoryStream.Accept(socket);
+                    if (stream != null)
+                    {
+                        StartClient(stream, "shm");
+                    }
+                }).Start();
+            }
         }
 
         private void EventQueue()
@@ -523,6 +862,20 @@ namespace Oxygen
             ev.Name = "EventQueue";
             ev.Start();
 
+            foreach (string path in this.unixSocketPaths)
+            {
+                var listen = new Thread(ListenUnix);
+                listen.Name = "UnixListener";
+                listen.Start(BindUnixSocket(path));
+            }
+
+            foreach (string path in this.sharedMemorySocketPaths)
+            {
+                var listen = new Thread(ListenSharedMemory);
+                listen.Name = "SharedMemoryListener";
+                listen.Start(BindUnixSocket(path));
+            }
+
             this.Listen();
         }
     }
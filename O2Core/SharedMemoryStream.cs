@@ -0,0 +1,302 @@
+﻿using System.IO.MemoryMappedFiles;
+using System.Net.Sockets;
+using System.Text;
+
+namespace Oxygen
+{
+    /// <summary>
+    /// The server end of a shm:// connection. The client asks over a Unix socket for rings of a
+    /// capacity, one for each direction, and the server creates a file holding them and sends
+    /// back its path. The socket then only carries doorbells, a byte sent when the other side is
+    /// waiting for data. The layout is described in libOxygen/Transport.cpp.
+    /// </summary>
+    internal class SharedMemoryStream : Stream
+    {
+        private const uint Magic = 0x4D53584F;
+        private const uint Version = 2;
+        private const int FileHeaderSize = 64;
+        private const int RingHeaderSize = 256;
+        private const int HeadOffset = 0;
+        private const int TailOffset = 64;
+        private const int WaitingOffset = 128;
+        private const long MaxCapacity = 1 << 30;
+        private const int HandshakeTimeoutMs = 5000;
+
+        private static int counter;
+
+        private readonly Socket socket;
+        private readonly MemoryMappedFile file;
+        private readonly MemoryMappedViewAccessor view;
+        private readonly long capacity;
+        private readonly long inRing;
+        private readonly long outRing;
+        private readonly byte[] doorbells = new byte[64];
+        private readonly byte[] doorbell = new byte[] { 1 };
+        private volatile bool closed;
+
+        private SharedMemoryStream(Socket socket, MemoryMappedFile file, MemoryMappedViewAccessor view, long capacity)
+        {
+            this.socket = socket;
+            this.file = file;
+            this.view = view;
+            this.capacity = capacity;
+            this.inRing = FileHeaderSize;
+            this.outRing = FileHeaderSize + RingHeaderSize + capacity;
+        }
+
+        /// <summary>
+        /// Completes the handshake on an accepted socket, returns null if it fails.
+        /// </summary>
+        public static SharedMemoryStream? Accept(Socket socket)
+        {
+            string? path = null;
+            FileStream? stream = null;
+            MemoryMappedFile? file = null;
+            MemoryMappedViewAccessor? view = null;
+            try
+            {
+                socket.ReceiveTimeout = HandshakeTimeoutMs;
+
+                byte[] header = ReceiveAll(socket, 12);
+                uint magic = BitConverter.ToUInt32(header, 0);
+                uint version = BitConverter.ToUInt32(header, 4);
+                long capacity = BitConverter.ToUInt32(header, 8);
+                if (magic != Magic || version != Version ||
+                    capacity == 0 || (capacity & (capacity - 1)) != 0 || capacity > MaxCapacity)
+                {
+                    throw new InvalidDataException("Malformed shared memory handshake.");
+                }
+
+                // The file is created by the server, so no path a client sends is ever mapped. Only
+                // the server's user can open it, and it is removed once the client has mapped it.
+                path = Path.Combine(SharedMemoryDirectory(), $"oxygen-server-{Environment.ProcessId}-{Interlocked.Increment(ref counter)}");
+                var options = new FileStreamOptions
+                {
+                    Mode = FileMode.CreateNew,
+                    Access = FileAccess.ReadWrite,
+                    Share = FileShare.ReadWrite,
+                    UnixCreateMode = UnixFileMode.UserRead | UnixFileMode.UserWrite
+                };
+                stream = new FileStream(path, options);
+                file = MemoryMappedFile.CreateFromFile(stream, null, FileHeaderSize + 2 * (RingHeaderSize + capacity),
+                    MemoryMappedFileAccess.ReadWrite, HandleInheritability.None, false);
+                view = file.CreateViewAccessor(0, 0, MemoryMappedFileAccess.ReadWrite);
+
+                view.Write(0, Magic);
+                view.Write(4, Version);
+                view.Write(8, (uint)capacity);
+
+                // Both consumers start out waiting, so the first frame each way rings the doorbell.
+                view.Write(FileHeaderSize + WaitingOffset, 1);
+                view.Write(FileHeaderSize + RingHeaderSize + capacity + WaitingOffset, 1);
+
+                byte[] name = Encoding.UTF8.GetBytes(path);
+                byte[] reply = new byte[5 + name.Length];
+                reply[0] = 1;
+                BitConverter.GetBytes(name.Length).CopyTo(reply, 1);
+                name.CopyTo(reply, 5);
+                socket.Send(reply);
+
+                if (ReceiveAll(socket, 1)[0] != 1)
+                {
+                    throw new InvalidDataException("The client failed to map the shared memory file.");
+                }
+                File.Delete(path);
+
+                socket.ReceiveTimeout = 0;
+                return new SharedMemoryStream(socket, file, view, capacity);
+            }
+            catch (Exception e)
+            {
+                Logger.Instance.Log("Shared memory handshake failed: {0}", e.Message);
+
+                view?.Dispose();
+                file?.Dispose();
+                stream?.Dispose();
+                if (path != null)
+                {
+                    try
+                    {
+                        File.Delete(path);
+                    }
+                    catch (Exception)
+                    {
+                    }
+                }
+                try
+                {
+                    socket.Send(new byte[] { 0 });
+                }
+                catch (Exception)
+                {
+                }
+                socket.Dispose();
+                return null;
+            }
+        }
+
+        private static string SharedMemoryDirectory()
+        {
+            // Prefer the memory backed file system, the file never needs to reach a disk.
+            return Directory.Exists("/dev/shm") ? "/dev/shm" : Path.GetTempPath();
+        }
+
+        private static byte[] ReceiveAll(Socket socket, int size)
+        {
+            byte[] data = new byte[size];
+            int index = 0;
+            while (index < size)
+            {
+                int count = socket.Receive(data, index, size - index, SocketFlags.None);
+                if (count == 0)
+                {
+                    throw new EndOfStreamException();
+                }
+                index += count;
+            }
+            return data;
+        }
+
+        public override bool CanRead => true;
+        public override bool CanSeek => false;
+        public override bool CanWrite => true;
+        public override long Length => throw new NotSupportedException();
+        public override long Position { get => throw new NotSupportedException(); set => throw new NotSupportedException(); }
+
+        public override void Flush()
+        {
+        }
+
+        public override long Seek(long offset, SeekOrigin origin) => throw new NotSupportedException();
+        public override void SetLength(long value) => throw new NotSupportedException();
+
+        public override int Read(byte[] buffer, int offset, int count)
+        {
+            while (true)
+            {
+                int read = ReadRing(buffer, offset, count);
+                if (read > 0 || this.closed)
+                {
+                    return read;
+                }
+
+                // Flagged before the final check, the client checks the flag after publishing.
+                this.view.Write(this.inRing + WaitingOffset, 1);
+                Interlocked.MemoryBarrier();
+
+                read = ReadRing(buffer, offset, count);
+                if (read > 0)
+                {
+                    return read;
+                }
+
+                int received;
+                try
+                {
+                    received = this.socket.Receive(this.doorbells);
+                }
+                catch (Exception e) when (e is SocketException || e is ObjectDisposedException)
+                {
+                    received = 0;
+                }
+
+                if (received == 0)
+                {
+                    // Anything written before the client closed is still read.
+                    this.closed = true;
+                }
+            }
+        }
+
+        public override void Write(byte[] buffer, int offset, int count)
+        {
+            while (count > 0)
+            {
+                if (this.closed)
+                {
+                    throw new IOException("The shared memory connection has closed.");
+                }
+
+                int written = WriteRing(buffer, offset, count);
+                if (written == 0)
+                {
+                    // The client does not signal space, the ring is large enough that polling is rare.
+                    Thread.Sleep(1);
+                    continue;
+                }
+
+                offset += written;
+                count -= written;
+
+                Interlocked.MemoryBarrier();
+                if (this.view.ReadInt32(this.outRing + WaitingOffset) != 0)
+                {
+                    this.view.Write(this.outRing + WaitingOffset, 0);
+                    try
+                    {
+                        this.socket.Send(this.doorbell);
+                    }
+                    catch (Exception e) when (e is SocketException || e is ObjectDisposedException)
+                    {
+                        this.closed = true;
+                    }
+                }
+            }
+        }
+
+        private int ReadRing(byte[] buffer, int offset, int count)
+        {
+            long head = this.view.ReadInt64(this.inRing + HeadOffset);
+            long tail = this.view.ReadInt64(this.inRing + TailOffset);
+            Interlocked.MemoryBarrier();
+
+            int available = (int)Math.Min(count, tail - head);
+            if (available > 0)
+            {
+                long start = head & (this.capacity - 1);
+                int first = (int)Math.Min(available, this.capacity - start);
+                long data = this.inRing + RingHeaderSize;
+                this.view.ReadArray(data + start, buffer, offset, first);
+                this.view.ReadArray(data, buffer, offset + first, available - first);
+
+                Interlocked.MemoryBarrier();
+                this.view.Write(this.inRing + HeadOffset, head + available);
+            }
+            return Math.Max(available, 0);
+        }
+
+        private int WriteRing(byte[] buffer, int offset, int count)
+        {
+            long tail = this.view.ReadInt64(this.outRing + TailOffset);
+            long head = this.view.ReadInt64(this.outRing + HeadOffset);
+            Interlocked.MemoryBarrier();
+
+            int space = (int)Math.Min(count, this.capacity - (tail - head));
+            if (space > 0)
+            {
+                long start = tail & (this.capacity - 1);
+                int first = (int)Math.Min(space, this.capacity - start);
+                long data = this.outRing + RingHeaderSize;
+                this.view.WriteArray(data + start, buffer, offset, first);
+                this.view.WriteArray(data, buffer, offset + first, space - first);
+
+                Interlocked.MemoryBarrier();
+                this.view.Write(this.outRing + TailOffset, tail + space);
+            }
+            return Math.Max(space, 0);
+        }
+
+        protected override void Dispose(bool disposing)
+        {
+            if (disposing)
+            {
+                this.closed = true;
+                this.socket.Dispose();
+                this.view.Dispose();
+                this.file.Dispose();
+            }
+
+            base.Dispose(disposing);
+        }
+    }
+}
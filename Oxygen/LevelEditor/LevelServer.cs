@@ -14,6 +14,10 @@ namespace Oxygen
             : base("LEVEL_SVR")
         {
             Level.LoadLevels();
+
+            // The object header layouts as written by LevelObject.Serialize.
+            Schema.Register("OBJECT", (Schema.Int32, 1), (Schema.Double, 3), (Schema.Double, 3), (Schema.Double, 3), (Schema.Int32, 1));
+            Schema.Register("OBJECT_ADD", (Schema.Double, 3), (Schema.Double, 3), (Schema.Double, 3), (Schema.Int32, 1));
         }
 
         public override void OnClientDisconnected(Client client)
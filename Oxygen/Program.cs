@@ -6,7 +6,14 @@ namespace Oxygen
     {
         static void Main(string[] args)
         {
-            if (args.Length == 0)
+            var unixPaths = new List<string>();
+            var sharedMemoryPaths = new List<string>();
+
+            if (args.Length == 1 && args[0] == "setup")
+            {
+                Setup.Install();
+            }
+            else if (ParseListeners(args, unixPaths, sharedMemoryPaths))
             {
                 Console.WriteLine("Starting server!");
 
@@ -14,6 +21,22 @@ namespace Oxygen
                 Authorizer.LoadAuthorizationData();
 
                 Server server = new Server(9888);
+                if (OperatingSystem.IsWindows() && unixPaths.Count + sharedMemoryPaths.Count > 0)
+                {
+                    Console.WriteLine("Unix socket and shared memory listeners are not supported on Windows.");
+                }
+                else
+                {
+                    // Same-host clients can skip the TCP stack with unix:// or shm:// URLs.
+                    foreach (string path in unixPaths)
+                    {
+                        server.AddUnixListener(path);
+                    }
+                    foreach (string path in sharedMemoryPaths)
+                    {
+                        server.AddSharedMemoryListener(path);
+                    }
+                }
                 server.AddNode(new AssetServer());
                 server.AddNode(new LoginServer());
                 server.AddNode(new LevelServer());
@@ -31,13 +54,38 @@ namespace Oxygen
                     Console.WriteLine(ex.Message);
                 }
             }
-            else if (args.Length == 1)
+            else
             {
-                if (args[0] == "setup")
+                Console.WriteLine("Usage: Oxygen setup");
+                Console.WriteLine("       Oxygen [--unix <socket path>] [--shm <socket path>]");
+            }
+        }
+
+        /// <summary>
+        /// The same-host listeners are only added when asked for, each option may be repeated.
+        /// </summary>
+        private static bool ParseListeners(string[] args, List<string> unixPaths, List<string> sharedMemoryPaths)
+        {
+            for (int i = 0; i < args.Length; i += 2)
+            {
+                if (i + 1 == args.Length)
+                {
+                    return false;
+                }
+
+                switch (args[i])
                 {
-                    Setup.Install();
+                    case "--unix":
+                        unixPaths.Add(args[i + 1]);
+                        break;
+                    case "--shm":
+                        sharedMemoryPaths.Add(args[i + 1]);
+                        break;
+                    default:
+                        return false;
                 }
             }
+            return true;
         }
     }
 }
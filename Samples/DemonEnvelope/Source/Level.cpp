@@ -1,5 +1,6 @@
 #include "Level.h"
 #include "Message.h"
+#include "Schema.h"
 #include "DeltaCompress.h"
 #include <iostream>
 
@@ -47,18 +48,22 @@ NPCObject::NPCObject()
 {
 }
 
+namespace DE
+{
+    struct NPCSchema
+    {
+        using Type = Oxygen::Schema<"NPC", &NPCObject::_px, &NPCObject::_py, &NPCObject::_spriteId>;
+    };
+}
+
 void NPCObject::Serialize(Oxygen::Message& msg)
 {
-    msg.WriteInt32(_px);
-    msg.WriteInt32(_py);
-    msg.WriteInt32(_spriteId);
+    NPCSchema::Type::Write(msg, *this);
 }
 
 void NPCObject::Deserialize(Oxygen::Message& msg)
 {
-    _px = msg.ReadInt32();
-    _py = msg.ReadInt32();
-    _spriteId = msg.ReadInt32();
+    NPCSchema::Type::Read(msg, *this);
 }
 
 //==================
@@ -53,6 +53,8 @@ namespace DE
         void Deserialize(Oxygen::Message& msg);
 
     private:
+        friend struct NPCSchema;
+
         int _id;
         int _version;
         int _px;
@@ -5,6 +5,8 @@
 #include "DeltaCompress.h"
 #include "EventStream.h"
 #include "ObjectStream.h"
+#include "AsyncRequest.h"
+#include <cstring>
 #include <unordered_map>
 #include <iostream>
 
@@ -156,7 +158,7 @@ void Network::DeleteLevel(const std::string& name)
         Oxygen::Message request("LEVEL_SVR", "DELETE_LEVEL");
         request.WriteString(name);
 
-        SendMsg(request);
+        SendMsg(std::move(request));
     }
 }
 
@@ -291,16 +293,7 @@ void Network::CreateTilemap(int width, int height, int numLayers)
 
         levelSub->PrepareAddMessage(&msg, obj);
 
-        std::shared_ptr<Oxygen::Subscriber> sub = std::shared_ptr<Oxygen::Subscriber>(new Oxygen::Subscriber(msg));
-        sub->Signal([this, sub2 = std::shared_ptr<Oxygen::Subscriber>(sub)](Oxygen::Message& response) {
-            if (response.ReadString() == "NACK")
-            {
-                std::cout << response.ReadInt32() << " " << response.ReadString() << std::endl;
-            }
-
-            conn->RemoveSubscriber(sub2);
-            });
-        conn->AddSubscriber(sub);
+        SendMsg(std::move(msg));
     }
 
     for (int i = 0; i < numLayers; i++)
@@ -313,16 +306,7 @@ void Network::CreateTilemap(int width, int height, int numLayers)
 
         levelSub->PrepareAddMessage(&msg, obj);
 
-        std::shared_ptr<Oxygen::Subscriber> sub = std::shared_ptr<Oxygen::Subscriber>(new Oxygen::Subscriber(msg));
-        sub->Signal([this, sub2 = std::shared_ptr<Oxygen::Subscriber>(sub)](Oxygen::Message& response) {
-            if (response.ReadString() == "NACK")
-            {
-                std::cout << response.ReadInt32() << " " << response.ReadString() << std::endl;
-            }
-
-            conn->RemoveSubscriber(sub2);
-            });
-        conn->AddSubscriber(sub);
+        SendMsg(std::move(msg));
     }
 
     {
@@ -333,16 +317,7 @@ void Network::CreateTilemap(int width, int height, int numLayers)
 
         levelSub->PrepareAddMessage(&msg, obj);
 
-        std::shared_ptr<Oxygen::Subscriber> sub = std::shared_ptr<Oxygen::Subscriber>(new Oxygen::Subscriber(msg));
-        sub->Signal([this, sub2 = std::shared_ptr<Oxygen::Subscriber>(sub)](Oxygen::Message& response) {
-            if (response.ReadString() == "NACK")
-            {
-                std::cout << response.ReadInt32() << " " << response.ReadString() << std::endl;
-            }
-
-            conn->RemoveSubscriber(sub2);
-            });
-        conn->AddSubscriber(sub);
+        SendMsg(std::move(msg));
     }
 }
 
@@ -362,7 +337,7 @@ void Network::UpdateTilemask(const Tilemap_Mask& mask)
     SendUpdateMsg(msg, obj);
 }
 
-void Network::UpdateTilemap(const Tilemap_Layer& layer)
+void Network::UpdateTilemap(Tilemap_Layer& layer)
 {
     Oxygen::Object obj = {};
     obj.id = layer.ID();
@@ -371,6 +346,18 @@ void Network::UpdateTilemap(const Tilemap_Layer& layer)
     obj.scale[1] = 1.0;
     obj.scale[2] = 1.0;
 
+    // Painting only sends the cells which changed, the layer follows the name and the layer index.
+    const int layerOffset = 4 + int(std::strlen("TILEMAP_LAYER")) + 4;
+    std::vector<Oxygen::DeltaRange> ranges;
+    layer.CollectDirtyRanges(layerOffset, ranges);
+
+    Oxygen::Message update("LEVEL_SVR", "UPDATE_OBJECT");
+    if (!ranges.empty() && levelSub->PrepareUpdateMessage(&update, obj, ranges.data(), int(ranges.size())))
+    {
+        SendMsg(std::move(update));
+        return;
+    }
+
     Oxygen::Message msg = levelSub->BuildUpdateMessage(obj);
     msg.WriteString("TILEMAP_LAYER");
     msg.WriteInt32(layer.Layer());
@@ -397,7 +384,7 @@ void Network::CreateNPC(int parentId, int x, int y)
 
         levelSub->PrepareAddMessage(&msg, obj);
 
-        SendMsg(msg);
+        SendMsg(std::move(msg));
     }
 }
 
@@ -421,7 +408,7 @@ void Network::DeleteNPC(int id)
 {
     Oxygen::Message msg = Oxygen::Message("LEVEL_SVR", "DELETE_OBJECT");
     msg.WriteInt32(id);
-    SendMsg(msg);
+    SendMsg(std::move(msg));
 }
 
 void Network::CreateScript(int parentId, int x, int y)
@@ -443,16 +430,7 @@ void Network::CreateScript(int parentId, int x, int y)
 
         levelSub->PrepareAddMessage(&msg, obj);
 
-        std::shared_ptr<Oxygen::Subscriber> sub = std::shared_ptr<Oxygen::Subscriber>(new Oxygen::Subscriber(msg));
-        sub->Signal([this, sub2 = std::shared_ptr<Oxygen::Subscriber>(sub)](Oxygen::Message& response) {
-            if (response.ReadString() == "NACK")
-            {
-                std::cout << response.ReadInt32() << " " << response.ReadString() << std::endl;
-            }
-
-            conn->RemoveSubscriber(sub2);
-            });
-        conn->AddSubscriber(sub);
+        SendMsg(std::move(msg));
     }
 }
 
@@ -476,7 +454,7 @@ void Network::DeleteObject(int id)
 {
     Oxygen::Message msg = Oxygen::Message("LEVEL_SVR", "DELETE_OBJECT");
     msg.WriteInt32(id);
-    SendMsg(msg);
+    SendMsg(std::move(msg));
 }
 
 void Network::UpdateCursor(int objectId, int subID)
@@ -485,37 +463,29 @@ void Network::UpdateCursor(int objectId, int subID)
     msg.WriteInt32(objectId);
     msg.WriteInt32(subID);
 
-    std::shared_ptr<Oxygen::Subscriber> sub = std::shared_ptr<Oxygen::Subscriber>(new Oxygen::Subscriber(msg));
-    sub->Signal([this, sub2 = std::shared_ptr<Oxygen::Subscriber>(sub)](Oxygen::Message& response) {
-        if (response.ReadString() == "NACK")
-        {
-            std::cout << response.ReadInt32() << " " << response.ReadString() << std::endl;
-        }
+    // Only the latest cursor position matters.
+    msg.CoalesceBy(objectId);
 
-        conn->RemoveSubscriber(sub2);
-        });
-    conn->AddSubscriber(sub);
+    SendMsg(std::move(msg));
 }
 
-void Network::SendMsg(Oxygen::Message& msg)
+Oxygen::Task<void> Network::SendMsg(Oxygen::Message msg)
 {
-    std::shared_ptr<Oxygen::Subscriber> sub = std::shared_ptr<Oxygen::Subscriber>(new Oxygen::Subscriber(msg));
-    sub->Signal([this, sub2 = std::shared_ptr<Oxygen::Subscriber>(sub)](Oxygen::Message& response) {
-        if (response.ReadString() == "NACK")
-        {
-            std::cout << response.ReadInt32() << " " << response.ReadString() << std::endl;
-        }
-
-        conn->RemoveSubscriber(sub2);
-        });
-    conn->AddSubscriber(sub);
+    // The message is moved into the request rather than copying the serialized object. Cursor
+    // and object updates are coalesced, a superseded one completes without a reply.
+    Oxygen::Response response = co_await conn->Request(std::move(msg));
+    if (response.Completed() && response.Reply().ReadString() == "NACK")
+    {
+        Oxygen::Message& reply = response.Reply();
+        std::cout << reply.ReadInt32() << " " << reply.ReadString() << std::endl;
+    }
 }
 
 void Network::SendUpdateMsg(Oxygen::Message& msg, Oxygen::Object& obj)
 {
     levelSub->PrepareUpdateMessage(&msg, obj);
 
-    SendMsg(msg);
+    SendMsg(std::move(msg));
 }
 
 bool Network::Connected()
@@ -534,6 +504,9 @@ void Network::Process()
 
     if (conn)
     {
-        conn->Process(false);
+        // Called once per frame, a burst of updates is spread over the following frames.
+        Oxygen::ProcessBudget budget;
+        budget.maxTime = std::chrono::milliseconds(2);
+        conn->Process(std::chrono::milliseconds(0), budget);
     }
 }
@@ -49,7 +49,7 @@ namespace DE
         void CloseLevel();
         void ListLevels(std::vector<std::string>& levels);
         void CreateTilemap(int width, int height, int numLayers);
-        void UpdateTilemap(const Tilemap_Layer& layer);
+        void UpdateTilemap(Tilemap_Layer& layer);
         void UpdateTilemask(const Tilemap_Mask& mask);
         void UpdateCursor(int objectId, int subID);
         void CreateNPC(int parentId, int x, int y);
@@ -74,7 +74,7 @@ namespace DE
     private:
 
         void OnLevelLoaded(std::shared_ptr<Level>& level);
-        void SendMsg(Oxygen::Message& msg);
+        Oxygen::Task<void> SendMsg(Oxygen::Message msg);
         void SendUpdateMsg(Oxygen::Message& msg, Oxygen::Object& obj);
 
         Oxygen::ClientConnection* conn;
@@ -1,6 +1,7 @@
 #include "Scripting.h"
 #include "imgui.h"
 #include "Message.h"
+#include "Schema.h"
 #include "Sun.h"
 #include "Level.h"
 #include <functional>
@@ -341,22 +342,24 @@ ScriptObject::ScriptObject(int id)
 {
 }
 
+namespace DE
+{
+    // The script name follows the fixed size fields.
+    struct ScriptSchema
+    {
+        using Type = Oxygen::Schema<"SCRIPT", &ScriptObject::_trigger, &ScriptObject::_px, &ScriptObject::_py, &ScriptObject::_parentId>;
+    };
+}
+
 void ScriptObject::Deserialize(Oxygen::Message& msg)
 {
-    const int scriptTriggerType = msg.ReadInt32();
-    _trigger = (ScriptTrigger)scriptTriggerType;
-    _px = msg.ReadInt32();
-    _py = msg.ReadInt32();
-    _parentId = msg.ReadInt32();
+    ScriptSchema::Type::Read(msg, *this);
     _scriptName = msg.ReadString();
 }
 
 void ScriptObject::Serialize(Oxygen::Message& msg)
 {
-    msg.WriteInt32((int)_trigger);
-    msg.WriteInt32(_px);
-    msg.WriteInt32(_py);
-    msg.WriteInt32(_parentId);
+    ScriptSchema::Type::Write(msg, *this);
     msg.WriteString(_scriptName);
 }
 
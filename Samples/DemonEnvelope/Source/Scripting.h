@@ -154,6 +154,8 @@ namespace DE
         inline bool IsTriggered() { return _isTriggered; }
 
     private:
+        friend struct ScriptSchema;
+
         bool _isTriggered;
         int _version;
         int _id;
@@ -1,5 +1,7 @@
 #include "Tilemap.h"
 #include "Message.h"
+#include "DeltaCompress.h"
+#include <bit>
 
 #include <iostream>
 
@@ -92,11 +94,38 @@ void Tilemap_Layer::Load(const int layer, const int width, const int height)
 
     _tiles = new int[numTiles];
     std::memset(_tiles, 0, sizeof(int) * numTiles);
+
+    _dirty.assign((numTiles + 63) / 64, 0);
 }
 
 void Tilemap_Layer::Set(int cell, int tile)
 {
     _tiles[cell] = tile;
+    _dirty[cell / 64] |= std::uint64_t(1) << (cell % 64);
+}
+
+void Tilemap_Layer::CollectDirtyRanges(int offset, std::vector<Oxygen::DeltaRange>& ranges)
+{
+    // The tiles follow the width, height and byte count written by Serialize.
+    const int tilesOffset = offset + 12;
+
+    const int numWords = int(_dirty.size());
+    for (int word = 0; word < numWords; word++)
+    {
+        while (_dirty[word] != 0)
+        {
+            // Takes the lowest run of set bits, which may carry on into the next words.
+            const int start = word * 64 + std::countr_zero(_dirty[word]);
+            int end = start;
+            while (end / 64 < numWords && (_dirty[end / 64] >> (end % 64)) & 1)
+            {
+                _dirty[end / 64] &= ~(std::uint64_t(1) << (end % 64));
+                end++;
+            }
+
+            ranges.push_back({ tilesOffset + start * int(sizeof(int)), (end - start) * int(sizeof(int)), (const unsigned char*)(_tiles + start) });
+        }
+    }
 }
 
 void Tilemap_Layer::Update(int scrollX, int scrollY, int viewwidth, int viewheight)
@@ -132,6 +161,7 @@ void Tilemap_Layer::Serialize(Oxygen::Message& msg) const
 {
     const int tileSize = _width * _height * sizeof(int);
 
+    msg.Reserve(12 + tileSize);
     msg.WriteInt32(_width);
     msg.WriteInt32(_height);
     msg.WriteBytes(tileSize, (unsigned char*)_tiles);
@@ -146,6 +176,8 @@ void Tilemap_Layer::Deserialize(Oxygen::Message& msg)
     int numBytes = msg.ReadInt32();
     _tiles = new int[numBytes / sizeof(int)];
     msg.ReadBytes(numBytes, (unsigned char*)_tiles);
+
+    _dirty.assign((numBytes / sizeof(int) + 63) / 64, 0);
 }
 
 Tilemap_Layer::~Tilemap_Layer()
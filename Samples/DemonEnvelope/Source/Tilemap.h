@@ -1,11 +1,14 @@
 #pragma once
 #include "API.h"
 #include "Tileset.h"
+#include <cstdint>
 #include <memory>
+#include <vector>
 
 namespace Oxygen
 {
     class Message;
+    struct DeltaRange;
 }
 
 namespace DE
@@ -59,6 +62,10 @@ namespace DE
 
         void Set(int cell, int tile);
 
+        // Adds a range for each run of cells set since the last call, for an update of only
+        // those cells. offset is where Serialize starts in the object's custom data.
+        void CollectDirtyRanges(int offset, std::vector<Oxygen::DeltaRange>& ranges);
+
         void Update(int scrollX, int scrollY, int viewwidth, int viewheight);
 
         void Serialize(Oxygen::Message& msg) const;
@@ -85,6 +92,7 @@ namespace DE
 
     private:
         int* _tiles;
+        std::vector<std::uint64_t> _dirty;
         int _width;
         int _height;
         int _id;
@@ -46,29 +46,29 @@ void AssetService::GetAssetList(const std::function<void(std::vector<std::string
 {
     _assetListCallback = callback;
 
-    Message msg("ASSET_SVR", "ASSET_LIST");
-    std::shared_ptr<Subscriber> sub = std::make_shared<Subscriber>(msg);
-    _conn->AddSubscriber(sub);
-    sub->Signal([this, sub2 = sub](Oxygen::Message& msg)
+    RequestAssetList();
+}
+
+Task<void> AssetService::RequestAssetList()
+{
+    Response response = co_await _conn->Request(Message("ASSET_SVR", "ASSET_LIST"));
+    if (!response.Completed())
+    {
+        co_return;
+    }
+
+    Message& msg = response.Reply();
+    if (msg.ReadString() == "ACK")
+    {
+        const int numAssets = msg.ReadInt32();
+        std::vector<std::string> assets;
+        for (int i = 0; i < numAssets; i++)
         {
-            if (msg.ReadString() == "ACK")
-            {
-                const int numAssets = msg.ReadInt32();
-                std::vector<std::string> assets;
-                for (int i = 0; i < numAssets; i++)
-                {
-                    assets.push_back(msg.ReadString());
-                }
-
-                _assetListCallback(assets);
-            }
-            else
-            {
-                const int code = msg.ReadInt32();
-            }
-
-            _conn->RemoveSubscriber(sub2);
-        });
+            assets.push_back(msg.ReadString());
+        }
+
+        _assetListCallback(assets);
+    }
 }
 
 void AssetService::UploadAsset(const std::string& asset, const std::function<void()>& callback)
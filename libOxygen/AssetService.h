@@ -5,6 +5,7 @@
 #include <fstream>
 #include "DownloadStream.h"
 #include "UploadStream.h"
+#include "AsyncRequest.h"
 
 namespace Oxygen
 {
@@ -32,6 +33,7 @@ namespace Oxygen
         inline bool IsDownloadError() { return _downloadStream->IsError(); }
 
     private:
+        Task<void> RequestAssetList();
 
         ClientConnection* _conn;
         const std::string _assetDir;
@@ -0,0 +1,90 @@
+#include "AsyncRequest.h"
+#include "ClientConnection.h"
+
+using namespace Oxygen;
+
+PendingRequest::PendingRequest(ClientConnection* conn, Message&& msg, const RequestOptions& options)
+    :
+    Subscriber(std::move(msg)),
+    _conn(conn),
+    _cancellation(options.cancellation),
+    _completed(false),
+    _result(nullptr),
+    _index(0)
+{
+    // The connection's timer wheel enforces the deadline.
+    SetTimeout(options.timeout);
+    SetRetry(options.retryInterval, options.retries);
+}
+
+bool PendingRequest::Start(std::coroutine_handle<> awaiting, std::optional<Response>* result)
+{
+    // Returns false if the request finished without waiting.
+    if (!_conn->IsConnected())
+    {
+        _completed = true;
+        result->emplace(RequestStatus::Disconnected);
+        return false;
+    }
+
+    _awaiting = awaiting;
+    _result = result;
+
+    std::shared_ptr<PendingRequest> self = _self.lock();
+    _index = _conn->pendingRequests.size();
+    _conn->pendingRequests.push_back(self);
+    _conn->AddSubscriber(self);
+    return true;
+}
+
+void PendingRequest::OnNewMessage(Message& msg)
+{
+    Complete(Response(std::move(msg)));
+}
+
+void PendingRequest::OnTimeout()
+{
+    Complete(Response(RequestStatus::TimedOut));
+}
+
+void PendingRequest::OnSuperseded()
+{
+    Complete(Response(RequestStatus::Superseded));
+}
+
+bool PendingRequest::Check(bool connected)
+{
+    if (_completed)
+    {
+        return true;
+    }
+
+    if (_cancellation.IsCancelled())
+    {
+        Complete(Response(RequestStatus::Cancelled));
+    }
+    else if (!connected)
+    {
+        Complete(Response(RequestStatus::Disconnected));
+    }
+
+    return _completed;
+}
+
+void PendingRequest::Complete(Response&& response)
+{
+    if (_completed)
+    {
+        return;
+    }
+
+    _completed = true;
+    _result->emplace(std::move(response));
+
+    // Resuming can destroy the coroutine holding the last other reference.
+    std::shared_ptr<PendingRequest> self = _self.lock();
+    _conn->RemoveSubscriber(self);
+    _conn->FinishRequest(this);
+
+    _awaiting.resume();
+}
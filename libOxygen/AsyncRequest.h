@@ -0,0 +1,270 @@
+#pragma once
+#include "Message.h"
+#include "Subscriber.h"
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace Oxygen
+{
+    class ClientConnection;
+
+    template<typename T>
+    class Task;
+
+    namespace Detail
+    {
+        template<typename T>
+        struct TaskPromise;
+
+        template<typename T>
+        struct FinalAwaiter
+        {
+            bool await_ready() noexcept { return false; }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<TaskPromise<T>> handle) noexcept
+            {
+                // Hands control straight to the awaiting coroutine. Nobody is
+                // left to destroy a detached task, so it cleans up after itself.
+                TaskPromise<T>& promise = handle.promise();
+                if (promise.continuation)
+                {
+                    return promise.continuation;
+                }
+
+                if (promise.detached)
+                {
+                    handle.destroy();
+                }
+
+                return std::noop_coroutine();
+            }
+
+            void await_resume() noexcept {}
+        };
+
+        template<typename T>
+        struct TaskPromiseBase
+        {
+            std::coroutine_handle<> continuation;
+            bool detached = false;
+
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            FinalAwaiter<T> final_suspend() noexcept { return {}; }
+            void unhandled_exception() { std::terminate(); }
+        };
+
+        template<typename T>
+        struct TaskPromise : public TaskPromiseBase<T>
+        {
+            std::optional<T> value;
+
+            Task<T> get_return_object();
+            void return_value(T result) { value.emplace(std::move(result)); }
+        };
+
+        template<>
+        struct TaskPromise<void> : public TaskPromiseBase<void>
+        {
+            Task<void> get_return_object();
+            void return_void() {}
+        };
+    }
+
+    // A coroutine which starts running as soon as it is called and can be
+    // co_awaited for its result. Dropping a task does not cancel it, the
+    // coroutine runs to completion and frees itself.
+    template<typename T>
+    class Task
+    {
+    public:
+        using promise_type = Detail::TaskPromise<T>;
+        using Handle = std::coroutine_handle<promise_type>;
+
+        explicit Task(Handle handle) : _handle(handle) {}
+        Task(Task&& other) noexcept : _handle(std::exchange(other._handle, nullptr)) {}
+        Task(const Task&) = delete;
+        Task& operator=(const Task&) = delete;
+
+        Task& operator=(Task&& other) noexcept
+        {
+            if (this != &other)
+            {
+                Release();
+                _handle = std::exchange(other._handle, nullptr);
+            }
+            return *this;
+        }
+
+        inline bool Done() const { return _handle && _handle.done(); }
+
+        bool await_ready() const noexcept { return _handle.done(); }
+        void await_suspend(std::coroutine_handle<> awaiting) noexcept { _handle.promise().continuation = awaiting; }
+
+        T await_resume()
+        {
+            if constexpr (!std::is_void_v<T>)
+            {
+                return std::move(*_handle.promise().value);
+            }
+        }
+
+        ~Task() { Release(); }
+
+    private:
+        void Release()
+        {
+            if (_handle)
+            {
+                if (_handle.done())
+                {
+                    _handle.destroy();
+                }
+                else
+                {
+                    _handle.promise().detached = true;
+                }
+                _handle = nullptr;
+            }
+        }
+
+        Handle _handle;
+    };
+
+    namespace Detail
+    {
+        template<typename T>
+        Task<T> TaskPromise<T>::get_return_object()
+        {
+            return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+        }
+
+        inline Task<void> TaskPromise<void>::get_return_object()
+        {
+            return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+        }
+    }
+
+    // Tasks start eagerly, so the requests are all in flight before the first is awaited.
+    template<typename T>
+    Task<std::vector<T>> WhenAll(std::vector<Task<T>> tasks)
+    {
+        std::vector<T> results;
+        results.reserve(tasks.size());
+        for (auto& task : tasks)
+        {
+            results.push_back(co_await task);
+        }
+        co_return results;
+    }
+
+    template<typename... T>
+    Task<std::tuple<T...>> WhenAll(Task<T>... tasks)
+    {
+        co_return std::tuple<T...>{ co_await tasks... };
+    }
+
+    //============================================================
+
+    // Shared between a CancellationSource and the requests it was passed to.
+    class CancellationToken
+    {
+    public:
+        CancellationToken() {}
+        inline bool IsCancelled() const { return _state && _state->load(std::memory_order_acquire); }
+
+    private:
+        friend class CancellationSource;
+        explicit CancellationToken(const std::shared_ptr<std::atomic<bool>>& state) : _state(state) {}
+
+        std::shared_ptr<std::atomic<bool>> _state;
+    };
+
+    class CancellationSource
+    {
+    public:
+        CancellationSource() : _state(std::make_shared<std::atomic<bool>>(false)) {}
+
+        // Can be called from any thread, the requests complete on the next Process.
+        inline void Cancel() { _state->store(true, std::memory_order_release); }
+        inline bool IsCancelled() const { return _state->load(std::memory_order_acquire); }
+        inline CancellationToken Token() const { return CancellationToken(_state); }
+
+    private:
+        std::shared_ptr<std::atomic<bool>> _state;
+    };
+
+    struct RequestOptions
+    {
+        // Zero waits for the response indefinitely.
+        std::chrono::milliseconds timeout = std::chrono::milliseconds(0);
+        CancellationToken cancellation;
+
+        // Resends the request until it is answered, see Subscriber::SetRetry.
+        std::chrono::milliseconds retryInterval = std::chrono::milliseconds(0);
+        int retries = 0;
+    };
+
+    enum class RequestStatus
+    {
+        Completed,
+        TimedOut,
+        Cancelled,
+        Disconnected,
+        // A newer request with the same coalesce key replaced it before it was sent.
+        Superseded
+    };
+
+    class Response
+    {
+    public:
+        explicit Response(RequestStatus status) : _status(status) {}
+        explicit Response(Message&& msg) : _status(RequestStatus::Completed), _message(std::move(msg)) {}
+
+        inline RequestStatus Status() const { return _status; }
+        inline bool Completed() const { return _status == RequestStatus::Completed; }
+
+        // Only valid when the request completed.
+        inline Message& Reply() { return *_message; }
+
+    private:
+        RequestStatus _status;
+        std::optional<Message> _message;
+    };
+
+    // The subscriber behind a single ClientConnection::Request. It removes itself
+    // from the connection when the response arrives or the request is abandoned.
+    class PendingRequest : public Subscriber
+    {
+    public:
+        PendingRequest(ClientConnection* conn, Message&& msg, const RequestOptions& options);
+
+        virtual void OnNewMessage(Message& msg);
+        virtual void OnTimeout();
+        virtual void OnSuperseded();
+
+        // Completes the request if it has been cancelled or the connection was lost.
+        bool Check(bool connected);
+
+        bool Start(std::coroutine_handle<> awaiting, std::optional<Response>* result);
+
+    private:
+        void Complete(Response&& response);
+
+        ClientConnection* _conn;
+        CancellationToken _cancellation;
+        bool _completed;
+        std::coroutine_handle<> _awaiting;
+        std::optional<Response>* _result;
+        std::weak_ptr<PendingRequest> _self;
+        size_t _index;
+
+        friend class ClientConnection;
+    };
+}
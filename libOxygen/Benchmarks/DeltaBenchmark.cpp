@@ -0,0 +1,429 @@
+// Measures the delta codec on a corpus of object updates laid out as the DemonEnvelope sample
+// streams them: tile paints, collision mask toggles, NPC moves, script edits and layer resizes
+// which shift the rows, on layers from 32x32 to 4096x4096. Each update is the object state the
+// stream keeps before and after the edit. Reports encode and decode MB/s, the compression ratio
+// and heap allocations per operation, as a table or with --json as JSON to track over releases.
+// --write-corpus <dir> saves the corpus as <name>.init and <name>.new pairs, --corpus <dir>
+// measures the pairs in a directory instead, such as updates captured from a session.
+
+#include "../DeltaCompress.h"
+#include "../Endian.h"
+#include "../Message.h"
+#include "../ObjectStream.h"
+#include "../Schema.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+using namespace Oxygen;
+
+// Each update is run until about this many bytes have been encoded, and at least a few times.
+constexpr size_t BYTES_PER_UPDATE = 64 * 1024 * 1024;
+constexpr int MIN_ITERATIONS = 4;
+
+static std::atomic<std::uint64_t> numAllocations = 0;
+
+void* operator new(size_t size)
+{
+    numAllocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size ? size : 1))
+    {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+struct Update
+{
+    std::string name;
+    std::vector<unsigned char> initialData;
+    std::vector<unsigned char> newData;
+};
+
+struct NPC
+{
+    int px;
+    int py;
+    int spriteId;
+};
+
+struct Script
+{
+    int trigger;
+    int px;
+    int py;
+    int parentId;
+};
+
+// As DE::NPCSchema and DE::ScriptSchema in the sample.
+using NPCSchema = Schema<"NPC", &NPC::px, &NPC::py, &NPC::spriteId>;
+using ScriptSchema = Schema<"SCRIPT", &Script::trigger, &Script::px, &Script::py, &Script::parentId>;
+
+template<typename Func>
+static std::vector<unsigned char> ObjectState(int id, const Func& writeCustomData)
+{
+    // The state the object stream keeps, the names of the stream and the object header
+    // followed by the custom data.
+    Object obj = {};
+    obj.id = id;
+    obj.scale[0] = 1.0;
+    obj.scale[1] = 1.0;
+    obj.scale[2] = 1.0;
+
+    Message msg("LEVEL_SVR", "OBJECT_STREAM");
+    msg.WriteInt32(0);
+    ObjectSchema::Write(msg, obj);
+    const size_t customDataPos = msg.size() - 4;
+
+    writeCustomData(msg);
+
+    // Locally built messages start with their size and id.
+    std::vector<unsigned char> state(msg.data() + 8, msg.data() + msg.size());
+    StoreLittleEndian(state.data() + customDataPos - 8, std::int32_t(msg.size() - customDataPos - 4));
+    return state;
+}
+
+static std::vector<int> MakeTiles(int width, int height)
+{
+    // A few tile types in long runs, as a painted layer has.
+    std::vector<int> tiles(size_t(width) * height);
+    for (size_t i = 0; i < tiles.size(); i++)
+    {
+        tiles[i] = int((i / 37) % 5);
+    }
+    return tiles;
+}
+
+static std::vector<unsigned char> LayerState(int width, int height, const std::vector<int>& tiles)
+{
+    // As Network::UpdateTilemap and Tilemap_Layer::Serialize.
+    return ObjectState(1, [&](Message& msg)
+    {
+        msg.WriteString("TILEMAP_LAYER");
+        msg.WriteInt32(0);
+        msg.WriteInt32(width);
+        msg.WriteInt32(height);
+        msg.WriteBytes(int(tiles.size() * sizeof(int)), (const unsigned char*)tiles.data());
+    });
+}
+
+static std::vector<unsigned char> MaskState(int width, int height, const std::vector<unsigned char>& mask)
+{
+    // As Network::UpdateTilemask and Tilemap_Mask::Serialize.
+    return ObjectState(2, [&](Message& msg)
+    {
+        msg.WriteString("TILEMAP_MASK");
+        msg.WriteInt32(width);
+        msg.WriteInt32(height);
+        msg.WriteBytes(int(mask.size()), mask.data());
+    });
+}
+
+static std::vector<unsigned char> NPCState(const NPC& npc)
+{
+    return ObjectState(3, [&](Message& msg)
+    {
+        msg.WriteString("NPC");
+        NPCSchema::Write(msg, npc);
+    });
+}
+
+static std::vector<unsigned char> ScriptState(const Script& script, const std::string& scriptName)
+{
+    return ObjectState(4, [&](Message& msg)
+    {
+        msg.WriteString("SCRIPT");
+        ScriptSchema::Write(msg, script);
+        msg.WriteString(scriptName);
+    });
+}
+
+static void AddLayerUpdates(std::vector<Update>& corpus, int size)
+{
+    const std::string dimensions = std::to_string(size) + "x" + std::to_string(size);
+    const std::vector<int> tiles = MakeTiles(size, size);
+    const std::vector<unsigned char> initialData = LayerState(size, size, tiles);
+
+    // A few strokes of a 3x3 brush.
+    std::vector<int> painted = tiles;
+    for (int stroke = 0; stroke < 8; stroke++)
+    {
+        const int cx = (stroke * 7919 + 3) % (size - 2);
+        const int cy = (stroke * 104729 + 5) % (size - 2);
+        for (int y = cy; y < cy + 3; y++)
+        {
+            for (int x = cx; x < cx + 3; x++)
+            {
+                painted[size_t(y) * size + x] = 6;
+            }
+        }
+    }
+    corpus.push_back({ "tile paint " + dimensions, initialData, LayerState(size, size, painted) });
+
+    // A column added on the right shifts every row after the first.
+    std::vector<int> widened;
+    widened.reserve(size_t(size + 1) * size);
+    for (int y = 0; y < size; y++)
+    {
+        widened.insert(widened.end(), tiles.begin() + size_t(y) * size, tiles.begin() + size_t(y + 1) * size);
+        widened.push_back(0);
+    }
+    corpus.push_back({ "layer resize " + dimensions, initialData, LayerState(size + 1, size, widened) });
+}
+
+static void AddMaskUpdate(std::vector<Update>& corpus, int size)
+{
+    const int numTiles = size * size;
+    std::vector<unsigned char> mask(size_t(numTiles / 8) + (numTiles % 8 > 0 ? 1 : 0));
+    for (size_t i = 0; i < mask.size(); i++)
+    {
+        mask[i] = (i / 16) % 3 == 0 ? 0xFF : 0;
+    }
+
+    std::vector<unsigned char> toggled = mask;
+    for (int cell = 0; cell < numTiles; cell += numTiles / 16 + 1)
+    {
+        toggled[cell / 8] ^= 1 << (cell % 8);
+    }
+
+    corpus.push_back({ "mask toggle " + std::to_string(size) + "x" + std::to_string(size),
+        MaskState(size, size, mask), MaskState(size, size, toggled) });
+}
+
+static std::vector<Update> MakeCorpus()
+{
+    std::vector<Update> corpus;
+    for (int size : { 32, 256, 1024, 4096 })
+    {
+        AddLayerUpdates(corpus, size);
+    }
+
+    AddMaskUpdate(corpus, 256);
+    AddMaskUpdate(corpus, 4096);
+
+    corpus.push_back({ "npc move", NPCState({ 10, 12, 3 }), NPCState({ 11, 12, 3 }) });
+
+    // Moving a script keeps its size, renaming it changes it.
+    const Script script = { 1, 20, 4, 7 };
+    const Script moved = { 1, 21, 4, 7 };
+    corpus.push_back({ "script move", ScriptState(script, "village_gate.ss"), ScriptState(moved, "village_gate.ss") });
+    corpus.push_back({ "script rename", ScriptState(script, "village_gate.ss"), ScriptState(script, "village_gate_night.ss") });
+
+    return corpus;
+}
+
+static std::vector<unsigned char> ReadFile(const std::filesystem::path& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    return std::vector<unsigned char>(std::istreambuf_iterator<char>(file), {});
+}
+
+static void WriteFile(const std::filesystem::path& path, const std::vector<unsigned char>& data)
+{
+    std::ofstream file(path, std::ios::binary);
+    file.write((const char*)data.data(), std::streamsize(data.size()));
+}
+
+static std::vector<Update> ReadCorpus(const std::filesystem::path& directory)
+{
+    std::vector<Update> corpus;
+    for (const auto& entry : std::filesystem::directory_iterator(directory))
+    {
+        std::filesystem::path newPath = entry.path();
+        if (entry.path().extension() != ".init" || !std::filesystem::exists(newPath.replace_extension(".new")))
+        {
+            continue;
+        }
+
+        corpus.push_back({ entry.path().stem().string(), ReadFile(entry.path()), ReadFile(newPath) });
+    }
+
+    std::sort(corpus.begin(), corpus.end(), [](const Update& a, const Update& b) { return a.name < b.name; });
+    return corpus;
+}
+
+static void WriteCorpus(const std::filesystem::path& directory, const std::vector<Update>& corpus)
+{
+    std::filesystem::create_directories(directory);
+    for (const Update& update : corpus)
+    {
+        std::string name = update.name;
+        std::replace(name.begin(), name.end(), ' ', '_');
+
+        WriteFile(directory / (name + ".init"), update.initialData);
+        WriteFile(directory / (name + ".new"), update.newData);
+    }
+}
+
+struct Result
+{
+    int numDeltaBytes;
+    double encodeMBs;
+    double decodeMBs;
+    double encodeAllocations;
+    double decodeAllocations;
+    bool ok;
+};
+
+static Result Run(const Update& update)
+{
+    const std::vector<unsigned char>& initialData = update.initialData;
+    const std::vector<unsigned char>& newData = update.newData;
+    const int iterations = int(std::max<size_t>(MIN_ITERATIONS, BYTES_PER_UPDATE / std::max<size_t>(newData.size(), 1)));
+
+    std::vector<unsigned char> delta(CompressBound(int(initialData.size()), int(newData.size())));
+    std::vector<unsigned char> decoded(newData.size());
+
+    Result result = {};
+
+    const std::uint64_t encodeAllocations = numAllocations.load();
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+    {
+        result.numDeltaBytes = Compress(initialData.data(), int(initialData.size()), newData.data(), int(newData.size()), delta.data());
+    }
+    const auto encoded = std::chrono::steady_clock::now();
+
+    const std::uint64_t decodeAllocations = numAllocations.load();
+    int numDecoded = 0;
+    for (int i = 0; i < iterations; i++)
+    {
+        numDecoded = Decompress(initialData.data(), int(initialData.size()), delta.data(), result.numDeltaBytes, decoded.data(), int(decoded.size()));
+    }
+    const auto end = std::chrono::steady_clock::now();
+    const std::uint64_t endAllocations = numAllocations.load();
+
+    const double bytes = double(newData.size()) * iterations / (1024.0 * 1024.0);
+    result.encodeMBs = bytes / std::chrono::duration<double>(encoded - start).count();
+    result.decodeMBs = bytes / std::chrono::duration<double>(end - encoded).count();
+    result.encodeAllocations = double(decodeAllocations - encodeAllocations) / iterations;
+    result.decodeAllocations = double(endAllocations - decodeAllocations) / iterations;
+    result.ok = numDecoded == int(newData.size()) && decoded == newData;
+    return result;
+}
+
+static void PrintTable(const std::vector<Update>& corpus, const std::vector<Result>& results)
+{
+    for (size_t i = 0; i < corpus.size(); i++)
+    {
+        const Update& update = corpus[i];
+        const Result& result = results[i];
+
+        std::cout << update.name << " (" << update.newData.size() << " bytes): "
+            << "encode " << result.encodeMBs << " MB/s, "
+            << "decode " << result.decodeMBs << " MB/s, "
+            << "ratio " << double(update.newData.size()) / result.numDeltaBytes << ", "
+            << "allocations " << result.encodeAllocations << " encode " << result.decodeAllocations << " decode";
+        if (!result.ok)
+        {
+            std::cout << " (mismatch)";
+        }
+        std::cout << std::endl;
+    }
+}
+
+static void PrintJson(const std::vector<Update>& corpus, const std::vector<Result>& results)
+{
+    // Names are generated or file stems, quotes and backslashes are all that need escaping.
+    std::cout << "{\n  \"updates\": [\n";
+    for (size_t i = 0; i < corpus.size(); i++)
+    {
+        const Update& update = corpus[i];
+        const Result& result = results[i];
+
+        std::string name;
+        for (char c : update.name)
+        {
+            if (c == '"' || c == '\\')
+            {
+                name += '\\';
+            }
+            name += c;
+        }
+
+        std::cout << "    { \"name\": \"" << name << "\""
+            << ", \"initial_bytes\": " << update.initialData.size()
+            << ", \"new_bytes\": " << update.newData.size()
+            << ", \"delta_bytes\": " << result.numDeltaBytes
+            << ", \"ratio\": " << double(update.newData.size()) / result.numDeltaBytes
+            << ", \"encode_mb_s\": " << result.encodeMBs
+            << ", \"decode_mb_s\": " << result.decodeMBs
+            << ", \"encode_allocations\": " << result.encodeAllocations
+            << ", \"decode_allocations\": " << result.decodeAllocations
+            << ", \"ok\": " << (result.ok ? "true" : "false") << " }"
+            << (i + 1 < corpus.size() ? ",\n" : "\n");
+    }
+    std::cout << "  ]\n}" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    bool json = false;
+    std::filesystem::path corpusDirectory;
+    std::filesystem::path writeDirectory;
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--json")
+        {
+            json = true;
+        }
+        else if (arg == "--corpus" && i + 1 < argc)
+        {
+            corpusDirectory = argv[++i];
+        }
+        else if (arg == "--write-corpus" && i + 1 < argc)
+        {
+            writeDirectory = argv[++i];
+        }
+        else
+        {
+            std::cerr << "Usage: DeltaBenchmark [--json] [--corpus <dir>] [--write-corpus <dir>]" << std::endl;
+            return 1;
+        }
+    }
+
+    const std::vector<Update> corpus = corpusDirectory.empty() ? MakeCorpus() : ReadCorpus(corpusDirectory);
+    if (!writeDirectory.empty())
+    {
+        WriteCorpus(writeDirectory, corpus);
+        return 0;
+    }
+
+    std::vector<Result> results;
+    bool ok = true;
+    for (const Update& update : corpus)
+    {
+        results.push_back(Run(update));
+        ok = ok && results.back().ok;
+    }
+
+    if (json)
+    {
+        PrintJson(corpus, results);
+    }
+    else
+    {
+        PrintTable(corpus, results);
+    }
+
+    return ok ? 0 : 1;
+}
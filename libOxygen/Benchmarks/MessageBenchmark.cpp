@@ -0,0 +1,148 @@
+// Measures the cost of serializing a 256x256 tilemap layer into a Message
+// the way the level editor does it, against the previous byte at a time encoder.
+
+#include "../Message.h"
+#include "../Subscriber.h"
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+using namespace Oxygen;
+
+constexpr int LAYER_WIDTH = 256;
+constexpr int LAYER_HEIGHT = 256;
+constexpr int ITERATIONS = 200;
+
+// The encoder as it was before the fast path, kept as the baseline.
+class ByteEncoder
+{
+public:
+    void WriteInt32(int value)
+    {
+        _data.push_back(value & 0xFF);
+        _data.push_back((value >> 8) & 0xFF);
+        _data.push_back((value >> 16) & 0xFF);
+        _data.push_back((value >> 24) & 0xFF);
+    }
+
+    void WriteDouble(double value)
+    {
+        std::int64_t val;
+        std::memcpy(&val, &value, sizeof(val));
+        for (int i = 0; i < 8; i++)
+        {
+            _data.push_back((val >> (i * 8)) & 0xFF);
+        }
+    }
+
+    void WriteBytes(int numBytes, const unsigned char* bytes)
+    {
+        WriteInt32(numBytes);
+        for (int i = 0; i < numBytes; i++)
+        {
+            _data.push_back(bytes[i] & 0xff);
+        }
+    }
+
+    void WriteString(const std::string& str)
+    {
+        WriteBytes(int(str.size()), (const unsigned char*)str.data());
+    }
+
+    size_t size() const { return _data.size(); }
+
+private:
+    std::vector<unsigned char> _data;
+};
+
+template<typename Encoder>
+static void WriteLayer(Encoder& msg, const std::vector<int>& tiles)
+{
+    // Matches ObjectStream::BuildUpdateMessage followed by Tilemap_Layer::Serialize.
+    msg.WriteInt32(0);
+    msg.WriteInt32(1);
+    for (int i = 0; i < 9; i++)
+    {
+        msg.WriteDouble(1.0);
+    }
+    msg.WriteInt32(0);
+    msg.WriteString("TILEMAP_LAYER");
+    msg.WriteInt32(0);
+    msg.WriteInt32(LAYER_WIDTH);
+    msg.WriteInt32(LAYER_HEIGHT);
+    msg.WriteBytes(int(tiles.size() * sizeof(int)), (const unsigned char*)tiles.data());
+}
+
+template<typename Func>
+static void Run(const char* name, size_t bytesPerOp, const Func& func)
+{
+    size_t total = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        total += func();
+    }
+    const auto end = std::chrono::steady_clock::now();
+
+    const double seconds = std::chrono::duration<double>(end - start).count();
+    const double usPerOp = seconds * 1e6 / ITERATIONS;
+    const double mbPerSecond = double(bytesPerOp) * ITERATIONS / seconds / (1024.0 * 1024.0);
+
+    std::cout << name << ": " << usPerOp << " us/op, " << mbPerSecond << " MB/s";
+    if (total == 0)
+    {
+        std::cout << " (empty)";
+    }
+    std::cout << std::endl;
+}
+
+int main()
+{
+    std::vector<int> tiles(LAYER_WIDTH * LAYER_HEIGHT);
+    for (size_t i = 0; i < tiles.size(); i++)
+    {
+        tiles[i] = int(i % 97);
+    }
+
+    const size_t layerBytes = tiles.size() * sizeof(int);
+
+    Run("byte encoder", layerBytes, [&]()
+        {
+            ByteEncoder msg;
+            WriteLayer(msg, tiles);
+            return msg.size();
+        });
+
+    Run("message", layerBytes, [&]()
+        {
+            Message msg("LEVEL_SVR", "OBJECT_STREAM");
+            WriteLayer(msg, tiles);
+            return msg.size();
+        });
+
+    Run("message with size hint", layerBytes, [&]()
+        {
+            Message msg("LEVEL_SVR", "OBJECT_STREAM", 128 + layerBytes);
+            WriteLayer(msg, tiles);
+            return msg.size();
+        });
+
+    Run("copy into subscriber", layerBytes, [&]()
+        {
+            Message msg("LEVEL_SVR", "OBJECT_STREAM", 128 + layerBytes);
+            WriteLayer(msg, tiles);
+            Subscriber sub(msg);
+            return sub.Request().size();
+        });
+
+    Run("move into subscriber", layerBytes, [&]()
+        {
+            Message msg("LEVEL_SVR", "OBJECT_STREAM", 128 + layerBytes);
+            WriteLayer(msg, tiles);
+            Subscriber sub(std::move(msg));
+            return sub.Request().size();
+        });
+
+    return 0;
+}
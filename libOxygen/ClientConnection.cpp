@@ -2,51 +2,45 @@
 #include "Message.h"
 #include "Subscriber.h"
 #include "Security.h"
-
+#include "RingBuffer.h"
+#include "FramePool.h"
+#include "Routes.h"
+#include "ObjectStream.h"
+#include "AsyncRequest.h"
+#include "TimerWheel.h"
+#include "Transport.h"
+#include "FrameCompress.h"
+
+#ifdef _WIN32
 #include <WinSock2.h>
 #include <ws2tcpip.h>
+#pragma comment(lib, "Ws2_32.lib")
+#else
+#include "Reactor.h"
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
 #include <sstream>
 #include <thread>
 #include <functional>
-#include <queue>
+#include <atomic>
 #include <mutex>
 #include <condition_variable>
 #include <iostream>
-
-#pragma comment(lib, "Ws2_32.lib")
+#include <algorithm>
+#include <unordered_map>
+#include <map>
+#include <cstring>
 
 using namespace std;
 using namespace Oxygen;
 
 namespace Oxygen
 {
-    template<typename T>
-    class ReaderWriterQueue
-    {
-    public:
-        inline void Enqueue(const T& item)
-        {
-            std::unique_lock<decltype(_lock)>(_lock);
-            _queue.push(item);
-        }
-
-        inline T Dequeue()
-        {
-            std::unique_lock<decltype(_lock)>(_lock);
-            const T front = _queue.front();
-            _queue.pop();
-            return front;
-        }
-
-        inline size_t Size() { return _queue.size(); }
-
-    private:
-        std::queue<T> _queue;
-        std::mutex _lock;
-    };
-
-    //============================================================
-
     class WaitHandle
     {
     public:
@@ -55,17 +49,42 @@ namespace Oxygen
 
         void WaitOne(std::unique_lock<std::mutex>& lock);
         void WaitOne(std::unique_lock<std::mutex>& lock, int timeout);
+        void WaitOne(std::unique_lock<std::mutex>& lock, std::chrono::milliseconds timeout);
         void Set();
+        void Reset();
+
+        // Called by the first Set after a Reset, on the thread calling Set.
+        // Must be given before the handle is shared with other threads.
+        void Listen(const std::function<void()>& callback);
+#ifndef _WIN32
+        // An eventfd which is readable from Set until Reset, created on first use.
+        int EventFd();
+#endif
+        ~WaitHandle();
 
     private:
         std::mutex mutex;
         std::condition_variable condition;
         bool writeData;
+        bool signalled;
+        std::function<void()> listener;
+#ifndef _WIN32
+        int eventFd;
+#endif
     };
 
-    WaitHandle::WaitHandle() : writeData(false) {}
+#ifdef _WIN32
+    WaitHandle::WaitHandle() : writeData(false), signalled(false) {}
+#else
+    WaitHandle::WaitHandle() : writeData(false), signalled(false), eventFd(-1) {}
+#endif
 
     void WaitHandle::WaitOne(std::unique_lock<std::mutex>& lock, int timeout)
+    {
+        WaitOne(lock, std::chrono::seconds(timeout));
+    }
+
+    void WaitHandle::WaitOne(std::unique_lock<std::mutex>& lock, std::chrono::milliseconds timeout)
     {
         std::unique_lock<std::mutex> temp(mutex);
         lock.swap(temp);
@@ -74,7 +93,7 @@ namespace Oxygen
         // Then wait until can process data, when the lock is then reacquired
         // Set the process flag and release the lock
         //condition.wait(lock, [this] { return writeData; });
-        condition.wait_for(lock, std::chrono::seconds(timeout), [this] { return writeData; });
+        condition.wait_for(lock, timeout, [this] { return writeData; });
         writeData = false;
     }
 
@@ -92,60 +111,371 @@ namespace Oxygen
 
     void WaitHandle::Set()
     {
+        bool notify = false;
         {
             // acquire the lock, once held allow the queue to be processed
             std::unique_lock<decltype(mutex)>lock(mutex);
             writeData = true;
+            if (!signalled)
+            {
+                notify = bool(listener);
+                signalled = notify;
+#ifndef _WIN32
+                if (eventFd != -1)
+                {
+                    const std::uint64_t one = 1;
+                    const ssize_t written = write(eventFd, &one, sizeof(one));
+                    (void)written;
+                    signalled = true;
+                }
+#endif
+            }
         }
 
         condition.notify_one();
+
+        if (notify)
+        {
+            listener();
+        }
+    }
+
+    void WaitHandle::Reset()
+    {
+        std::unique_lock<decltype(mutex)>lock(mutex);
+        writeData = false;
+        if (signalled)
+        {
+#ifndef _WIN32
+            if (eventFd != -1)
+            {
+                std::uint64_t value;
+                const ssize_t consumed = read(eventFd, &value, sizeof(value));
+                (void)consumed;
+            }
+#endif
+            signalled = false;
+        }
+    }
+
+    void WaitHandle::Listen(const std::function<void()>& callback)
+    {
+        std::unique_lock<decltype(mutex)>lock(mutex);
+        listener = callback;
+    }
+
+#ifndef _WIN32
+    int WaitHandle::EventFd()
+    {
+        std::unique_lock<decltype(mutex)>lock(mutex);
+        if (eventFd == -1)
+        {
+            eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+            // The listener may already have been told about pending work.
+            if (eventFd != -1 && signalled)
+            {
+                const std::uint64_t one = 1;
+                const ssize_t written = write(eventFd, &one, sizeof(one));
+                (void)written;
+            }
+        }
+        return eventFd;
+    }
+#endif
+
+    WaitHandle::~WaitHandle()
+    {
+#ifndef _WIN32
+        if (eventFd != -1)
+        {
+            close(eventFd);
+        }
+#endif
     }
 
     //============================================================
 
+    using Clock = std::chrono::steady_clock;
+
+    // A heartbeat is only sent once nothing else has been sent for this long.
+    constexpr std::chrono::seconds HEARTBEAT_INTERVAL(30);
+
+    // Request timers are keyed by the subscriber id and the kind of timer.
+    constexpr TimerWheel::Key HEARTBEAT_TIMER = 0;
+    constexpr TimerWheel::Key DEADLINE_TIMER = 1;
+    constexpr TimerWheel::Key RETRY_TIMER = 2;
+
+    inline WritePriority DefaultPriority(const Message& msg)
+    {
+        return msg.Route() >= 0 ? Routes::Priority(msg.Route()) : WritePriority::Normal;
+    }
+
+    inline TimerWheel::Key RequestTimerKey(int id, TimerWheel::Key kind)
+    {
+        return (TimerWheel::Key(std::uint32_t(id)) << 2) | kind;
+    }
+
+    // Each turn a write lane may send up to its weight in multiples of this many bytes.
+    constexpr size_t WRITE_QUANTUM = 4 * 1024;
+
+    // Upper bound on the number of buffers handed to a single vectored send.
+    constexpr size_t MAX_BATCH_FRAMES = 256;
+
+    // Frames are received into pooled chunks of at least this size, a chunk is
+    // replaced once less than MIN_READ_SPACE bytes are left after the pending frame.
+    constexpr size_t READ_CHUNK_SIZE = 64 * 1024;
+    constexpr size_t MIN_READ_SPACE = 4 * 1024;
+
+    // How often a transport which cannot poll for space retries a write which did not fit.
+    constexpr std::chrono::milliseconds FLUSH_RETRY_INTERVAL(1);
+
+    // Subscriber ids count up from zero so the handshake uses a negative id.
+    constexpr int NEGOTIATE_ID = -2;
+
+#ifdef _WIN32
     class ClientConnectionImpl
+#else
+    class ClientConnectionImpl : public ReactorHandler
+#endif
     {
     public:
-        ClientConnectionImpl(const std::string& host, int port);
+        ClientConnectionImpl(const std::string& url, int port, const ConnectionOptions& options,
+            const std::shared_ptr<Reactor>& sharedReactor, const std::function<void()>& onPending);
 
         inline bool Connected() { return connected; }
+#ifdef _WIN32
         void ReadThread();
         void WriteThread();
-        void HeartbeatThread();
-        void WriteMessage(const Message& msg);
+#else
+        virtual void OnReadable();
+        virtual void OnWritable();
+        virtual void OnNotify();
+        virtual void OnTimer();
+#endif
+        bool WriteMessage(const Message& msg, WritePriority priority, WriteMode mode);
+        bool WriteMessage(Message&& msg, WritePriority priority, WriteMode mode);
+        bool TryWriteMessage(Message& msg, WritePriority priority);
         void AddSubscriber(std::shared_ptr<Subscriber>& subscriber);
         void RemoveSubscriber(const std::shared_ptr<Subscriber>& subscriber);
-        void Process(bool wait);
+        int Process(std::chrono::milliseconds timeout, const ProcessBudget& budget);
+        bool HasPending();
+        int PendingFd();
         inline int NumBytesSent() const { return numBytesSent; }
         inline int NumBytesReceived() const { return numBytesReceived; }
+        inline int ReadQueueHighWaterMark() const { return int(readQueue.HighWaterMark()); }
+        int WriteQueueHighWaterMark() const;
+        inline int WriteQueueDepth(WritePriority priority) const { return int(Lane(priority).queue.Size()); }
+        inline int WriteQueueHighWaterMark(WritePriority priority) const { return int(Lane(priority).queue.HighWaterMark()); }
+        inline int NumWritesRejected() const { return numWritesRejected; }
+        inline int NumFramesSent() const { return numFramesSent; }
+        inline int NumSendCalls() const { return numSendCalls; }
+        inline bool CompressionNegotiated() const { return compressionNegotiated; }
+        std::vector<CompressionStats> GetCompressionStats() const;
         ~ClientConnectionImpl();
 
     private:
-        bool connected;
+        void WakeWriter();
+        void WakeReader();
+        void FillBatch();
+        void ConsumeBatch(size_t sent);
+        void Negotiate();
+        bool HandleControlMessage(Message& msg);
+        void WaitForPending(std::chrono::milliseconds timeout);
+        void Dispatch(Message& msg);
+        Message Encode(const Message& msg) const;
+        Message Encode(Message&& msg) const;
+        Message Compress(const Message& msg);
+        bool Decompress(const unsigned char* data, size_t size, FrameRef& frame, size_t& rawSize);
+        bool Enqueue(Message&& item, WritePriority priority, WriteMode mode, int subscriberId);
+        void CompleteSuperseded();
+        bool TryEnqueue(Message&& item, WritePriority priority);
+        void ScheduleTimers(const std::shared_ptr<Subscriber>& subscriber);
+        bool CancelTimers(int id);
+        void RunTimers();
+        void SendHeartbeat();
+        void ExpireSubscribers();
+
+        std::atomic<bool> connected;
         bool running;
+
+        // Set on the I/O thread once the server has accepted the route table.
+        std::atomic<bool> routesNegotiated;
+        bool internRoutes;
+
+        // Set on the I/O thread once the server has accepted frame compression. Each direction
+        // has its own history, so the compressor is only used by the thread sending frames and
+        // the decompressor by the thread receiving them.
+        std::atomic<bool> compressionNegotiated;
+        bool compressFrames;
+        size_t compressionThreshold;
+        FrameCompressor frameCompressor;
+        FrameDecompressor frameDecompressor;
+        mutable std::mutex compressionLock;
+        std::map<std::pair<std::string, std::string>, CompressionStats> compressionStats;
+
+        // Responses carry the id of the request, each id belongs to at most one subscriber.
+        std::unordered_map<int, std::shared_ptr<Subscriber>> subscribers;
+
+        // Each lane of the write queue has a single consumer, the I/O thread, but messages
+        // may be written from several threads so producers are serialized with the lane's lock.
+        // A writer waiting for space holds the lock of its own lane only, so an upload
+        // filling the bulk lane does not hold up writes to the others.
+        // A message with a coalesce key waits in coalesced, the lane only holds its place.
+        struct QueuedMessage
+        {
+            std::optional<Message> msg;
+            std::uint64_t coalesceKey;
+        };
+
+        struct CoalescedMessage
+        {
+            Message msg;
+            int subscriberId;
+        };
+
+        struct WriteLane
+        {
+            WriteLane(int capacity, int weight);
+
+            RingBuffer<QueuedMessage> queue;
+            std::mutex lock;
+            std::atomic<bool> blocked;
+            WaitHandle spaceHandle;
+
+            // Deficit round robin, the bytes the lane may still send this turn.
+            size_t quantum;
+            size_t deficit;
+        };
+
+        inline WriteLane& Lane(WritePriority priority) const { return *writeLanes[int(priority)]; }
+        void CreateWriteLanes(const ConnectionOptions& options);
+        Message* NextMessage(WriteLane& lane);
+        bool Coalesce(Message& item, int subscriberId, WriteLane* lane);
+
+        std::unique_ptr<WriteLane> writeLanes[NUM_WRITE_PRIORITIES];
+        // Keyed messages which have not been reached by the I/O thread yet. A newer message
+        // replaces the older one in place, whose subscriber is handed to Process in superseded.
+        std::mutex coalesceLock;
+        std::unordered_map<std::uint64_t, CoalescedMessage> coalesced;
+        std::vector<int> superseded;
+        std::vector<int> supersededScratch;
+        std::atomic<bool> supersededPending;
+
+        RingBuffer<Message> readQueue;
+        std::atomic<bool> readBlocked;
+        WaitHandle readWaitHandle;
+        std::atomic<int> numWritesRejected;
+
+        // Messages taken from the write queue which have not been fully sent yet.
+        std::vector<Message> batch;
+        size_t batchIndex;
+        size_t batchOffset;
+        size_t batchBytes;
+        size_t maxBatchBytes;
+        bool tcpCork;
+
+        // Retries resend a copy of the request until the first response arrives.
+        struct RequestTimer
+        {
+            Message request;
+            WritePriority priority;
+            std::chrono::milliseconds retryInterval;
+            int retries;
+        };
+
+        // The timers run on the I/O thread, subscribers schedule and cancel
+        // theirs from the caller's thread so they are guarded by timerLock.
+        // Requests which ran out of time are handed back to Process in timedOut.
+        std::mutex timerLock;
+        TimerWheel timers;
+        std::unordered_map<int, RequestTimer> requestTimers;
+        std::vector<TimerWheel::Key> expiredTimers;
+        std::vector<int> timedOut;
+        std::vector<int> timedOutScratch;
+        std::atomic<bool> timeoutsPending;
+        Clock::time_point lastSend;
+#ifdef _WIN32
+        std::chrono::milliseconds NextTimerWait();
+        void ConfigureSocket(const ConnectionOptions& options);
+
         SOCKET sock;
-        std::vector<std::shared_ptr<Subscriber>> subscribers;
-        std::unique_ptr<std::thread> heartbeat;
         std::unique_ptr<std::thread> write;
         std::unique_ptr<std::thread> read;
-        ReaderWriterQueue<Message> writeQueue;
-        ReaderWriterQueue<Message> readQueue;
         WaitHandle writeWaitHandle;
-        WaitHandle readWaitHandle;
-        WaitHandle heartbeatHandle;
+        WaitHandle readSpaceHandle;
+        std::vector<WSABUF> buffers;
+#else
+        void Disconnect();
+        void Flush();
+        void ReadFrames();
+        void ReserveFrame();
+        void ArmTimer();
+
+        std::unique_ptr<Transport> transport;
+        // Shared with the other connections of a ConnectionGroup.
+        std::shared_ptr<Reactor> reactor;
+
+        // Received messages reference the chunk they arrived in rather than
+        // copying out of it. readPos is the start of the first unparsed frame.
+        FrameRef readChunk;
+        size_t readPos;
+        size_t readOffset;
+        std::vector<iovec> buffers;
+        bool corked;
+
+        // When a transport which can't poll for space last failed to write.
+        Clock::time_point flushRetry;
+
+        // The deadline the reactor will next call OnTimer at.
+        Clock::time_point armedDeadline;
+#endif
         int subscriberId;
-        int numBytesSent;
-        int numBytesReceived;
+        // Written on the I/O thread, read from any.
+        std::atomic<int> numBytesSent;
+        std::atomic<int> numBytesReceived;
+        std::atomic<int> numFramesSent;
+        std::atomic<int> numSendCalls;
     };
 }
 
-ClientConnectionImpl::ClientConnectionImpl(const std::string& host, int port)
-    : running(true), sock(0L), subscriberId(0), numBytesReceived(0), numBytesSent(0)
+#ifdef _WIN32
+ClientConnectionImpl::ClientConnectionImpl(const std::string& url, int port, const ConnectionOptions& options,
+    const std::shared_ptr<Reactor>& sharedReactor, const std::function<void()>& onPending)
+    :
+    running(true),
+    routesNegotiated(false),
+    internRoutes(options.internRoutes),
+    compressionNegotiated(false),
+    compressFrames(options.compressFrames),
+    compressionThreshold(size_t(std::max(options.compressionThreshold, 0))),
+    supersededPending(false),
+    readQueue(options.readQueueCapacity),
+    readBlocked(false),
+    numWritesRejected(0),
+    batchIndex(0),
+    batchOffset(0),
+    batchBytes(0),
+    maxBatchBytes(std::max(options.maxBatchBytes, 1)),
+    tcpCork(options.tcpCork),
+    timeoutsPending(false),
+    lastSend(Clock::now()),
+    sock(0L),
+    subscriberId(0),
+    numBytesSent(0),
+    numBytesReceived(0),
+    numFramesSent(0),
+    numSendCalls(0)
 {
-    connected = true;
+    CreateWriteLanes(options);
+    readWaitHandle.Listen(onPending);
+
+    // Unix sockets and shared memory are only implemented for POSIX.
+    Endpoint endpoint;
+    connected = Endpoint::Parse(url, port, endpoint) && endpoint.scheme == Endpoint::Scheme::Tcp;
 
     WSADATA wsaData;
-    const int error = WSAStartup(MAKEWORD(2, 2), &wsaData);
+    const int error = connected ? WSAStartup(MAKEWORD(2, 2), &wsaData) : 0;
     if (error != 0)
     {
         connected = false;
@@ -166,14 +496,14 @@ ClientConnectionImpl::ClientConnectionImpl(const std::string& host, int port)
     if (connected)
     {
         std::stringstream ss;
-        ss << port;
+        ss << endpoint.port;
 
         addrinfo hint;
         std::memset(&hint, 0, sizeof(hint));
         hint.ai_family = AF_UNSPEC;
         hint.ai_socktype = SOCK_STREAM;
 
-        const int retval = getaddrinfo(host.c_str(), ss.str().c_str(), &hint, &addresses);
+        const int retval = getaddrinfo(endpoint.host.c_str(), ss.str().c_str(), &hint, &addresses);
         if (retval != 0)
         {
             connected = false;
@@ -204,37 +534,28 @@ ClientConnectionImpl::ClientConnectionImpl(const std::string& host, int port)
 
     if (connected)
     {
-        write.reset(new std::thread(&ClientConnectionImpl::WriteThread, this));
-        read.reset(new std::thread(&ClientConnectionImpl::ReadThread, this));
-        heartbeat.reset(new std::thread(&ClientConnectionImpl::HeartbeatThread, this));
-    }
-}
+        ConfigureSocket(options);
 
-void ClientConnectionImpl::HeartbeatThread()
-{
-    // Sends a heartbeat message to the server at a fixed interval.
+        timers.Schedule(HEARTBEAT_TIMER, lastSend + HEARTBEAT_INTERVAL);
 
-    while (running)
-    {
-        //std::this_thread::sleep_for(std::chrono::seconds(30));
-        std::unique_lock<std::mutex>lock;
-        heartbeatHandle.WaitOne(lock, 30);
+        write.reset(new std::thread(&ClientConnectionImpl::WriteThread, this));
+        read.reset(new std::thread(&ClientConnectionImpl::ReadThread, this));
 
-        Message msg("HEARTBEAT", "");
-        msg.Prepare();
-        WriteMessage(msg);
+        if (internRoutes || compressFrames)
+        {
+            Negotiate();
+        }
     }
 }
 
 void ClientConnectionImpl::ReadThread()
 {
-    const int maxBytes = 2048*32;
-    unsigned char* bytes = new unsigned char[maxBytes];
+    unsigned char header[8];
 
     while (running)
     {
-        int consumed = recv(sock, (char*)bytes, 8, MSG_WAITALL);
-        if (consumed == -1)
+        int consumed = recv(sock, (char*)header, 8, MSG_WAITALL);
+        if (consumed <= 0)
         {
             // Disconnected
             break;
@@ -242,20 +563,23 @@ void ClientConnectionImpl::ReadThread()
 
         numBytesReceived += consumed;
 
+        const bool compressed = (header[3] & 0x80) != 0;
         const int totalBytes =
-            bytes[0] |
-            (bytes[1] << 8) |
-            (bytes[2] << 16) |
-            (bytes[3] << 24);
+            header[0] |
+            (header[1] << 8) |
+            (header[2] << 16) |
+            ((header[3] & 0x7F) << 24);
         const int id = 
-            bytes[4] |
-            (bytes[5] << 8) |
-            (bytes[6] << 16) |
-            (bytes[7] << 24);
+            header[4] |
+            (header[5] << 8) |
+            (header[6] << 16) |
+            (header[7] << 24);
 
-        consumed = recv(sock, (char*)bytes, totalBytes, MSG_WAITALL);
+        // The payload is received straight into a pooled frame sized from the header.
+        FrameRef frame = FramePool::Shared().Acquire(totalBytes);
+        consumed = recv(sock, (char*)frame.data(), totalBytes, MSG_WAITALL);
 
-        if (consumed == -1)
+        if (consumed < 0 || (consumed == 0 && totalBytes > 0))
         {
             // Disconnected
             break;
@@ -263,187 +587,1420 @@ void ClientConnectionImpl::ReadThread()
 
         numBytesReceived += consumed;
 
-        Message msg(bytes, totalBytes);
+        size_t size = size_t(totalBytes);
+        if (compressed)
+        {
+            FrameRef inflated;
+            if (!Decompress(frame.data(), size_t(totalBytes), inflated, size))
+            {
+                // The stream can not be followed any further.
+                break;
+            }
+            frame = std::move(inflated);
+        }
+
+        Message msg(frame, 0, int(size));
         msg.SetId(id);
-        readQueue.Enqueue(msg);
+        if (HandleControlMessage(msg))
+        {
+            continue;
+        }
+
+        while (!readQueue.TryPush(std::move(msg)) && running)
+        {
+            // Wait for Process to make room in the queue.
+            readBlocked = true;
+            if (readQueue.Size() == readQueue.Capacity())
+            {
+                std::unique_lock<std::mutex> lock;
+                readSpaceHandle.WaitOne(lock, 1);
+            }
+        }
+        readBlocked = false;
         readWaitHandle.Set();
     }
-
-    delete[] bytes;
 }
 
 void ClientConnectionImpl::WriteThread()
 {
     while (running)
     {
+        // Sleeps until there is something to send or the next timer is due.
         std::unique_lock<std::mutex>lock;
-        writeWaitHandle.WaitOne(lock);
+        writeWaitHandle.WaitOne(lock, NextTimerWait());
+
+        RunTimers();
 
-        while (writeQueue.Size() > 0)
+        // Everything queued is written with one vectored send per batch.
+        FillBatch();
+        while (batchIndex < batch.size())
         {
-            const Message msg = writeQueue.Dequeue();
+            buffers.clear();
+            for (size_t i = batchIndex; i < batch.size(); i++)
+            {
+                const size_t offset = i == batchIndex ? batchOffset : 0;
 
-            const unsigned char* buffer = msg.data();
-            const size_t size = msg.size();
+                WSABUF buffer;
+                buffer.buf = (CHAR*)(batch[i].data() + offset);
+                buffer.len = ULONG(batch[i].size() - offset);
+                buffers.push_back(buffer);
+            }
 
-            const int error = send(sock, (char*)buffer, (int)size, 0);
+            DWORD sent = 0;
+            if (WSASend(sock, buffers.data(), DWORD(buffers.size()), &sent, 0, NULL, NULL) != 0)
+            {
+                // Disconnected
+                batch.clear();
+                batchIndex = 0;
+                batchOffset = 0;
+                batchBytes = 0;
+                break;
+            }
 
-            numBytesSent += size;
+            ConsumeBatch(sent);
+            FillBatch();
         }
     }
 }
 
-void ClientConnectionImpl::WriteMessage(const Message& msg)
+std::chrono::milliseconds ClientConnectionImpl::NextTimerWait()
 {
-    writeQueue.Enqueue(msg);
-    writeWaitHandle.Set();
-}
+    Clock::time_point deadline;
+    {
+        std::lock_guard<std::mutex> lock(timerLock);
+        deadline = timers.NextDeadline();
+    }
 
-void ClientConnectionImpl::AddSubscriber(std::shared_ptr<Subscriber>& subscriber)
-{
-    subscriber->SetId(subscriberId++);
-    WriteMessage(subscriber->Request());
+    const auto now = Clock::now();
+    if (deadline <= now)
+    {
+        return std::chrono::milliseconds(0);
+    }
 
-    subscribers.push_back(subscriber);
+    // Round up so the thread does not wake just before the deadline.
+    const auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now) + std::chrono::milliseconds(1);
+    return std::min<std::chrono::milliseconds>(wait, HEARTBEAT_INTERVAL);
 }
 
-void ClientConnectionImpl::RemoveSubscriber(const std::shared_ptr<Subscriber>& subscriber)
+void ClientConnectionImpl::ConfigureSocket(const ConnectionOptions& options)
 {
-    const auto& it = std::find(subscribers.begin(), subscribers.end(), subscriber);
-    if (it != subscribers.end())
+    // Corking is not available with WinSock, the vectored send already
+    // hands the whole batch to the stack at once.
+    BOOL noDelay = options.tcpNoDelay ? TRUE : FALSE;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+
+    if (options.sendBufferSize > 0)
     {
-        subscribers.erase(it);
+        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (const char*)&options.sendBufferSize, sizeof(options.sendBufferSize));
     }
 }
 
-void ClientConnectionImpl::Process(bool wait)
+void ClientConnectionImpl::WakeWriter()
+{
+    writeWaitHandle.Set();
+}
+
+void ClientConnectionImpl::WakeReader()
+{
+    readSpaceHandle.Set();
+}
+
+#else
+
+ClientConnectionImpl::ClientConnectionImpl(const std::string& url, int port, const ConnectionOptions& options,
+    const std::shared_ptr<Reactor>& sharedReactor, const std::function<void()>& onPending)
+    :
+    running(true),
+    routesNegotiated(false),
+    internRoutes(options.internRoutes),
+    compressionNegotiated(false),
+    compressFrames(options.compressFrames),
+    compressionThreshold(size_t(std::max(options.compressionThreshold, 0))),
+    supersededPending(false),
+    readQueue(options.readQueueCapacity),
+    readBlocked(false),
+    numWritesRejected(0),
+    batchIndex(0),
+    batchOffset(0),
+    batchBytes(0),
+    maxBatchBytes(std::max(options.maxBatchBytes, 1)),
+    tcpCork(options.tcpCork),
+    timeoutsPending(false),
+    lastSend(Clock::now()),
+    readPos(0),
+    readOffset(0),
+    corked(false),
+    flushRetry(Clock::time_point::max()),
+    armedDeadline(Clock::time_point::max()),
+    subscriberId(0),
+    numBytesSent(0),
+    numBytesReceived(0),
+    numFramesSent(0),
+    numSendCalls(0)
 {
-    std::unique_lock<std::mutex> lock;
-    if (wait)
+    CreateWriteLanes(options);
+    readWaitHandle.Listen(onPending);
+
+    Endpoint endpoint;
+    if (Endpoint::Parse(url, port, endpoint))
     {
-        readWaitHandle.WaitOne(lock);
+        transport = Transport::Connect(endpoint, options);
     }
+    connected = transport != nullptr;
 
-    while (readQueue.Size() > 0)
+    if (connected)
     {
-        const Message msg = readQueue.Dequeue();
+        readChunk = FramePool::Shared().Acquire(READ_CHUNK_SIZE);
+
+        reactor = sharedReactor ? sharedReactor : std::make_shared<Reactor>();
+        reactor->Add(transport->Fd(), this);
+
+        timers.Schedule(HEARTBEAT_TIMER, lastSend + HEARTBEAT_INTERVAL);
+        ArmTimer();
+
+        if (internRoutes || compressFrames)
+        {
+            Negotiate();
+        }
+    }
+}
+
+void ClientConnectionImpl::Disconnect()
+{
+    // Called on the reactor thread when the server closes the connection.
+    connected = false;
+    reactor->Remove(this);
+    readWaitHandle.Set();
+}
 
-        // Add to a list as NewMessage can add/remove a subscriber..
-        std::vector<std::shared_ptr<Subscriber>> activate;
-        for (auto& sub : subscribers)
+void ClientConnectionImpl::OnReadable()
+{
+    while (!readBlocked)
+    {
+        const ssize_t consumed = transport->Read(readChunk.data() + readOffset, readChunk.capacity() - readOffset);
+        if (consumed == 0)
         {
-            if (sub->Request().NodeName() == msg.NodeName() &&
-                sub->Request().MessageName() == msg.MessageName() &&
-                sub->Id() == msg.Id())
+            Disconnect();
+            return;
+        }
+        else if (consumed < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            else if (errno != EAGAIN && errno != EWOULDBLOCK)
             {
-                activate.push_back(sub);
+                Disconnect();
+                return;
             }
+            break;
         }
 
-        for (auto& sub : activate)
+        readOffset += consumed;
+        numBytesReceived += int(consumed);
+
+        ReadFrames();
+        if (!connected)
         {
-            sub->NewMessage(msg);
+            return;
         }
     }
 }
 
-ClientConnectionImpl::~ClientConnectionImpl()
+void ClientConnectionImpl::ReadFrames()
 {
-    running = false;
-    closesocket(sock);
-    heartbeatHandle.Set();
-    writeWaitHandle.Set();
-
-    write->join();
-    heartbeat->join();
-    read->join();
-}
+    bool received = false;
+    while (readOffset - readPos >= 8)
+    {
+        if (readQueue.Size() == readQueue.Capacity())
+        {
+            // Stop reading from the socket until Process has made room.
+            readBlocked = true;
+            reactor->SetReadable(this, false);
+            break;
+        }
 
-// ==========================================================================
+        const unsigned char* header = readChunk.data() + readPos;
+        const bool compressed = (header[3] & 0x80) != 0;
+        const int totalBytes =
+            header[0] |
+            (header[1] << 8) |
+            (header[2] << 16) |
+            ((header[3] & 0x7F) << 24);
+        const int id =
+            header[4] |
+            (header[5] << 8) |
+            (header[6] << 16) |
+            (header[7] << 24);
+
+        if (readOffset - readPos - 8 < size_t(totalBytes))
+        {
+            break;
+        }
 
-ClientConnection::ClientConnection(const std::string& host, int port)
-{
-    impl = new ClientConnectionImpl(host, port);
-    security = new Security();
-}
+        // A compressed payload is decompressed into a frame of its own.
+        FrameRef inflated;
+        size_t size = size_t(totalBytes);
+        if (compressed && !Decompress(header + 8, size_t(totalBytes), inflated, size))
+        {
+            Disconnect();
+            return;
+        }
 
-bool ClientConnection::IsConnected()
-{
-    return impl->Connected();
-}
+        Message msg(compressed ? inflated : readChunk, compressed ? 0 : readPos + 8, int(size));
+        msg.SetId(id);
+        readPos += size_t(totalBytes) + 8;
 
-void ClientConnection::WriteMessage(const Message& msg)
-{
-    impl->WriteMessage(msg);
-}
+        if (!HandleControlMessage(msg))
+        {
+            readQueue.TryPush(std::move(msg));
+            received = true;
+        }
+    }
 
-void ClientConnection::AddSubscriber(std::shared_ptr<Subscriber> subscriber)
-{
-    impl->AddSubscriber(subscriber);
-}
+    ReserveFrame();
 
-void ClientConnection::RemoveSubscriber(const std::shared_ptr<Subscriber> subscriber)
-{
-    impl->RemoveSubscriber(subscriber);
+    if (received)
+    {
+        readWaitHandle.Set();
+    }
 }
 
-void ClientConnection::Process(bool wait)
+void ClientConnectionImpl::ReserveFrame()
 {
-    impl->Process(wait);
-}
+    // Makes sure the chunk can hold the rest of the pending frame.
+    const size_t pending = readOffset - readPos;
+    size_t required = 8;
+    if (pending >= 8)
+    {
+        const unsigned char* header = readChunk.data() + readPos;
+        const size_t totalBytes = size_t(
+            header[0] |
+            (header[1] << 8) |
+            (header[2] << 16) |
+            ((header[3] & 0x7F) << 24));
+        required += totalBytes;
+    }
+    required = std::max(required, pending + MIN_READ_SPACE);
 
-void ClientConnection::HashPassword(const std::string& password, Message& msg)
-{
-    unsigned char* hash;
-    unsigned int size;
-    security->SHA256(password, &hash, &size);
+    if (readPos + required <= readChunk.capacity())
+    {
+        return;
+    }
 
-    msg.WriteBytes(size, hash);
+    if (readChunk.unique() && required <= readChunk.capacity())
+    {
+        // No messages reference the chunk, so it can be reused.
+        std::memmove(readChunk.data(), readChunk.data() + readPos, pending);
+    }
+    else
+    {
+        // Only the bytes of the partially received frame are carried over.
+        FrameRef chunk = FramePool::Shared().Acquire(std::max(required, READ_CHUNK_SIZE));
+        std::memcpy(chunk.data(), readChunk.data() + readPos, pending);
+        readChunk = std::move(chunk);
+    }
 
-    delete[] hash;
+    readPos = 0;
+    readOffset = pending;
 }
 
-void ClientConnection::Logon(const std::string& username, const std::string& password)
+void ClientConnectionImpl::Flush()
 {
-    Message request("LOGIN_SVR", "LOGIN");
-    request.WriteString(username);
-    HashPassword(password, request);
-    std::shared_ptr<Subscriber> logSub = std::shared_ptr<Subscriber>(new Subscriber(request));
-    AddSubscriber(logSub);
-    logSub->Signal([this, sub2 = std::shared_ptr<Subscriber>(logSub)](Message& msg) {
-        RemoveSubscriber(sub2);
-        if (msg.ReadString() == "NACK")
+    FillBatch();
+
+    if (tcpCork && !corked && batchIndex < batch.size())
+    {
+        // Hold back partial segments until the batch has been written.
+        transport->Cork(true);
+        corked = true;
+    }
+
+    while (batchIndex < batch.size())
+    {
+        buffers.clear();
+        for (size_t i = batchIndex; i < batch.size(); i++)
         {
-            const int errCode = msg.ReadInt32();
-            const std::string errText = msg.ReadString();
-            OnLogonFailed(errCode, errText);
+            const size_t offset = i == batchIndex ? batchOffset : 0;
+
+            iovec buffer;
+            buffer.iov_base = (void*)(batch[i].data() + offset);
+            buffer.iov_len = batch[i].size() - offset;
+            buffers.push_back(buffer);
         }
-        else
+
+        const ssize_t sent = transport->Write(buffers.data(), int(buffers.size()));
+        if (sent < 0)
         {
-            OnLogonSuccess();
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // Resume once the transport has space again.
+                if (transport->PollsWritable())
+                {
+                    reactor->SetWritable(this, true);
+                }
+                else
+                {
+                    flushRetry = Clock::now() + FLUSH_RETRY_INTERVAL;
+                    ArmTimer();
+                }
+                return;
+            }
+
+            Disconnect();
+            return;
         }
-        });
+
+        ConsumeBatch(size_t(sent));
+        FillBatch();
+    }
+
+    if (corked)
+    {
+        transport->Cork(false);
+        corked = false;
+    }
+
+    reactor->SetWritable(this, false);
 }
 
-void ClientConnection::LogonHandler(const std::function<void(int errCode, const std::string& text)>& handler)
+void ClientConnectionImpl::OnWritable()
 {
-    logonHandler.active = true;
-    logonHandler.handler = handler;
+    Flush();
 }
 
-void ClientConnection::OnLogonSuccess()
+void ClientConnectionImpl::OnNotify()
 {
-    if (logonHandler.active)
+    if (readBlocked)
     {
-        logonHandler.handler(0, "");
+        readBlocked = false;
+        ReadFrames();
+        if (!readBlocked && connected)
+        {
+            // Catches up on anything the transport holds, which may not poll readable again.
+            reactor->SetReadable(this, true);
+            OnReadable();
+        }
     }
+
+    Flush();
+
+    // Subscribers added since may have brought a deadline forward.
+    ArmTimer();
 }
 
-void ClientConnection::OnLogonFailed(int errCode, const std::string& text)
+void ClientConnectionImpl::OnTimer()
 {
-    if (logonHandler.active)
+    armedDeadline = Clock::time_point::max();
+    if (flushRetry <= Clock::now())
     {
-        logonHandler.handler(errCode, text);
+        flushRetry = Clock::time_point::max();
+    }
+
+    RunTimers();
+    Flush();
+    ArmTimer();
+}
+
+void ClientConnectionImpl::ArmTimer()
+{
+    // The reactor holds a single deadline for the connection, the earliest in the wheel.
+    Clock::time_point deadline;
+    {
+        std::lock_guard<std::mutex> lock(timerLock);
+        deadline = timers.NextDeadline();
+    }
+    deadline = std::min(deadline, flushRetry);
+
+    if (deadline < armedDeadline)
+    {
+        armedDeadline = deadline;
+        reactor->SetTimer(this, deadline);
+    }
+}
+
+void ClientConnectionImpl::WakeWriter()
+{
+    if (reactor)
+    {
+        reactor->Notify(this);
+    }
+}
+
+void ClientConnectionImpl::WakeReader()
+{
+    if (reactor)
+    {
+        reactor->Notify(this);
+    }
+}
+
+#endif
+
+ClientConnectionImpl::WriteLane::WriteLane(int capacity, int weight)
+    :
+    queue(size_t(std::max(capacity, 1))),
+    blocked(false),
+    quantum(size_t(std::max(weight, 1)) * WRITE_QUANTUM),
+    deficit(0)
+{
+}
+
+void ClientConnectionImpl::CreateWriteLanes(const ConnectionOptions& options)
+{
+    writeLanes[int(WritePriority::Bulk)].reset(new WriteLane(options.bulkQueueCapacity, options.bulkWeight));
+    writeLanes[int(WritePriority::Normal)].reset(new WriteLane(options.writeQueueCapacity, options.normalWeight));
+    writeLanes[int(WritePriority::Interactive)].reset(new WriteLane(options.interactiveQueueCapacity, options.interactiveWeight));
+}
+
+int ClientConnectionImpl::WriteQueueHighWaterMark() const
+{
+    int highWaterMark = 0;
+    for (auto& lane : writeLanes)
+    {
+        highWaterMark = std::max(highWaterMark, int(lane->queue.HighWaterMark()));
+    }
+    return highWaterMark;
+}
+
+Message* ClientConnectionImpl::NextMessage(WriteLane& lane)
+{
+    // Called on the I/O thread. Once a coalesced message is reached it can no longer
+    // be replaced, so it is moved into the lane.
+    QueuedMessage* next = lane.queue.Front();
+    if (next && next->coalesceKey != 0)
+    {
+        std::lock_guard<std::mutex> lock(coalesceLock);
+
+        const auto& it = coalesced.find(next->coalesceKey);
+        next->msg.emplace(std::move(it->second.msg));
+        next->coalesceKey = 0;
+        coalesced.erase(it);
+    }
+
+    return next ? &*next->msg : nullptr;
+}
+
+void ClientConnectionImpl::FillBatch()
+{
+    // Drains the write lanes into the current batch so that a burst
+    // of small messages is written with a single call. The lanes take turns,
+    // highest priority first, each sending up to its quantum per turn.
+    // Unused quantum carries over while a lane has messages waiting.
+    bool waiting = true;
+    while (waiting && batchBytes < maxBatchBytes && batch.size() - batchIndex < MAX_BATCH_FRAMES)
+    {
+        waiting = false;
+        for (int i = NUM_WRITE_PRIORITIES - 1; i >= 0; i--)
+        {
+            WriteLane& lane = *writeLanes[i];
+            Message* next = NextMessage(lane);
+            if (!next)
+            {
+                lane.deficit = 0;
+                continue;
+            }
+
+            lane.deficit += lane.quantum;
+            while (next && next->size() <= lane.deficit &&
+                batchBytes < maxBatchBytes && batch.size() - batchIndex < MAX_BATCH_FRAMES)
+            {
+                lane.deficit -= next->size();
+
+                Message msg = std::move(*lane.queue.TryPop()->msg);
+                if (compressionNegotiated && msg.size() - 8 >= compressionThreshold)
+                {
+                    msg = Compress(msg);
+                }
+
+                batchBytes += msg.size();
+                batch.push_back(std::move(msg));
+
+                if (lane.blocked)
+                {
+                    lane.spaceHandle.Set();
+                }
+
+                next = NextMessage(lane);
+            }
+
+            if (next)
+            {
+                waiting = true;
+            }
+            else
+            {
+                lane.deficit = 0;
+            }
+        }
+    }
+}
+
+void ClientConnectionImpl::ConsumeBatch(size_t sent)
+{
+    numSendCalls++;
+    numBytesSent += int(sent);
+    lastSend = Clock::now();
+    batchBytes -= sent;
+
+    while (sent > 0)
+    {
+        const size_t remaining = batch[batchIndex].size() - batchOffset;
+        if (sent < remaining)
+        {
+            batchOffset += sent;
+            break;
+        }
+
+        sent -= remaining;
+        batchIndex++;
+        batchOffset = 0;
+        numFramesSent++;
+    }
+
+    if (batchIndex == batch.size())
+    {
+        batch.clear();
+        batchIndex = 0;
+    }
+}
+
+void ClientConnectionImpl::Negotiate()
+{
+    // Ids are the positions in the table. A server which does not know the
+    // handshake never replies, in which case the names continue to be sent.
+    const int numRoutes = internRoutes ? Routes::Count() : 0;
+    Message msg("CONNECTION", "NEGOTIATE");
+    msg.WriteInt32(numRoutes);
+    for (int i = 0; i < numRoutes; i++)
+    {
+        msg.WriteString(Routes::NodeName(i));
+        msg.WriteString(Routes::MessageName(i));
+    }
+
+    // The server checks the payload layouts against its own.
+    msg.WriteInt32(2);
+    msg.WriteString(std::string(ObjectSchema::Name));
+    msg.WriteInt32(int(ObjectSchema::Hash));
+    msg.WriteString(std::string(ObjectAddSchema::Name));
+    msg.WriteInt32(int(ObjectAddSchema::Hash));
+
+    // The server replies with the capabilities it accepts.
+    msg.WriteInt32(compressFrames ? CAPABILITY_COMPRESSION : 0);
+
+    msg.SetId(NEGOTIATE_ID);
+    msg.Prepare();
+
+    WriteMessage(std::move(msg), WritePriority::Normal, WriteMode::Block);
+}
+
+bool ClientConnectionImpl::HandleControlMessage(Message& msg)
+{
+    // Called on the I/O thread for each received message,
+    // returns true if the message was consumed by the connection.
+    if (msg.Id() != NEGOTIATE_ID ||
+        msg.NodeName() != "CONNECTION" ||
+        msg.MessageName() != "NEGOTIATE")
+    {
+        return false;
+    }
+
+    const bool accepted = msg.ReadString() == "ACK";
+    routesNegotiated = accepted && internRoutes;
+
+    // Servers which predate capabilities end the reply there.
+    const int capabilities = accepted && msg.BytesRemaining() >= 4 ? msg.ReadInt32() : 0;
+    compressionNegotiated = compressFrames && (capabilities & CAPABILITY_COMPRESSION) != 0;
+    return true;
+}
+
+Message ClientConnectionImpl::Compress(const Message& msg)
+{
+    // Called on the thread sending frames, as the frames must be compressed in the order they are sent.
+    Message compressed = msg.Compress(frameCompressor);
+
+    std::lock_guard<std::mutex> lock(compressionLock);
+    CompressionStats& stats = compressionStats[{ msg.NodeName(), msg.MessageName() }];
+    stats.frames++;
+    stats.uncompressedBytes += msg.size() - 8;
+    stats.compressedBytes += compressed.size() - 8;
+    return compressed;
+}
+
+bool ClientConnectionImpl::Decompress(const unsigned char* data, size_t size, FrameRef& frame, size_t& rawSize)
+{
+    // Called on the thread receiving frames, in the order they arrive.
+    if (!FrameDecompressor::RawSize(data, size, rawSize))
+    {
+        return false;
+    }
+
+    frame = FramePool::Shared().Acquire(std::max<size_t>(rawSize, 1));
+    return frameDecompressor.Decompress(data, size, frame.data());
+}
+
+std::vector<CompressionStats> ClientConnectionImpl::GetCompressionStats() const
+{
+    std::vector<CompressionStats> result;
+
+    std::lock_guard<std::mutex> lock(compressionLock);
+    for (const auto& it : compressionStats)
+    {
+        CompressionStats stats = it.second;
+        stats.nodeName = it.first.first;
+        stats.messageName = it.first.second;
+        result.push_back(std::move(stats));
+    }
+    return result;
+}
+
+Message ClientConnectionImpl::Encode(const Message& msg) const
+{
+    // The queued copy is made in the compact form when the server supports it.
+    if (routesNegotiated && msg.CanCompact())
+    {
+        return msg.Compact();
+    }
+
+    return Message(msg);
+}
+
+Message ClientConnectionImpl::Encode(Message&& msg) const
+{
+    if (routesNegotiated && msg.CanCompact())
+    {
+        return msg.Compact();
+    }
+
+    return std::move(msg);
+}
+
+bool ClientConnectionImpl::WriteMessage(const Message& msg, WritePriority priority, WriteMode mode)
+{
+    return Enqueue(Encode(msg), priority, mode, -1);
+}
+
+bool ClientConnectionImpl::WriteMessage(Message&& msg, WritePriority priority, WriteMode mode)
+{
+    return Enqueue(Encode(std::move(msg)), priority, mode, -1);
+}
+
+bool ClientConnectionImpl::TryWriteMessage(Message& msg, WritePriority priority)
+{
+    WriteLane& lane = Lane(priority);
+    QueuedMessage queued;
+    queued.coalesceKey = msg.CoalesceKey();
+    {
+        // A writer holding the lock may be waiting for space, in which case the lane is full.
+        std::unique_lock<std::mutex> producer(lane.lock, std::try_to_lock);
+        const bool space = producer.owns_lock() && lane.queue.Size() < lane.queue.Capacity();
+
+        if (queued.coalesceKey != 0)
+        {
+            // Replacing a waiting message does not need space in the lane.
+            Message encoded = Encode(msg);
+            if (!Coalesce(encoded, -1, space ? &lane : nullptr))
+            {
+                return false;
+            }
+            msg = std::move(encoded);
+        }
+        else
+        {
+            if (!space)
+            {
+                return false;
+            }
+
+            // Only this producer can fill the lane, so the push cannot fail.
+            queued.msg.emplace(Encode(std::move(msg)));
+            lane.queue.TryPush(std::move(queued));
+        }
+    }
+
+    WakeWriter();
+    return true;
+}
+
+bool ClientConnectionImpl::Coalesce(Message& item, int subscriberId, WriteLane* lane)
+{
+    // Returns true if the message replaced a waiting one with the same key. Otherwise, if
+    // lane is given, the caller holds its producer lock and true is returned if the message
+    // took a place in it. The place is taken under the coalesce lock, so no other writer
+    // can replace a message which is not queued, and the I/O thread does not reach the
+    // place before the message is stored for it.
+    bool replaced = false;
+    {
+        std::lock_guard<std::mutex> lock(coalesceLock);
+
+        const std::uint64_t key = item.CoalesceKey();
+        const auto& it = coalesced.find(key);
+        if (it == coalesced.end())
+        {
+            if (!lane || !lane->queue.TryPush(QueuedMessage{ std::nullopt, key }))
+            {
+                return false;
+            }
+
+            coalesced.emplace(key, CoalescedMessage{ std::move(item), subscriberId });
+            return true;
+        }
+
+        if (it->second.subscriberId >= 0)
+        {
+            superseded.push_back(it->second.subscriberId);
+            supersededPending = true;
+            replaced = true;
+        }
+
+        it->second.msg = std::move(item);
+        it->second.subscriberId = subscriberId;
+    }
+
+    if (replaced)
+    {
+        readWaitHandle.Set();
+    }
+
+    return true;
+}
+
+bool ClientConnectionImpl::Enqueue(Message&& item, WritePriority priority, WriteMode mode, int subscriberId)
+{
+    QueuedMessage queued;
+    queued.coalesceKey = item.CoalesceKey();
+    if (queued.coalesceKey == 0)
+    {
+        queued.msg.emplace(std::move(item));
+    }
+    else if (Coalesce(item, subscriberId, nullptr))
+    {
+        // The message took the place of an older one so it never waits for space.
+        return true;
+    }
+
+    WriteLane& lane = Lane(priority);
+    {
+        // A keyed message is only stored once it has a place, so a failed write leaves
+        // nothing behind for another writer to have replaced.
+        std::lock_guard<std::mutex> producer(lane.lock);
+        while (queued.coalesceKey != 0 ? !Coalesce(item, subscriberId, &lane) : !lane.queue.TryPush(std::move(queued)))
+        {
+            if (!connected || mode == WriteMode::FailFast)
+            {
+                numWritesRejected++;
+                return false;
+            }
+
+            // The lane is full, wait for the I/O thread to drain it.
+            lane.blocked = true;
+            WakeWriter();
+            if (lane.queue.Size() == lane.queue.Capacity())
+            {
+                std::unique_lock<std::mutex> lock;
+                lane.spaceHandle.WaitOne(lock, 1);
+            }
+        }
+        lane.blocked = false;
+    }
+
+    WakeWriter();
+    return true;
+}
+
+bool ClientConnectionImpl::TryEnqueue(Message&& item, WritePriority priority)
+{
+    // The I/O thread must never wait for space in the write queue as it is the
+    // only thread which drains it, so the message is dropped when the lane is busy.
+    WriteLane& lane = Lane(priority);
+    std::unique_lock<std::mutex> producer(lane.lock, std::try_to_lock);
+    return producer.owns_lock() && lane.queue.TryPush(QueuedMessage{ std::move(item), 0 });
+}
+
+void ClientConnectionImpl::ScheduleTimers(const std::shared_ptr<Subscriber>& subscriber)
+{
+    const bool retry = subscriber->Retries() > 0 && subscriber->RetryInterval().count() > 0;
+    const bool deadline = subscriber->Timeout().count() > 0;
+    if (!retry && !deadline)
+    {
+        return;
+    }
+
+    // The I/O thread picks up the new timers when it is woken for the request.
+    const int id = subscriber->Id();
+    const auto now = Clock::now();
+    std::lock_guard<std::mutex> lock(timerLock);
+
+    requestTimers.insert_or_assign(id, RequestTimer{ subscriber->Request(), DefaultPriority(subscriber->Request()),
+        subscriber->RetryInterval(), retry ? subscriber->Retries() : 0 });
+
+    if (retry)
+    {
+        timers.Schedule(RequestTimerKey(id, RETRY_TIMER), now + subscriber->RetryInterval());
+    }
+
+    if (deadline)
+    {
+        timers.Schedule(RequestTimerKey(id, DEADLINE_TIMER), now + subscriber->Timeout());
+    }
+}
+
+bool ClientConnectionImpl::CancelTimers(int id)
+{
+    // Returns false if the request had no timers or they were already cancelled.
+    std::lock_guard<std::mutex> lock(timerLock);
+
+    const auto& it = requestTimers.find(id);
+    if (it == requestTimers.end())
+    {
+        return false;
+    }
+
+    requestTimers.erase(it);
+    timers.Cancel(RequestTimerKey(id, DEADLINE_TIMER));
+    timers.Cancel(RequestTimerKey(id, RETRY_TIMER));
+    return true;
+}
+
+void ClientConnectionImpl::RunTimers()
+{
+    // Called on the I/O thread.
+    bool heartbeat = false;
+    bool expired = false;
+    {
+        std::lock_guard<std::mutex> lock(timerLock);
+
+        const auto now = Clock::now();
+        timers.Expire(now, expiredTimers);
+
+        for (auto key : expiredTimers)
+        {
+            if (key == HEARTBEAT_TIMER)
+            {
+                heartbeat = true;
+                continue;
+            }
+
+            const int id = int(std::uint32_t(key >> 2));
+            const auto& it = requestTimers.find(id);
+            if (it == requestTimers.end())
+            {
+                continue;
+            }
+
+            if ((key & 3) == DEADLINE_TIMER)
+            {
+                // The entry is left for Process, which drops the timeout if the
+                // response has already been queued.
+                timers.Cancel(RequestTimerKey(id, RETRY_TIMER));
+                timedOut.push_back(id);
+                expired = true;
+            }
+            else
+            {
+                RequestTimer& timer = it->second;
+                if (TryEnqueue(Encode(timer.request), timer.priority))
+                {
+                    timer.retries--;
+                }
+
+                if (timer.retries > 0)
+                {
+                    timers.Schedule(key, now + timer.retryInterval);
+                }
+            }
+        }
+
+        expiredTimers.clear();
+    }
+
+    if (heartbeat)
+    {
+        SendHeartbeat();
+    }
+
+    if (expired)
+    {
+        timeoutsPending = true;
+        readWaitHandle.Set();
+    }
+}
+
+void ClientConnectionImpl::SendHeartbeat()
+{
+    // Any frame keeps the connection alive, so the heartbeat
+    // is only sent once the connection has been idle for the interval.
+    const auto now = Clock::now();
+    Clock::time_point next = lastSend + HEARTBEAT_INTERVAL;
+    if (next <= now)
+    {
+        Message msg("HEARTBEAT", "");
+        msg.Prepare();
+        TryEnqueue(Encode(std::move(msg)), WritePriority::Normal);
+
+        next = now + HEARTBEAT_INTERVAL;
+    }
+
+    std::lock_guard<std::mutex> lock(timerLock);
+    timers.Schedule(HEARTBEAT_TIMER, next);
+}
+
+void ClientConnectionImpl::AddSubscriber(std::shared_ptr<Subscriber>& subscriber)
+{
+    // A subscriber added again is only reachable through its new id.
+    const auto& it = subscribers.find(subscriber->Id());
+    if (it != subscribers.end() && it->second == subscriber)
+    {
+        subscribers.erase(it);
+        CancelTimers(subscriber->Id());
+    }
+
+    subscriber->SetId(subscriberId++);
+    ScheduleTimers(subscriber);
+    Enqueue(Encode(subscriber->Request()), DefaultPriority(subscriber->Request()), WriteMode::Block, subscriber->Id());
+
+    subscribers.emplace(subscriber->Id(), subscriber);
+}
+
+void ClientConnectionImpl::RemoveSubscriber(const std::shared_ptr<Subscriber>& subscriber)
+{
+    const auto& it = subscribers.find(subscriber->Id());
+    if (it != subscribers.end() && it->second == subscriber)
+    {
+        subscribers.erase(it);
+        CancelTimers(subscriber->Id());
+    }
+}
+
+bool ClientConnectionImpl::HasPending()
+{
+    return readQueue.Size() > 0 || timeoutsPending || supersededPending;
+}
+
+int ClientConnectionImpl::PendingFd()
+{
+#ifdef _WIN32
+    return -1;
+#else
+    const int fd = readWaitHandle.EventFd();
+    if (HasPending())
+    {
+        readWaitHandle.Set();
+    }
+    return fd;
+#endif
+}
+
+void ClientConnectionImpl::WaitForPending(std::chrono::milliseconds timeout)
+{
+    // The handle is set after anything is queued for Process, so the
+    // check cannot miss a message which arrives just before the wait.
+    const bool forever = timeout == std::chrono::milliseconds::max();
+    const auto deadline = forever ? Clock::time_point::max() : Clock::now() + timeout;
+    while (!HasPending() && connected)
+    {
+        std::unique_lock<std::mutex> lock;
+        if (forever)
+        {
+            readWaitHandle.WaitOne(lock);
+            continue;
+        }
+
+        const auto now = Clock::now();
+        if (now >= deadline)
+        {
+            break;
+        }
+        readWaitHandle.WaitOne(lock, std::chrono::ceil<std::chrono::milliseconds>(deadline - now));
+    }
+}
+
+int ClientConnectionImpl::Process(std::chrono::milliseconds timeout, const ProcessBudget& budget)
+{
+    if (timeout.count() > 0)
+    {
+        WaitForPending(timeout);
+    }
+
+    // At least one message is dispatched per call so a slow callback cannot stall the queue.
+    const bool timed = budget.maxTime.count() > 0;
+    const auto deadline = timed ? Clock::now() + budget.maxTime : Clock::time_point::max();
+    int processed = 0;
+    while (budget.maxMessages <= 0 || processed < budget.maxMessages)
+    {
+        if (timed && processed > 0 && Clock::now() >= deadline)
+        {
+            break;
+        }
+
+        auto msg = readQueue.TryPop();
+        if (!msg)
+        {
+            break;
+        }
+
+        processed++;
+        Dispatch(*msg);
+    }
+
+    if (timeoutsPending)
+    {
+        ExpireSubscribers();
+    }
+
+    if (supersededPending)
+    {
+        CompleteSuperseded();
+    }
+
+    if (readBlocked)
+    {
+        WakeReader();
+    }
+
+    // Whatever the budget left behind keeps the pending descriptor readable.
+    readWaitHandle.Reset();
+    if (HasPending())
+    {
+        readWaitHandle.Set();
+    }
+
+    return processed;
+}
+
+void ClientConnectionImpl::Dispatch(Message& msg)
+{
+    const auto& it = subscribers.find(msg.Id());
+    if (it == subscribers.end())
+    {
+        return;
+    }
+
+    // Routed messages are matched on the id, the names are only compared for unknown pairs.
+    const Message& request = it->second->Request();
+    const bool matches = request.Route() >= 0 || msg.Route() >= 0 ?
+        request.Route() == msg.Route() :
+        request.NodeName() == msg.NodeName() && request.MessageName() == msg.MessageName();
+    if (matches)
+    {
+        // Hold a reference as NewMessage can add/remove subscribers.
+        const std::shared_ptr<Subscriber> sub = it->second;
+        if (sub->Timeout().count() > 0 || sub->Retries() > 0)
+        {
+            // The first response ends the request's timeout and retries.
+            CancelTimers(sub->Id());
+        }
+        sub->NewMessage(msg);
+    }
+}
+
+void ClientConnectionImpl::ExpireSubscribers()
+{
+    // Expiring a subscriber runs its callbacks, which may process the connection again.
+    std::vector<int> expired;
+    expired.swap(timedOutScratch);
+
+    timeoutsPending = false;
+    {
+        std::lock_guard<std::mutex> lock(timerLock);
+        expired.swap(timedOut);
+    }
+
+    for (const int id : expired)
+    {
+        // Skips requests which were answered or removed after the deadline passed.
+        if (!CancelTimers(id))
+        {
+            continue;
+        }
+
+        const auto& it = subscribers.find(id);
+        if (it != subscribers.end())
+        {
+            const std::shared_ptr<Subscriber> sub = it->second;
+            subscribers.erase(it);
+            sub->Expire();
+        }
+    }
+
+    expired.clear();
+    timedOutScratch.swap(expired);
+}
+
+void ClientConnectionImpl::CompleteSuperseded()
+{
+    std::vector<int> replaced;
+    replaced.swap(supersededScratch);
+
+    supersededPending = false;
+    {
+        std::lock_guard<std::mutex> lock(coalesceLock);
+        replaced.swap(superseded);
+    }
+
+    for (const int id : replaced)
+    {
+        // The replaced request was never sent, so no response will arrive for it.
+        CancelTimers(id);
+
+        const auto& it = subscribers.find(id);
+        if (it != subscribers.end())
+        {
+            const std::shared_ptr<Subscriber> sub = it->second;
+            subscribers.erase(it);
+            sub->Supersede();
+        }
+    }
+
+    replaced.clear();
+    supersededScratch.swap(replaced);
+}
+
+ClientConnectionImpl::~ClientConnectionImpl()
+{
+    running = false;
+#ifdef _WIN32
+    closesocket(sock);
+    writeWaitHandle.Set();
+
+    write->join();
+    read->join();
+#else
+    if (reactor)
+    {
+        reactor->Remove(this);
+        reactor.reset();
+    }
+
+    transport.reset();
+#endif
+}
+
+// ==========================================================================
+
+ClientConnection::ClientConnection(const std::string& host, int port)
+{
+    impl = new ClientConnectionImpl(host, port, ConnectionOptions(), nullptr, nullptr);
+    security = new Security();
+}
+
+ClientConnection::ClientConnection(const std::string& host, int port, const ConnectionOptions& options)
+{
+    impl = new ClientConnectionImpl(host, port, options, nullptr, nullptr);
+    security = new Security();
+}
+
+ClientConnection::ClientConnection(const std::string& url)
+{
+    impl = new ClientConnectionImpl(url, DEFAULT_PORT, ConnectionOptions(), nullptr, nullptr);
+    security = new Security();
+}
+
+ClientConnection::ClientConnection(const std::string& url, const ConnectionOptions& options)
+{
+    impl = new ClientConnectionImpl(url, DEFAULT_PORT, options, nullptr, nullptr);
+    security = new Security();
+}
+
+ClientConnection::ClientConnection(const std::string& url, int port, const ConnectionOptions& options,
+    const std::shared_ptr<Reactor>& reactor, const std::function<void()>& onPending)
+{
+    impl = new ClientConnectionImpl(url, port, options, reactor, onPending);
+    security = new Security();
+}
+
+bool ClientConnection::IsConnected()
+{
+    return impl->Connected();
+}
+
+bool ClientConnection::WriteMessage(const Message& msg)
+{
+    return impl->WriteMessage(msg, DefaultPriority(msg), WriteMode::Block);
+}
+
+bool ClientConnection::WriteMessage(Message&& msg)
+{
+    const WritePriority priority = DefaultPriority(msg);
+    return impl->WriteMessage(std::move(msg), priority, WriteMode::Block);
+}
+
+bool ClientConnection::WriteMessage(const Message& msg, WritePriority priority, WriteMode mode)
+{
+    return impl->WriteMessage(msg, priority, mode);
+}
+
+bool ClientConnection::WriteMessage(Message&& msg, WritePriority priority, WriteMode mode)
+{
+    return impl->WriteMessage(std::move(msg), priority, mode);
+}
+
+bool ClientConnection::TryWriteMessage(Message& msg)
+{
+    return impl->TryWriteMessage(msg, DefaultPriority(msg));
+}
+
+bool ClientConnection::TryWriteMessage(Message& msg, WritePriority priority)
+{
+    return impl->TryWriteMessage(msg, priority);
+}
+
+void ClientConnection::AddSubscriber(std::shared_ptr<Subscriber> subscriber)
+{
+    impl->AddSubscriber(subscriber);
+}
+
+void ClientConnection::RemoveSubscriber(const std::shared_ptr<Subscriber> subscriber)
+{
+    impl->RemoveSubscriber(subscriber);
+}
+
+void ClientConnection::Process(bool wait)
+{
+    Process(wait ? std::chrono::milliseconds::max() : std::chrono::milliseconds(0));
+}
+
+int ClientConnection::Process(std::chrono::milliseconds timeout, const ProcessBudget& budget)
+{
+    const int processed = impl->Process(timeout, budget);
+
+    if (!pendingRequests.empty())
+    {
+        CheckRequests();
+    }
+
+    return processed;
+}
+
+bool ClientConnection::HasPending()
+{
+    return impl->HasPending();
+}
+
+int ClientConnection::PendingFd()
+{
+    return impl->PendingFd();
+}
+
+namespace Oxygen
+{
+    // Does not own the request, which is kept alive by the coroutine awaiting it.
+    struct RequestAwaiter
+    {
+        PendingRequest* request;
+        std::optional<Response>* result;
+
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> awaiting) { return request->Start(awaiting, result); }
+        void await_resume() const noexcept {}
+    };
+}
+
+Task<Response> ClientConnection::Request(Message msg)
+{
+    return Request(std::move(msg), RequestOptions());
+}
+
+Task<Response> ClientConnection::Request(Message msg, RequestOptions options)
+{
+    std::optional<Response> result;
+
+    std::shared_ptr<PendingRequest> request = std::make_shared<PendingRequest>(this, std::move(msg), options);
+    request->_self = request;
+
+    co_await RequestAwaiter{ request.get(), &result };
+    co_return std::move(*result);
+}
+
+void ClientConnection::CheckRequests()
+{
+    // Completing a request resumes its coroutine, which can issue or complete
+    // other requests, so the requests are checked from a copy of the list.
+    std::vector<std::shared_ptr<PendingRequest>> requests;
+    requests.swap(expireScratch);
+    requests.assign(pendingRequests.begin(), pendingRequests.end());
+
+    const bool connected = IsConnected();
+    for (auto& request : requests)
+    {
+        request->Check(connected);
+    }
+
+    requests.clear();
+    expireScratch.swap(requests);
+}
+
+void ClientConnection::FinishRequest(PendingRequest* request)
+{
+    const size_t index = request->_index;
+    if (index < pendingRequests.size() && pendingRequests[index].get() == request)
+    {
+        if (index != pendingRequests.size() - 1)
+        {
+            pendingRequests[index] = std::move(pendingRequests.back());
+            pendingRequests[index]->_index = index;
+        }
+        pendingRequests.pop_back();
+    }
+}
+
+void ClientConnection::HashPassword(const std::string& password, Message& msg)
+{
+    unsigned char* hash;
+    unsigned int size;
+    security->SHA256(password, &hash, &size);
+
+    msg.WriteBytes(size, hash);
+
+    delete[] hash;
+}
+
+void ClientConnection::Logon(const std::string& username, const std::string& password)
+{
+    Message request("LOGIN_SVR", "LOGIN");
+    request.WriteString(username);
+    HashPassword(password, request);
+    std::shared_ptr<Subscriber> logSub = std::shared_ptr<Subscriber>(new Subscriber(request));
+    AddSubscriber(logSub);
+    logSub->Signal([this, sub2 = std::shared_ptr<Subscriber>(logSub)](Message& msg) {
+        RemoveSubscriber(sub2);
+        if (msg.ReadString() == "NACK")
+        {
+            const int errCode = msg.ReadInt32();
+            const std::string errText = msg.ReadString();
+            OnLogonFailed(errCode, errText);
+        }
+        else
+        {
+            OnLogonSuccess();
+        }
+        });
+}
+
+void ClientConnection::LogonHandler(const std::function<void(int errCode, const std::string& text)>& handler)
+{
+    logonHandler.active = true;
+    logonHandler.handler = handler;
+}
+
+void ClientConnection::OnLogonSuccess()
+{
+    if (logonHandler.active)
+    {
+        logonHandler.handler(0, "");
+    }
+}
+
+void ClientConnection::OnLogonFailed(int errCode, const std::string& text)
+{
+    if (logonHandler.active)
+    {
+        logonHandler.handler(errCode, text);
     }
 }
 
@@ -457,8 +2014,63 @@ int ClientConnection::NumBytesReceived() const
     return impl->NumBytesReceived();
 }
 
+int ClientConnection::ReadQueueHighWaterMark() const
+{
+    return impl->ReadQueueHighWaterMark();
+}
+
+int ClientConnection::WriteQueueHighWaterMark() const
+{
+    return impl->WriteQueueHighWaterMark();
+}
+
+int ClientConnection::WriteQueueDepth(WritePriority priority) const
+{
+    return impl->WriteQueueDepth(priority);
+}
+
+int ClientConnection::WriteQueueHighWaterMark(WritePriority priority) const
+{
+    return impl->WriteQueueHighWaterMark(priority);
+}
+
+int ClientConnection::NumWritesRejected() const
+{
+    return impl->NumWritesRejected();
+}
+
+int ClientConnection::NumFramesSent() const
+{
+    return impl->NumFramesSent();
+}
+
+int ClientConnection::NumSendCalls() const
+{
+    return impl->NumSendCalls();
+}
+
+bool ClientConnection::IsCompressionNegotiated() const
+{
+    return impl->CompressionNegotiated();
+}
+
+std::vector<CompressionStats> ClientConnection::GetCompressionStats() const
+{
+    return impl->GetCompressionStats();
+}
+
 ClientConnection::~ClientConnection()
 {
+    // Requests still waiting complete as disconnected, so their coroutines are not left suspended.
+    while (!pendingRequests.empty())
+    {
+        std::shared_ptr<PendingRequest> request = pendingRequests.back();
+        if (!request->Check(false))
+        {
+            FinishRequest(request.get());
+        }
+    }
+
     delete impl;
     impl = nullptr;
 
@@ -1,7 +1,9 @@
 ﻿#pragma once
+#include <chrono>
 #include <string>
 #include <memory>
 #include <functional>
+#include <vector>
 
 namespace Oxygen
 {
@@ -11,28 +13,168 @@ namespace Oxygen
     class Message;
     class Subscriber;
     class Security;
+    class Response;
+    class PendingRequest;
+    class ConnectionGroup;
+    class Reactor;
+    struct RequestOptions;
+    template<typename T> class Task;
+
+    // Outgoing messages wait in one of three bounded lanes. The lane is chosen from
+    // the message's route, see Routes::Priority, unless the writer gives one.
+    enum class WritePriority : int
+    {
+        Bulk,
+        Normal,
+        Interactive
+    };
+
+    constexpr int NUM_WRITE_PRIORITIES = 3;
+
+    // What a write does when its lane is full.
+    enum class WriteMode
+    {
+        // Waits for the I/O thread to make room.
+        Block,
+        // Drops the message and returns false.
+        FailFast
+    };
+
+    struct ConnectionOptions
+    {
+        // Number of messages which can be queued between the I/O thread
+        // and the caller, rounded up to a power of two.
+        // writeQueueCapacity is the size of the normal lane.
+        int readQueueCapacity = 1024;
+        int writeQueueCapacity = 1024;
+        int bulkQueueCapacity = 64;
+        int interactiveQueueCapacity = 1024;
+
+        // The I/O thread takes turns draining the lanes, each turn sending up to
+        // the lane's weight in multiples of 4 KB, so a lane full of bulk data
+        // delays an interactive message by at most one turn.
+        int bulkWeight = 1;
+        int normalWeight = 4;
+        int interactiveWeight = 8;
+
+        // Queued messages are coalesced into vectored sends of up to maxBatchBytes,
+        // so Nagle's algorithm is disabled by default. Corking is only supported on Linux.
+        bool tcpNoDelay = true;
+        bool tcpCork = false;
+        int maxBatchBytes = 64 * 1024;
+
+        // Caps the socket's send buffer, zero leaves it to the system. Bytes queued in
+        // the kernel have already left the write lanes, so a smaller buffer lets
+        // interactive messages overtake more of a bulk transfer on slow links.
+        int sendBufferSize = 0;
+
+        // Bytes in each direction for a shm:// connection, rounded up to a power of two.
+        int sharedMemoryCapacity = 4 * 1024 * 1024;
+
+        // Offers the server the route table after connecting, once accepted known
+        // node/message pairs are sent as an id in place of the two names.
+        bool internRoutes = true;
+
+        // Offers the server frame compression after connecting. Once accepted, payloads of
+        // at least compressionThreshold bytes are compressed on the I/O thread, smaller
+        // frames bypass the compressor so their latency is unchanged.
+        bool compressFrames = true;
+        int compressionThreshold = 512;
+    };
+
+    // The frames a connection has compressed for one node/message pair.
+    struct CompressionStats
+    {
+        std::string nodeName;
+        std::string messageName;
+        long long frames = 0;
+        long long uncompressedBytes = 0;
+        long long compressedBytes = 0;
+
+        inline double Ratio() const { return compressedBytes > 0 ? double(uncompressedBytes) / double(compressedBytes) : 1.0; }
+    };
+
+    // Bounds the work done by a single Process call, zero leaves a limit off.
+    // Messages beyond the budget stay queued for the next call.
+    struct ProcessBudget
+    {
+        int maxMessages = 0;
+        std::chrono::microseconds maxTime = std::chrono::microseconds(0);
+    };
 
     class ClientConnection
     {
     public:
         ClientConnection(const std::string& host, int port);
+        ClientConnection(const std::string& host, int port, const ConnectionOptions& options);
+
+        // Connects to a tcp://, unix:// or shm:// URL, see Endpoint in Transport.h.
+        // Same-host connections skip the TCP stack, Unix and shared memory are not available on Windows.
+        explicit ClientConnection(const std::string& url);
+        ClientConnection(const std::string& url, const ConnectionOptions& options);
         
         bool IsConnected();
 
-        void WriteMessage(const Message& msg);
+        // Returns false if the message was dropped because its lane was full and either
+        // the write was FailFast or the connection has closed.
+        // A message with a coalesce key replaces a queued one with the same key in place,
+        // which never waits for space. Messages sharing a key should use the same priority.
+        bool WriteMessage(const Message& msg);
+        bool WriteMessage(Message&& msg);
+        bool WriteMessage(const Message& msg, WritePriority priority, WriteMode mode = WriteMode::Block);
+        bool WriteMessage(Message&& msg, WritePriority priority, WriteMode mode = WriteMode::Block);
+
+        // Never waits, if the lane is full the message is left with the caller to send later.
+        bool TryWriteMessage(Message& msg);
+        bool TryWriteMessage(Message& msg, WritePriority priority);
 
         void AddSubscriber(std::shared_ptr<Subscriber> subscriber);
         void RemoveSubscriber(const std::shared_ptr<Subscriber> subscriber);
         void Process(bool wait);
 
+        // Waits up to the timeout for something to process, milliseconds::max() waits
+        // until something arrives or the connection closes. Returns the number of
+        // received messages dispatched.
+        int Process(std::chrono::milliseconds timeout, const ProcessBudget& budget = ProcessBudget());
+
+        // True when a received message, timeout or superseded request is waiting for Process.
+        bool HasPending();
+
+        // A descriptor which polls readable while HasPending is true, so Process can be
+        // driven from another event loop. Owned by the connection, -1 on Windows.
+        int PendingFd();
+
+        // Sends the request and completes with the response, include AsyncRequest.h to co_await it.
+        // Responses, timeouts and cancellations are all delivered from Process.
+        Task<Response> Request(Message msg);
+        Task<Response> Request(Message msg, RequestOptions options);
+
         void Logon(const std::string& username, const std::string& password);
         void LogonHandler(const std::function<void(int errCode, const std::string& text)>& handler);
 
         int NumBytesSent() const;
         int NumBytesReceived() const;
+        int ReadQueueHighWaterMark() const;
+        int WriteQueueHighWaterMark() const;
+        int WriteQueueDepth(WritePriority priority) const;
+        int WriteQueueHighWaterMark(WritePriority priority) const;
+        int NumWritesRejected() const;
+        int NumFramesSent() const;
+        int NumSendCalls() const;
+
+        // Whether the server accepted frame compression, the counters are
+        // totals for the frames sent since, one entry per node/message pair.
+        bool IsCompressionNegotiated() const;
+        std::vector<CompressionStats> GetCompressionStats() const;
 
         ~ClientConnection();
     private:
+        friend class PendingRequest;
+        friend class ConnectionGroup;
+
+        // Used by ConnectionGroup, onPending is called from any thread when there is something to process.
+        ClientConnection(const std::string& url, int port, const ConnectionOptions& options,
+            const std::shared_ptr<Reactor>& reactor, const std::function<void()>& onPending);
 
         struct Handler
         {
@@ -43,9 +185,15 @@ namespace Oxygen
         void HashPassword(const std::string& password, Message& msg);
         void OnLogonSuccess();
         void OnLogonFailed(int errCode, const std::string& text);
+        void CheckRequests();
+        void FinishRequest(PendingRequest* request);
 
         ClientConnectionImpl* impl;
         Security* security;
         Handler logonHandler;
+
+        // Requests waiting for a response, each knows its own index.
+        std::vector<std::shared_ptr<PendingRequest>> pendingRequests;
+        std::vector<std::shared_ptr<PendingRequest>> expireScratch;
     };
 }
@@ -0,0 +1,257 @@
+#include "ConnectionGroup.h"
+#ifndef _WIN32
+#include "Reactor.h"
+#endif
+#include <algorithm>
+#include <atomic>
+
+using namespace Oxygen;
+
+struct ConnectionGroup::Entry
+{
+    Entry() : dispatched(0) {}
+
+    int Run(const ProcessBudget& budget);
+
+    // Guards against the connection being processed on two threads at once.
+    std::mutex lock;
+    std::unique_ptr<ClientConnection> conn;
+    std::atomic<long long> dispatched;
+
+    // Schedules Run the same way the connection does when it has something pending.
+    std::function<void()> notify;
+    std::mutex postLock;
+    std::vector<std::function<void()>> posted;
+    std::vector<std::function<void()>> postedScratch;
+};
+
+int ConnectionGroup::Entry::Run(const ProcessBudget& budget)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (!conn)
+    {
+        // The group has closed the connection.
+        return 0;
+    }
+
+    std::vector<std::function<void()>> work;
+    work.swap(postedScratch);
+    {
+        std::lock_guard<std::mutex> postGuard(postLock);
+        work.swap(posted);
+    }
+
+    for (auto& item : work)
+    {
+        item();
+    }
+
+    work.clear();
+    postedScratch.swap(work);
+
+    const int processed = conn->Process(std::chrono::milliseconds(0), budget);
+    dispatched += processed;
+    return processed;
+}
+
+ConnectionGroup::ConnectionGroup(int numThreads)
+    :
+    ConnectionGroup(numThreads, ProcessBudget())
+{
+}
+
+ConnectionGroup::ConnectionGroup(int numThreads, const ProcessBudget& budget)
+    :
+    _budget(budget)
+{
+#ifndef _WIN32
+    for (int i = 0; i < std::max(numThreads, 1); i++)
+    {
+        _reactors.push_back(std::make_shared<Reactor>());
+    }
+#endif
+}
+
+ClientConnection* ConnectionGroup::Connect(const std::string& host, int port)
+{
+    return Connect(host, port, ConnectionOptions(), Executor());
+}
+
+ClientConnection* ConnectionGroup::Connect(const std::string& host, int port, const ConnectionOptions& options)
+{
+    return Connect(host, port, options, Executor());
+}
+
+ClientConnection* ConnectionGroup::Connect(const std::string& url)
+{
+    return Connect(url, DEFAULT_PORT, ConnectionOptions(), Executor());
+}
+
+ClientConnection* ConnectionGroup::Connect(const std::string& url, const ConnectionOptions& options)
+{
+    return Connect(url, DEFAULT_PORT, options, Executor());
+}
+
+ClientConnection* ConnectionGroup::Connect(const std::string& url, const ConnectionOptions& options, const Executor& executor)
+{
+    return Connect(url, DEFAULT_PORT, options, executor);
+}
+
+ClientConnection* ConnectionGroup::Connect(const std::string& host, int port, const ConnectionOptions& options, const Executor& executor)
+{
+    std::shared_ptr<Entry> entry = std::make_shared<Entry>();
+
+    std::function<void()> onPending;
+    if (executor)
+    {
+        // Posted work keeps the entry alive, the connection itself is closed by the group.
+        std::weak_ptr<Entry> weak = entry;
+        const ProcessBudget budget = _budget;
+        onPending = [weak, executor, budget]() {
+            if (std::shared_ptr<Entry> owner = weak.lock())
+            {
+                executor([owner, budget]() { owner->Run(budget); });
+            }
+        };
+    }
+    else
+    {
+        Entry* ready = entry.get();
+        onPending = [this, ready]() { Ready(ready); };
+    }
+
+    entry->notify = onPending;
+
+    std::shared_ptr<Reactor> reactor;
+#ifndef _WIN32
+    // Connections are spread evenly as none are removed before the group is destroyed.
+    reactor = _reactors[_entries.size() % _reactors.size()];
+#endif
+
+    ClientConnection* conn = nullptr;
+    {
+        // The connection can become pending before it has been stored.
+        std::lock_guard<std::mutex> lock(entry->lock);
+        entry->conn.reset(new ClientConnection(host, port, options, reactor, onPending));
+        conn = entry->conn.get();
+    }
+
+    _entries.push_back(std::move(entry));
+    return conn;
+}
+
+void ConnectionGroup::Post(size_t index, std::function<void()> work)
+{
+    Entry& entry = *_entries[index];
+    {
+        std::lock_guard<std::mutex> lock(entry.postLock);
+        entry.posted.push_back(std::move(work));
+    }
+
+    entry.notify();
+}
+
+void ConnectionGroup::Ready(Entry* entry)
+{
+    {
+        std::lock_guard<std::mutex> lock(_readyLock);
+        _ready.push_back(entry);
+    }
+
+    _readyCondition.notify_one();
+}
+
+int ConnectionGroup::Process(std::chrono::milliseconds timeout)
+{
+    std::vector<Entry*> ready;
+    ready.swap(_readyScratch);
+    {
+        std::unique_lock<std::mutex> lock(_readyLock);
+        const auto isReady = [this]() { return !_ready.empty(); };
+        if (timeout == std::chrono::milliseconds::max())
+        {
+            _readyCondition.wait(lock, isReady);
+        }
+        else if (timeout.count() > 0)
+        {
+            _readyCondition.wait_for(lock, timeout, isReady);
+        }
+
+        ready.swap(_ready);
+    }
+
+    // A connection left with work by the budget marks itself ready again for the next call.
+    int processed = 0;
+    for (Entry* entry : ready)
+    {
+        processed += entry->Run(_budget);
+    }
+
+    ready.clear();
+    _readyScratch.swap(ready);
+    return processed;
+}
+
+ClientConnection* ConnectionGroup::Connection(size_t index) const
+{
+    return _entries[index]->conn.get();
+}
+
+int ConnectionGroup::NumThreads() const
+{
+#ifdef _WIN32
+    // Each connection has a read and a write thread.
+    return int(_entries.size()) * 2;
+#else
+    return int(_reactors.size());
+#endif
+}
+
+void ConnectionGroup::Accumulate(const Entry& entry, ConnectionStats& stats)
+{
+    ClientConnection* conn = entry.conn.get();
+
+    stats.connections++;
+    stats.connected += conn->IsConnected() ? 1 : 0;
+    stats.pending += conn->HasPending() ? 1 : 0;
+    stats.bytesSent += conn->NumBytesSent();
+    stats.bytesReceived += conn->NumBytesReceived();
+    stats.framesSent += conn->NumFramesSent();
+    stats.sendCalls += conn->NumSendCalls();
+    stats.writesRejected += conn->NumWritesRejected();
+    stats.messagesDispatched += entry.dispatched;
+    stats.readQueueHighWaterMark = std::max(stats.readQueueHighWaterMark, conn->ReadQueueHighWaterMark());
+    stats.writeQueueHighWaterMark = std::max(stats.writeQueueHighWaterMark, conn->WriteQueueHighWaterMark());
+}
+
+ConnectionStats ConnectionGroup::Stats() const
+{
+    ConnectionStats stats;
+    for (const auto& entry : _entries)
+    {
+        Accumulate(*entry, stats);
+    }
+    return stats;
+}
+
+ConnectionStats ConnectionGroup::Stats(size_t index) const
+{
+    ConnectionStats stats;
+    Accumulate(*_entries[index], stats);
+    return stats;
+}
+
+ConnectionGroup::~ConnectionGroup()
+{
+    // The connections are closed here rather than on whichever thread lets go of
+    // the entry last, after waiting for any executor still processing them.
+    for (auto& entry : _entries)
+    {
+        std::unique_ptr<ClientConnection> conn;
+        {
+            std::lock_guard<std::mutex> lock(entry->lock);
+            conn.swap(entry->conn);
+        }
+        conn.reset();
+    }
+}
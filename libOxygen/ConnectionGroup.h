@@ -0,0 +1,92 @@
+#pragma once
+#include "ClientConnection.h"
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace Oxygen
+{
+    // Runs work for a ConnectionGroup on a thread of the caller's choosing, such as a
+    // job system or worker pool. It may be called from an I/O thread or from within
+    // the work it was given, so the work must be queued rather than run straight away.
+    using Executor = std::function<void(std::function<void()>)>;
+
+    struct ConnectionStats
+    {
+        int connections = 0;
+        int connected = 0;
+        // Connections with messages, timeouts or superseded requests waiting to be processed.
+        int pending = 0;
+        long long bytesSent = 0;
+        long long bytesReceived = 0;
+        long long framesSent = 0;
+        long long sendCalls = 0;
+        long long writesRejected = 0;
+        long long messagesDispatched = 0;
+        // The highest of the connections' high water marks.
+        int readQueueHighWaterMark = 0;
+        int writeQueueHighWaterMark = 0;
+    };
+
+    // Owns a set of connections which share a fixed pool of I/O threads, so the number
+    // of threads stays the same however many connections are opened. A connection is
+    // processed either by ConnectionGroup::Process or on the executor it was opened with,
+    // never on two threads at once, and only when it has something to process.
+    // Subscribers should be added from the thread which processes their connection, see Post.
+    // The group itself is not thread safe. On Windows each connection keeps its own threads.
+    class ConnectionGroup
+    {
+    public:
+        explicit ConnectionGroup(int numThreads);
+        // The budget bounds each call to the Process of a single connection.
+        ConnectionGroup(int numThreads, const ProcessBudget& budget);
+
+        ClientConnection* Connect(const std::string& host, int port);
+        ClientConnection* Connect(const std::string& host, int port, const ConnectionOptions& options);
+        ClientConnection* Connect(const std::string& host, int port, const ConnectionOptions& options, const Executor& executor);
+
+        // Connects to a tcp://, unix:// or shm:// URL.
+        ClientConnection* Connect(const std::string& url);
+        ClientConnection* Connect(const std::string& url, const ConnectionOptions& options);
+        ClientConnection* Connect(const std::string& url, const ConnectionOptions& options, const Executor& executor);
+
+        // Processes the connections opened without an executor which have something pending,
+        // waiting up to the timeout for one to. Returns the number of messages dispatched.
+        int Process(std::chrono::milliseconds timeout);
+
+        // Runs the work on the thread which processes the connection at the index,
+        // before its next Process. Can be called from any thread but not during Connect.
+        void Post(size_t index, std::function<void()> work);
+
+        inline size_t NumConnections() const { return _entries.size(); }
+        ClientConnection* Connection(size_t index) const;
+        int NumThreads() const;
+
+        // Totals across the group, or for the connection at the index.
+        ConnectionStats Stats() const;
+        ConnectionStats Stats(size_t index) const;
+
+        ~ConnectionGroup();
+
+    private:
+        struct Entry;
+
+        void Ready(Entry* entry);
+        static void Accumulate(const Entry& entry, ConnectionStats& stats);
+
+        ProcessBudget _budget;
+        std::vector<std::shared_ptr<Reactor>> _reactors;
+
+        // Connections without an executor which Process has yet to visit.
+        std::mutex _readyLock;
+        std::condition_variable _readyCondition;
+        std::vector<Entry*> _ready;
+        std::vector<Entry*> _readyScratch;
+
+        std::vector<std::shared_ptr<Entry>> _entries;
+    };
+}
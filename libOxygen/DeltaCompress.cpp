@@ -1,180 +1,485 @@
 #include "DeltaCompress.h"
+#include "DeltaKernels.h"
+#include "Endian.h"
+#include "WorkerPool.h"
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <functional>
 
 using namespace Oxygen;
 
 constexpr char UNCOMPRESSED_BLOCK = 0;
 constexpr char DELTA_COMPRESSED_BLOCK = 1;
+constexpr char COPY_BLOCK = 2;
+constexpr char CHUNK_INDEX_BLOCK = 3;
 
-static void CalculateDeltas(
-    const unsigned char* initialData,
-    const unsigned char* newData,
-    int initialDataOffset, 
-    int newDataOffset,
-    int newDataLength,
-    std::vector<unsigned char> &delta)
+// A versioned delta starts with a byte with the top bit set, the first byte of the
+// original format is always a block type.
+constexpr unsigned char VERSIONED_FORMAT = 0x80;
+constexpr unsigned char FORMAT_VERSION = 3;
+
+// The oldest versioned format which still decodes, it has no chunk index.
+constexpr unsigned char MIN_FORMAT_VERSION = 2;
+
+// Equal sized payloads are encoded this many bytes at a time.
+constexpr int DELTA_WINDOW = 64 * 1024;
+
+// Larger payloads are split into chunks of this many bytes, a multiple of the window, which
+// are encoded and decoded on their own. The size does not depend on the number of threads,
+// so neither does the delta.
+constexpr int CHUNK_SIZE = 1024 * 1024;
+
+// The most bytes a chunk's entry in the index takes.
+constexpr size_t MAX_CHUNK_ENTRY = 10;
+
+// Copies are found by indexing each block of this many bytes of the initial data.
+constexpr int MATCH_BLOCK_SIZE = 16;
+constexpr std::uint32_t HASH_MULTIPLIER = 0x01000193;
+
+// The index stops growing at 4 MB, larger initial data only keeps the first block for each bucket.
+constexpr int MAX_TABLE_BITS = 20;
+
+// Chunks are spread over the shared pool unless told otherwise. The shared pool is only
+// started by the first chunked payload, so programs which never send one have no threads.
+static WorkerPool* deltaWorkers = nullptr;
+static bool deltaWorkersSet = false;
+
+static inline void WriteVarint(unsigned char* dst, size_t& op, std::uint32_t value)
 {
-    for (int i = 0; i < newDataLength; i++)
+    while (value >= 0x80)
     {
-        delta.push_back((unsigned char)(initialData[i + initialDataOffset] - newData[i + newDataOffset]));
+        dst[op++] = (unsigned char)(value | 0x80);
+        value >>= 7;
     }
+    dst[op++] = (unsigned char)value;
 }
 
-static void WriteBlock(
-    std::vector<unsigned char>& stream,
-    const unsigned char* data,
-    int dataLength,
-    char flags,
-    int offset)
+static inline size_t VarintSize(std::uint32_t value)
 {
-    stream.push_back(flags);
+    size_t size = 1;
+    while (value >= 0x80)
+    {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
 
-    if (flags == DELTA_COMPRESSED_BLOCK)
+static inline bool ReadVarint(const unsigned char* data, int size, int& pos, int& value)
+{
+    // Values are at most five bytes and must fit in an int.
+    std::uint32_t result = 0;
+    for (int shift = 0; shift < 35; shift += 7)
     {
-        stream.push_back((unsigned char)(dataLength & 0xFF));
-        stream.push_back((unsigned char)((dataLength >> 8) & 0xFF));
+        if (pos >= size)
+        {
+            return false;
+        }
 
-        // Then run length encode the data.
-        unsigned char value = data[0];
-        int count = 1;
-        for (int i = 1; i < dataLength; i++)
+        const unsigned char byte = data[pos++];
+        if (shift == 28 && byte > 0x07)
         {
-            if (data[i] == value)
-            {
-                count++;
-            }
-            else
-            {
-                stream.push_back(value);
-                stream.push_back((unsigned char)(count & 0xFF));
-                stream.push_back((unsigned char)((count >> 8) & 0xFF));
+            return false;
+        }
 
-                value = data[i];
-                count = 1;
-            }
+        result |= std::uint32_t(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            value = int(result);
+            return true;
         }
+    }
+    return false;
+}
 
-        stream.push_back(value);
-        stream.push_back((unsigned char)(count & 0xFF));
-        stream.push_back((unsigned char)((count >> 8) & 0xFF));
+static void WriteInsert(unsigned char* dst, size_t& op, const unsigned char* data, int length)
+{
+    if (length == 0)
+    {
+        return;
     }
-    else if (flags == UNCOMPRESSED_BLOCK)
+
+    dst[op++] = UNCOMPRESSED_BLOCK;
+    WriteVarint(dst, op, std::uint32_t(length));
+    std::memcpy(dst + op, data, length);
+    op += length;
+}
+
+static void WriteCopy(unsigned char* dst, size_t& op, int offset, int length)
+{
+    dst[op++] = COPY_BLOCK;
+    WriteVarint(dst, op, std::uint32_t(offset));
+    WriteVarint(dst, op, std::uint32_t(length));
+}
+
+static void WriteDeltaWindow(unsigned char* dst, size_t& op, const unsigned char* initialData, const unsigned char* newData, int length)
+{
+    // Run length encodes the differences, which are found without being stored. A window
+    // which changed too much to be smaller that way is inserted as it is instead.
+    const DeltaKernels& kernels = DeltaKernels::Get();
+    const size_t start = op;
+    const size_t limit = start + 1 + VarintSize(std::uint32_t(length)) + size_t(length);
+
+    dst[op++] = DELTA_COMPRESSED_BLOCK;
+    WriteVarint(dst, op, std::uint32_t(length));
+
+    int i = 0;
+    while (i < length && op < limit)
     {
-        stream.push_back((unsigned char)(dataLength & 0xFF));
-        stream.push_back((unsigned char)((dataLength >> 8) & 0xFF));
+        const int count = int(kernels.differenceRunLength(initialData + i, newData + i, size_t(length - i)));
 
-        for (int i = 0; i < dataLength; i++)
+        dst[op++] = (unsigned char)(initialData[i] - newData[i]);
+        WriteVarint(dst, op, std::uint32_t(count));
+
+        i += count;
+    }
+
+    if (i < length || op > limit)
+    {
+        op = start;
+        WriteInsert(dst, op, newData, length);
+    }
+}
+
+static std::uint32_t BlockHash(const unsigned char* data)
+{
+    std::uint32_t hash = 0;
+    for (int i = 0; i < MATCH_BLOCK_SIZE; i++)
+    {
+        hash = hash * HASH_MULTIPLIER + data[i];
+    }
+    return hash;
+}
+
+static inline size_t Bucket(std::uint32_t hash, int bits)
+{
+    return (hash * 2654435761u) >> (32 - bits);
+}
+
+struct MatchTable
+{
+    std::vector<int> entries;
+    int bits = 0;
+};
+
+static void BuildMatchTable(MatchTable& table, const unsigned char* initialData, int numInitialBytes)
+{
+    // Each block of the initial data is indexed by its hash. The first block with a hash is
+    // kept, a match is extended past it anyway.
+    const int numBlocks = numInitialBytes / MATCH_BLOCK_SIZE;
+    if (numBlocks == 0)
+    {
+        return;
+    }
+
+    int bits = 4;
+    while ((1 << bits) < numBlocks * 2 && bits < MAX_TABLE_BITS)
+    {
+        bits++;
+    }
+
+    table.bits = bits;
+    table.entries.assign(size_t(1) << bits, -1);
+    for (int i = 0; i < numBlocks; i++)
+    {
+        int& entry = table.entries[Bucket(BlockHash(initialData + i * MATCH_BLOCK_SIZE), bits)];
+        if (entry < 0)
         {
-            stream.push_back((unsigned char)data[offset + i]);
+            entry = i * MATCH_BLOCK_SIZE;
         }
     }
 }
 
-static int FindSubArray(const unsigned char* longer, const unsigned char* shorter, int longerLength, int shorterLength)
+static void WriteMatches(unsigned char* dst, size_t& op, const MatchTable& table,
+    const unsigned char* initialData, int numInitialBytes,
+    const unsigned char* newData, int begin, int end)
 {
-    if (longerLength <= shorterLength)
+    // The same hash is rolled over the new data from begin to end a byte at a time. A hit is
+    // checked and extended both ways into a copy, the bytes in between are inserted as they
+    // are. Runs in linear time and reads nothing of the new data outside the range.
+    if (table.entries.empty() || end - begin < MATCH_BLOCK_SIZE)
     {
-        return -2;
+        WriteInsert(dst, op, newData + begin, end - begin);
+        return;
     }
 
-    for (int i = 0; i < longerLength; i++)
+    // Removes the byte leaving the window from the hash.
+    std::uint32_t outFactor = 1;
+    for (int i = 1; i < MATCH_BLOCK_SIZE; i++)
     {
-        bool success = true;
-        for (int j = 0; j < shorterLength; j++)
+        outFactor *= HASH_MULTIPLIER;
+    }
+
+    int literal = begin;
+    int pos = begin;
+    std::uint32_t hash = BlockHash(newData + pos);
+    while (pos + MATCH_BLOCK_SIZE <= end)
+    {
+        const int candidate = table.entries[Bucket(hash, table.bits)];
+        if (candidate >= 0 && std::memcmp(initialData + candidate, newData + pos, MATCH_BLOCK_SIZE) == 0)
         {
-            if (longer[i + j] != shorter[j])
+            int start = pos;
+            int source = candidate;
+            int length = MATCH_BLOCK_SIZE;
+            while (start + length < end && source + length < numInitialBytes &&
+                newData[start + length] == initialData[source + length])
+            {
+                length++;
+            }
+
+            while (start > literal && source > 0 && newData[start - 1] == initialData[source - 1])
             {
-                success = false;
-                break;
+                start--;
+                source--;
+                length++;
             }
+
+            WriteInsert(dst, op, newData + literal, start - literal);
+            WriteCopy(dst, op, source, length);
+
+            pos = start + length;
+            literal = pos;
+            if (pos + MATCH_BLOCK_SIZE <= end)
+            {
+                hash = BlockHash(newData + pos);
+            }
+            continue;
         }
 
-        if (success)
+        if (pos + MATCH_BLOCK_SIZE < end)
         {
-            return i;
+            hash = (hash - newData[pos] * outFactor) * HASH_MULTIPLIER + newData[pos + MATCH_BLOCK_SIZE];
         }
+        pos++;
+    }
+
+    WriteInsert(dst, op, newData + literal, end - literal);
+}
+
+static void WriteChunk(unsigned char* dst, size_t& op, const MatchTable& table,
+    const unsigned char* initialData, int numInitialBytes,
+    const unsigned char* newData, int numNewDataBytes, int begin, int end)
+{
+    if (numInitialBytes == numNewDataBytes)
+    {
+        // The layout is unchanged, so the differences are mostly zero and run length encode well.
+        // Each window is encoded on its own, so nothing is held for the whole payload.
+        for (int offset = begin; offset < end; offset += DELTA_WINDOW)
+        {
+            const int length = std::min(end - offset, DELTA_WINDOW);
+            WriteDeltaWindow(dst, op, initialData + offset, newData + offset, length);
+        }
+    }
+    else
+    {
+        // Bytes inserted or removed in the middle leave the rest to be copied from the initial data.
+        WriteMatches(dst, op, table, initialData, numInitialBytes, newData, begin, end);
+    }
+}
+
+static inline size_t ChunkBound(int numBytes)
+{
+    // A copy covers at least a match block, so costs at most a byte more than inserting it would,
+    // and a delta window costs at most the insert it falls back to.
+    const size_t size = size_t(numBytes);
+    return size + size / MATCH_BLOCK_SIZE + 32;
+}
+
+static void ForEachChunk(int numChunks, const std::function<void(int)>& task)
+{
+    WorkerPool* workers = deltaWorkersSet ? deltaWorkers : nullptr;
+    if (!deltaWorkersSet && numChunks > 1)
+    {
+        workers = &WorkerPool::Shared();
+    }
+
+    if (workers)
+    {
+        workers->ForEach(numChunks, task);
+        return;
+    }
+
+    for (int i = 0; i < numChunks; i++)
+    {
+        task(i);
+    }
+}
+
+void Oxygen::SetDeltaWorkerPool(WorkerPool* pool)
+{
+    deltaWorkers = pool;
+    deltaWorkersSet = true;
+}
+
+size_t Oxygen::CompressBound(int /*numInitialBytes*/, int numNewDataBytes)
+{
+    if (numNewDataBytes <= CHUNK_SIZE)
+    {
+        return ChunkBound(numNewDataBytes);
     }
 
-    return -1;
+    // Each chunk is encoded into room for the largest one after room for the largest index.
+    const size_t numChunks = (size_t(numNewDataBytes) + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    return 32 + numChunks * (MAX_CHUNK_ENTRY + ChunkBound(CHUNK_SIZE));
 }
 
-static void WriteData(std::vector<unsigned char>& stream,
-    const unsigned char* longer, const unsigned char* shorter,
-    int longerLength, int shorterLength, int offset)
+int Oxygen::Compress(const unsigned char* initialData, int numInitialBytes, const unsigned char* newData, int numNewDataBytes, unsigned char* deltaData)
 {
-    int length = shorterLength;
-    std::vector<unsigned char> delta;
-    CalculateDeltas(longer, shorter, length, offset, 0, delta);
+    size_t op = 0;
+    deltaData[op++] = VERSIONED_FORMAT | FORMAT_VERSION;
+
+    // The initial data is indexed once, the chunks only read the index.
+    MatchTable table;
+    if (numInitialBytes != numNewDataBytes && numNewDataBytes >= MATCH_BLOCK_SIZE)
+    {
+        BuildMatchTable(table, initialData, numInitialBytes);
+    }
 
-    if (offset > 0)
+    if (numNewDataBytes <= CHUNK_SIZE)
     {
-        const int uncompressedLength = offset;
-        WriteBlock(stream, longer, UNCOMPRESSED_BLOCK, 0, uncompressedLength);
+        WriteChunk(deltaData, op, table, initialData, numInitialBytes, newData, numNewDataBytes, 0, numNewDataBytes);
+        return int(op);
     }
 
-    WriteBlock(stream, delta.data(), int(delta.size()), DELTA_COMPRESSED_BLOCK, offset);
+    // Each chunk is written to its own part of the output in parallel, then the index is
+    // written and the chunks moved down after it.
+    const int numChunks = int((size_t(numNewDataBytes) + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    const size_t first = op + 8 + size_t(numChunks) * MAX_CHUNK_ENTRY;
+    const size_t stride = ChunkBound(CHUNK_SIZE);
+
+    std::vector<size_t> sizes(numChunks);
+    auto encode = [&](int chunk)
+    {
+        const int begin = chunk * CHUNK_SIZE;
+        const int end = std::min(numNewDataBytes - begin, CHUNK_SIZE) + begin;
+
+        const size_t start = first + size_t(chunk) * stride;
+        size_t chunkOp = start;
+        WriteChunk(deltaData, chunkOp, table, initialData, numInitialBytes, newData, numNewDataBytes, begin, end);
+        sizes[chunk] = chunkOp - start;
+    };
+
+    ForEachChunk(numChunks, encode);
 
-    if (offset + length < longerLength)
+    deltaData[op++] = CHUNK_INDEX_BLOCK;
+    WriteVarint(deltaData, op, std::uint32_t(numChunks));
+    for (int i = 0; i < numChunks; i++)
     {
-        const int uncompressedLength = offset + length;
-        WriteBlock(stream, longer, UNCOMPRESSED_BLOCK, uncompressedLength, longerLength - uncompressedLength);
+        WriteVarint(deltaData, op, std::uint32_t(std::min(numNewDataBytes - i * CHUNK_SIZE, CHUNK_SIZE)));
+        WriteVarint(deltaData, op, std::uint32_t(sizes[i]));
     }
+
+    for (int i = 0; i < numChunks; i++)
+    {
+        std::memmove(deltaData + op, deltaData + first + size_t(i) * stride, sizes[i]);
+        op += sizes[i];
+    }
+
+    return int(op);
 }
 
 int Oxygen::Compress(const unsigned char* initialData, int numInitialBytes, const unsigned char* newData, int numNewDataBytes, unsigned char** deltaData)
 {
-    std::vector<unsigned char> stream;
-    std::vector<unsigned char> delta;
+    *deltaData = new unsigned char[CompressBound(numInitialBytes, numNewDataBytes)];
+    return Compress(initialData, numInitialBytes, newData, numNewDataBytes, *deltaData);
+}
 
-    if (numInitialBytes > numNewDataBytes)
+size_t Oxygen::CompressRangesBound(const DeltaRange* ranges, int numRanges)
+{
+    // Each range may follow a copy, and a copy may end the delta.
+    size_t bound = 32;
+    for (int i = 0; i < numRanges; i++)
     {
-        WriteBlock(stream, newData, numNewDataBytes, UNCOMPRESSED_BLOCK, 0);
+        bound += ChunkBound(std::max(ranges[i].size, 0));
     }
-    else if (numNewDataBytes > numInitialBytes)
+    return bound;
+}
+
+int Oxygen::CompressRanges(const unsigned char* initialData, int numBytes, const DeltaRange* ranges, int numRanges, unsigned char* deltaData)
+{
+    size_t op = 0;
+    deltaData[op++] = VERSIONED_FORMAT | FORMAT_VERSION;
+
+    // The ranges are encoded as delta windows against the bytes they replace, so are
+    // decoded at the same position as they started in the initial data.
+    int position = 0;
+    for (int i = 0; i < numRanges; i++)
     {
-        int offset = FindSubArray(newData, initialData, numNewDataBytes, numInitialBytes);
-        if (offset > -1)
+        const DeltaRange& range = ranges[i];
+        if (range.offset < position || range.size < 0 || range.offset > numBytes - range.size)
+        {
+            return -1;
+        }
+
+        if (range.offset > position)
         {
-            WriteData(stream, newData, initialData, numNewDataBytes, numInitialBytes, offset);
+            WriteCopy(deltaData, op, position, range.offset - position);
         }
-        else
+
+        for (int offset = 0; offset < range.size; offset += DELTA_WINDOW)
         {
-            WriteBlock(stream, newData, numNewDataBytes, UNCOMPRESSED_BLOCK, 0);
+            const int length = std::min(range.size - offset, DELTA_WINDOW);
+            WriteDeltaWindow(deltaData, op, initialData + range.offset + offset, range.data + offset, length);
         }
+
+        position = range.offset + range.size;
     }
-    else
+
+    if (position < numBytes)
     {
-        CalculateDeltas(initialData, newData, 0, 0, numNewDataBytes, delta);
-        WriteBlock(stream, delta.data(), int(delta.size()), DELTA_COMPRESSED_BLOCK, 0);
+        WriteCopy(deltaData, op, position, numBytes - position);
     }
 
-    *deltaData = new unsigned char[stream.size()];
-    std::memcpy(*deltaData, stream.data(), stream.size());
-
-    return int(stream.size());
+    return int(op);
 }
 
-static void ReadBlock(
-    std::vector<unsigned char>& newData,
+static bool ReadBlock(
     const unsigned char* initialData,
-    const unsigned char* delta,
     int numInitialData,
-    int& pos)
+    const unsigned char* delta,
+    int numDelta,
+    int& pos,
+    unsigned char* newData,
+    int capacity,
+    int& written)
 {
+    // Reads a block of the original format, whose lengths are two bytes and copies four.
+    // Returns false if the block runs past the end of the delta, the initial data or the
+    // capacity. With no output the block is only checked and measured.
     int flags = delta[pos++];
     if (flags == UNCOMPRESSED_BLOCK)
     {
+        if (numDelta - pos < 2)
+        {
+            return false;
+        }
+
         int countLo = delta[pos++];
         int countHi = delta[pos++];
 
         int count = countLo | (countHi << 8);
+        if (numDelta - pos < count || count > capacity - written)
+        {
+            return false;
+        }
 
-        for (int i = 0; i < count; i++)
+        if (newData)
         {
-            newData.push_back(delta[pos++]);
+            std::memcpy(newData + written, delta + pos, count);
         }
+        pos += count;
+        written += count;
     }
     else if (flags == DELTA_COMPRESSED_BLOCK)
     {
+        if (numDelta - pos < 2)
+        {
+            return false;
+        }
+
         int dataLength;
         {
             int countLo = delta[pos++];
@@ -183,36 +488,303 @@ static void ReadBlock(
             dataLength = countLo | (countHi << 8);
         }
 
-        // Decode the run length encoding.
-        size_t offset = newData.size();
-        int end = int(newData.size()) + dataLength;
-        while (newData.size() < end)
+        if (dataLength < numInitialData || dataLength > capacity - written)
         {
+            return false;
+        }
+
+        // Decode the run length encoding, each run is filled in with vector stores.
+        unsigned char* out = newData ? newData + written : nullptr;
+
+        int filled = 0;
+        while (filled < dataLength)
+        {
+            if (numDelta - pos < 3)
+            {
+                return false;
+            }
+
             int value = delta[pos++];
             int countLo = delta[pos++];
             int countHi = delta[pos++];
 
             int count = countLo | (countHi << 8);
+            if (count > dataLength - filled)
+            {
+                return false;
+            }
 
-            for (int j = 0; j < count; j++)
+            if (out)
             {
-                newData.push_back((char)value);
+                std::memset(out + filled, value, count);
             }
+            filled += count;
         }
 
         // Decode the deltas.
-        for (int i = 0; i < numInitialData; i++)
+        if (out)
+        {
+            DeltaKernels::Get().subtract(initialData, out, out, numInitialData);
+        }
+        written += dataLength;
+    }
+    else if (flags == COPY_BLOCK)
+    {
+        if (numDelta - pos < 8)
         {
-            newData[i + offset] = (char)(initialData[i] - newData[i + offset]);
+            return false;
         }
+
+        const int offset = LoadLittleEndian<std::int32_t>(delta + pos);
+        const int length = LoadLittleEndian<std::int32_t>(delta + pos + 4);
+        pos += 8;
+
+        if (offset < 0 || length < 0 || offset > numInitialData - length || length > capacity - written)
+        {
+            return false;
+        }
+
+        if (newData)
+        {
+            std::memcpy(newData + written, initialData + offset, length);
+        }
+        written += length;
     }
+    else
+    {
+        return false;
+    }
+
+    return true;
 }
 
-void Oxygen::Decompress(unsigned char* initialData, int numInitialBytes, unsigned char* delta, int numDeltaBytes, std::vector<unsigned char>& newData)
+static bool ReadVersionedBlock(
+    const unsigned char* initialData,
+    int numInitialData,
+    const unsigned char* delta,
+    int numDelta,
+    int& pos,
+    unsigned char* newData,
+    int capacity,
+    int& written)
 {
-    int pos = 0;
+    // As ReadBlock, for the versioned format whose lengths, offsets and counts are varints.
+    // A delta block applies to the initial data at the position it is decoded to.
+    int flags = delta[pos++];
+    if (flags == UNCOMPRESSED_BLOCK)
+    {
+        int count;
+        if (!ReadVarint(delta, numDelta, pos, count) || numDelta - pos < count || count > capacity - written)
+        {
+            return false;
+        }
+
+        if (newData)
+        {
+            std::memcpy(newData + written, delta + pos, count);
+        }
+        pos += count;
+        written += count;
+    }
+    else if (flags == DELTA_COMPRESSED_BLOCK)
+    {
+        int dataLength;
+        if (!ReadVarint(delta, numDelta, pos, dataLength) ||
+            dataLength > numInitialData - written || dataLength > capacity - written)
+        {
+            return false;
+        }
+
+        unsigned char* out = newData ? newData + written : nullptr;
+
+        int filled = 0;
+        while (filled < dataLength)
+        {
+            if (pos >= numDelta)
+            {
+                return false;
+            }
+
+            int value = delta[pos++];
+            int count;
+            if (!ReadVarint(delta, numDelta, pos, count) || count == 0 || count > dataLength - filled)
+            {
+                return false;
+            }
+
+            if (out)
+            {
+                std::memset(out + filled, value, count);
+            }
+            filled += count;
+        }
+
+        if (out)
+        {
+            DeltaKernels::Get().subtract(initialData + written, out, out, dataLength);
+        }
+        written += dataLength;
+    }
+    else if (flags == COPY_BLOCK)
+    {
+        int offset;
+        int length;
+        if (!ReadVarint(delta, numDelta, pos, offset) || !ReadVarint(delta, numDelta, pos, length) ||
+            offset > numInitialData - length || length > capacity - written)
+        {
+            return false;
+        }
+
+        if (newData)
+        {
+            std::memcpy(newData + written, initialData + offset, length);
+        }
+        written += length;
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+static int DecodeChunks(const unsigned char* initialData, int numInitialBytes, const unsigned char* delta, int numDeltaBytes,
+    unsigned char* newData, int capacity, int& pos)
+{
+    // Reads the chunk index at pos, then decodes the chunks in parallel. Each must decode to
+    // exactly its size from exactly its bytes, as it is only placed by the ones before it.
+    // Returns -1 if any is malformed or the whole does not fit.
+    struct Chunk
+    {
+        int offset;
+        int size;
+        int deltaOffset;
+        int deltaSize;
+    };
+
+    int p = pos + 1;
+    int numChunks;
+    if (!ReadVarint(delta, numDeltaBytes, p, numChunks) || numChunks <= 0 || numChunks > numDeltaBytes)
+    {
+        return -1;
+    }
+
+    std::vector<Chunk> chunks(numChunks);
+    int size = 0;
+    int deltaSize = 0;
+    for (Chunk& chunk : chunks)
+    {
+        if (!ReadVarint(delta, numDeltaBytes, p, chunk.size) || !ReadVarint(delta, numDeltaBytes, p, chunk.deltaSize) ||
+            chunk.size > capacity - size || chunk.deltaSize > numDeltaBytes - deltaSize)
+        {
+            return -1;
+        }
+
+        chunk.offset = size;
+        chunk.deltaOffset = deltaSize;
+        size += chunk.size;
+        deltaSize += chunk.deltaSize;
+    }
+
+    if (deltaSize != numDeltaBytes - p)
+    {
+        return -1;
+    }
+
+    std::atomic<bool> valid = true;
+    ForEachChunk(numChunks, [&](int i)
+    {
+        const Chunk& chunk = chunks[i];
+        const int end = p + chunk.deltaOffset + chunk.deltaSize;
+
+        int chunkPos = p + chunk.deltaOffset;
+        int written = chunk.offset;
+        while (chunkPos < end && valid.load(std::memory_order_relaxed))
+        {
+            if (!ReadVersionedBlock(initialData, numInitialBytes, delta, end, chunkPos, newData, chunk.offset + chunk.size, written))
+            {
+                valid = false;
+            }
+        }
+
+        if (written != chunk.offset + chunk.size)
+        {
+            valid = false;
+        }
+    });
+
+    if (!valid)
+    {
+        return -1;
+    }
+
+    pos = numDeltaBytes;
+    return size;
+}
+
+static int Decode(const unsigned char* initialData, int numInitialBytes, const unsigned char* delta, int numDeltaBytes,
+    unsigned char* newData, int capacity, int& pos)
+{
+    // Decodes blocks until the end of the delta or the first malformed one, pos is left at its start.
+    // Blocks are decoded straight into the output, so the memory used does not grow with the payload.
+    const bool versioned = numDeltaBytes > 0 && (delta[0] & VERSIONED_FORMAT) != 0;
+    if (versioned)
+    {
+        const int version = delta[0] & ~VERSIONED_FORMAT;
+        if (version < MIN_FORMAT_VERSION || version > FORMAT_VERSION)
+        {
+            return 0;
+        }
+        pos++;
+
+        // A chunked delta is either decoded whole or not at all.
+        if (version >= 3 && pos < numDeltaBytes && delta[pos] == CHUNK_INDEX_BLOCK)
+        {
+            return std::max(DecodeChunks(initialData, numInitialBytes, delta, numDeltaBytes, newData, capacity, pos), 0);
+        }
+    }
+
+    int written = 0;
     while (pos < numDeltaBytes)
     {
-        ReadBlock(newData, initialData, delta, numInitialBytes, pos);
+        const int start = pos;
+        const int size = written;
+        const bool valid = versioned ?
+            ReadVersionedBlock(initialData, numInitialBytes, delta, numDeltaBytes, pos, newData, capacity, written) :
+            ReadBlock(initialData, numInitialBytes, delta, numDeltaBytes, pos, newData, capacity, written);
+        if (!valid)
+        {
+            pos = start;
+            return size;
+        }
     }
+    return written;
+}
+
+int Oxygen::DecompressedSize(int numInitialBytes, const unsigned char* delta, int numDeltaBytes)
+{
+    int pos = 0;
+    const int size = Decode(nullptr, numInitialBytes, delta, numDeltaBytes, nullptr, INT_MAX, pos);
+    return pos == numDeltaBytes ? size : -1;
+}
+
+int Oxygen::Decompress(const unsigned char* initialData, int numInitialBytes, const unsigned char* delta, int numDeltaBytes, unsigned char* newData, int capacity)
+{
+    int pos = 0;
+    const int size = Decode(initialData, numInitialBytes, delta, numDeltaBytes, newData, capacity, pos);
+    return pos == numDeltaBytes ? size : -1;
+}
+
+void Oxygen::Decompress(unsigned char* initialData, int numInitialBytes, unsigned char* delta, int numDeltaBytes, std::vector<unsigned char>& newData)
+{
+    // A malformed delta stops at the last block which could be read.
+    int end = 0;
+    const int size = Decode(nullptr, numInitialBytes, delta, numDeltaBytes, nullptr, INT_MAX, end);
+
+    const size_t offset = newData.size();
+    newData.resize(offset + size);
+
+    int pos = 0;
+    Decode(initialData, numInitialBytes, delta, end, newData.data() + offset, size, pos);
 }
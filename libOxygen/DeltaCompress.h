@@ -1,8 +1,60 @@
 #pragma once
+#include <cstddef>
 #include <vector>
 
 namespace Oxygen
 {
+    // Encodes newData as blocks which copy ranges of initialData, insert bytes or, when the two
+    // are the same size, run length encode the per byte differences. The format is shared with
+    // O2Core/DeltaCompress.cs.
+    // Deltas start with a version byte, 0x83, then the blocks, whose lengths, offsets and run
+    // counts are LEB128 varints. Equal sized payloads are encoded in 64 KB windows. Payloads
+    // over 1 MB are split into 1 MB chunks which are encoded and decoded in parallel, a chunk
+    // index of each one's decoded and encoded size comes first. The delta is the same for any
+    // number of threads. Deltas of version 0x82, which have no index, and deltas without the
+    // version byte, in the original format whose two byte lengths limit the run length
+    // encoding to 64 KB, still decode.
+
+    class WorkerPool;
+
+    // The pool chunks are encoded and decoded on, the shared one unless set, which is only
+    // started by the first payload of more than one chunk. With none they are done on the
+    // calling thread. Set before any deltas are encoded or decoded.
+    void SetDeltaWorkerPool(WorkerPool* pool);
+
+    // The most bytes Compress writes for the given sizes.
+    size_t CompressBound(int numInitialBytes, int numNewDataBytes);
+
+    // Writes the delta to deltaData, which has room for CompressBound bytes, and returns its size.
+    int Compress(const unsigned char* initialData, int numInitialBytes, const unsigned char* newData, int numNewDataBytes, unsigned char* deltaData);
+
+    // The size the delta decodes to, or -1 if it is malformed.
+    int DecompressedSize(int numInitialBytes, const unsigned char* delta, int numDeltaBytes);
+
+    // Decodes into newData, which has room for capacity bytes, and returns the decoded size.
+    // Returns -1 if the delta is malformed or does not fit.
+    int Decompress(const unsigned char* initialData, int numInitialBytes, const unsigned char* delta, int numDeltaBytes, unsigned char* newData, int capacity);
+
+    // A range of the new data which may differ from the initial data, and the bytes it now holds.
+    struct DeltaRange
+    {
+        int offset;
+        int size;
+        const unsigned char* data;
+    };
+
+    // The most bytes CompressRanges writes for the given ranges.
+    size_t CompressRangesBound(const DeltaRange* ranges, int numRanges);
+
+    // Encodes a change to only the given ranges of initialData, which keeps its size. The ranges
+    // are sorted and do not overlap, the rest is copied, so the cost is in the size of the ranges
+    // rather than of the data. Returns the size of the delta, or -1 if a range is out of order or
+    // outside the data.
+    int CompressRanges(const unsigned char* initialData, int numBytes, const DeltaRange* ranges, int numRanges, unsigned char* deltaData);
+
+    // As above, but the delta is allocated with new[] and its size returned.
     int Compress(const unsigned char* initialData, int numInitialBytes, const unsigned char* newData, int numNewDataBytes, unsigned char** deltaData);
+
+    // As above, but appends to newData. A malformed delta stops at the last block which could be read.
     void Decompress(unsigned char* initialData, int numInitialBytes, unsigned char* delta, int numDeltaBytes, std::vector<unsigned char>& newData);
 }
@@ -0,0 +1,234 @@
+#include "DeltaKernels.h"
+#include <bit>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define OXYGEN_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang only emit vector instructions beyond the baseline in functions marked for them,
+// MSVC emits them wherever the intrinsics are used.
+#if defined(OXYGEN_X86) && (defined(__GNUC__) || defined(__clang__))
+#define OXYGEN_TARGET(isa) __attribute__((target(isa)))
+#else
+#define OXYGEN_TARGET(isa)
+#endif
+
+using namespace Oxygen;
+
+static void SubtractScalar(const unsigned char* a, const unsigned char* b, unsigned char* dst, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        dst[i] = (unsigned char)(a[i] - b[i]);
+    }
+}
+
+static size_t RunLengthScalar(const unsigned char* data, size_t size)
+{
+    const unsigned char value = data[0];
+
+    size_t i = 1;
+    while (i < size && data[i] == value)
+    {
+        i++;
+    }
+    return i;
+}
+
+static size_t DifferenceRunLengthScalar(const unsigned char* a, const unsigned char* b, size_t size)
+{
+    const unsigned char value = (unsigned char)(a[0] - b[0]);
+
+    size_t i = 1;
+    while (i < size && (unsigned char)(a[i] - b[i]) == value)
+    {
+        i++;
+    }
+    return i;
+}
+
+#ifdef OXYGEN_X86
+
+OXYGEN_TARGET("sse2")
+static void SubtractSSE2(const unsigned char* a, const unsigned char* b, unsigned char* dst, size_t size)
+{
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        const __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+        const __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_sub_epi8(x, y));
+    }
+
+    SubtractScalar(a + i, b + i, dst + i, size - i);
+}
+
+OXYGEN_TARGET("sse2")
+static size_t RunLengthSSE2(const unsigned char* data, size_t size)
+{
+    // The first mismatching byte is the lowest clear bit of the compare mask.
+    const __m128i value = _mm_set1_epi8((char)data[0]);
+
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        const __m128i x = _mm_loadu_si128((const __m128i*)(data + i));
+        const std::uint32_t mask = std::uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(x, value)));
+        if (mask != 0xFFFF)
+        {
+            return i + std::countr_one(mask);
+        }
+    }
+
+    while (i < size && data[i] == data[0])
+    {
+        i++;
+    }
+    return i;
+}
+
+OXYGEN_TARGET("sse2")
+static size_t DifferenceRunLengthSSE2(const unsigned char* a, const unsigned char* b, size_t size)
+{
+    const __m128i value = _mm_set1_epi8((char)(a[0] - b[0]));
+
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        const __m128i x = _mm_sub_epi8(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+        const std::uint32_t mask = std::uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(x, value)));
+        if (mask != 0xFFFF)
+        {
+            return i + std::countr_one(mask);
+        }
+    }
+
+    while (i < size && (unsigned char)(a[i] - b[i]) == (unsigned char)(a[0] - b[0]))
+    {
+        i++;
+    }
+    return i;
+}
+
+OXYGEN_TARGET("avx2")
+static void SubtractAVX2(const unsigned char* a, const unsigned char* b, unsigned char* dst, size_t size)
+{
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32)
+    {
+        const __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+        const __m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_sub_epi8(x, y));
+    }
+
+    SubtractSSE2(a + i, b + i, dst + i, size - i);
+}
+
+OXYGEN_TARGET("avx2")
+static size_t RunLengthAVX2(const unsigned char* data, size_t size)
+{
+    const __m256i value = _mm256_set1_epi8((char)data[0]);
+
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32)
+    {
+        const __m256i x = _mm256_loadu_si256((const __m256i*)(data + i));
+        const std::uint32_t mask = std::uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, value)));
+        if (mask != 0xFFFFFFFFu)
+        {
+            return i + std::countr_one(mask);
+        }
+    }
+
+    while (i < size && data[i] == data[0])
+    {
+        i++;
+    }
+    return i;
+}
+
+OXYGEN_TARGET("avx2")
+static size_t DifferenceRunLengthAVX2(const unsigned char* a, const unsigned char* b, size_t size)
+{
+    const __m256i value = _mm256_set1_epi8((char)(a[0] - b[0]));
+
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32)
+    {
+        const __m256i x = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i)));
+        const std::uint32_t mask = std::uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, value)));
+        if (mask != 0xFFFFFFFFu)
+        {
+            return i + std::countr_one(mask);
+        }
+    }
+
+    while (i < size && (unsigned char)(a[i] - b[i]) == (unsigned char)(a[0] - b[0]))
+    {
+        i++;
+    }
+    return i;
+}
+
+static bool SupportsAVX2()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+    {
+        return false;
+    }
+
+    // The OS must also save the upper halves of the registers.
+    __cpuid(info, 1);
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    if (!osxsave || (_xgetbv(0) & 6) != 6)
+    {
+        return false;
+    }
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+static const DeltaKernels SCALAR_KERNELS = { DeltaKernelSet::Scalar, SubtractScalar, RunLengthScalar, DifferenceRunLengthScalar };
+#ifdef OXYGEN_X86
+static const DeltaKernels SSE2_KERNELS = { DeltaKernelSet::SSE2, SubtractSSE2, RunLengthSSE2, DifferenceRunLengthSSE2 };
+static const DeltaKernels AVX2_KERNELS = { DeltaKernelSet::AVX2, SubtractAVX2, RunLengthAVX2, DifferenceRunLengthAVX2 };
+#endif
+
+const DeltaKernels& DeltaKernels::Get()
+{
+    static const DeltaKernels& kernels = Get(DeltaKernelSet::AVX2);
+    return kernels;
+}
+
+const DeltaKernels& DeltaKernels::Get(DeltaKernelSet set)
+{
+#ifdef OXYGEN_X86
+    // SSE2 is part of every x86-64 CPU.
+    static const bool avx2 = SupportsAVX2();
+    if (set == DeltaKernelSet::AVX2 && avx2)
+    {
+        return AVX2_KERNELS;
+    }
+
+    if (set != DeltaKernelSet::Scalar)
+    {
+        return SSE2_KERNELS;
+    }
+#endif
+
+    return SCALAR_KERNELS;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <cstddef>
+
+namespace Oxygen
+{
+    enum class DeltaKernelSet
+    {
+        Scalar,
+        SSE2,
+        AVX2
+    };
+
+    // The byte loops of the delta codec, working 16 or 32 bytes at a time where the
+    // CPU supports it. Picked once, on first use, for the best set the CPU supports.
+    struct DeltaKernels
+    {
+        DeltaKernelSet set;
+
+        // dst[i] = a[i] - b[i], dst may be the same as a or b.
+        void (*subtract)(const unsigned char* a, const unsigned char* b, unsigned char* dst, size_t size);
+
+        // The number of bytes at the start of data which equal data[0], size must not be zero.
+        size_t (*runLength)(const unsigned char* data, size_t size);
+
+        // The run length of a[i] - b[i] without storing the differences, size must not be zero.
+        size_t (*differenceRunLength)(const unsigned char* a, const unsigned char* b, size_t size);
+
+        static const DeltaKernels& Get();
+
+        // The kernels for a set, or the best supported one below it.
+        static const DeltaKernels& Get(DeltaKernelSet set);
+    };
+}
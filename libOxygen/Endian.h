@@ -0,0 +1,44 @@
+#pragma once
+#include <bit>
+#include <cstring>
+#include <cstddef>
+
+namespace Oxygen
+{
+    // Values are stored in the little-endian wire order, which on
+    // little-endian targets is a plain copy.
+    template<typename T>
+    inline void StoreLittleEndian(unsigned char* dst, T value)
+    {
+        if constexpr (std::endian::native == std::endian::little)
+        {
+            std::memcpy(dst, &value, sizeof(T));
+        }
+        else
+        {
+            for (size_t i = 0; i < sizeof(T); i++)
+            {
+                dst[i] = (value >> (i * 8)) & 0xFF;
+            }
+        }
+    }
+
+    template<typename T>
+    inline T LoadLittleEndian(const unsigned char* src)
+    {
+        T value;
+        if constexpr (std::endian::native == std::endian::little)
+        {
+            std::memcpy(&value, src, sizeof(T));
+        }
+        else
+        {
+            value = 0;
+            for (size_t i = 0; i < sizeof(T); i++)
+            {
+                value |= T(src[i]) << (i * 8);
+            }
+        }
+        return value;
+    }
+}
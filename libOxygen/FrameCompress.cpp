@@ -0,0 +1,346 @@
+#include "FrameCompress.h"
+#include "Endian.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace Oxygen;
+
+// Set in the size of a payload which is stored uncompressed.
+constexpr std::uint32_t STORED_PAYLOAD = 0x80000000u;
+
+// Larger payloads are rejected rather than allocated for.
+constexpr size_t MAX_RAW_SIZE = 256 * 1024 * 1024;
+
+// Matches reach back at most this far, the offset is stored in two bytes.
+constexpr size_t MAX_OFFSET = 65535;
+constexpr size_t MIN_MATCH = 4;
+
+// The history is cut back to the window once it grows past this, so the move is amortized.
+constexpr size_t HISTORY_LIMIT = 4 * 65536;
+
+constexpr int HASH_BITS = 12;
+
+// The search skips ahead faster the longer nothing has matched, so incompressible data is cheap.
+constexpr int SKIP_SHIFT = 6;
+
+static inline std::uint32_t Hash(std::uint32_t value)
+{
+    return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static size_t Slide(std::vector<unsigned char>& history)
+{
+    if (history.size() <= HISTORY_LIMIT)
+    {
+        return 0;
+    }
+
+    const size_t removed = history.size() - MAX_OFFSET;
+    std::memmove(history.data(), history.data() + removed, MAX_OFFSET);
+    history.resize(MAX_OFFSET);
+    return removed;
+}
+
+static inline size_t LengthBytes(size_t length)
+{
+    return length >= 15 ? (length - 15) / 255 + 1 : 0;
+}
+
+static inline void WriteLength(unsigned char* dst, size_t& op, size_t length)
+{
+    if (length < 15)
+    {
+        return;
+    }
+
+    length -= 15;
+    while (length >= 255)
+    {
+        dst[op++] = 255;
+        length -= 255;
+    }
+    dst[op++] = (unsigned char)length;
+}
+
+static inline bool ReadLength(const unsigned char* data, size_t size, size_t& ip, size_t& length)
+{
+    unsigned char value;
+    do
+    {
+        if (ip >= size)
+        {
+            return false;
+        }
+
+        value = data[ip++];
+        length += value;
+    } while (value == 255);
+
+    return true;
+}
+
+FrameCompressor::FrameCompressor()
+    :
+    _base(0),
+    _table(size_t(1) << HASH_BITS, 0)
+{
+}
+
+static size_t Encode(const unsigned char* buffer, size_t start, size_t end, std::uint32_t base,
+    std::uint32_t* table, unsigned char* dst, size_t limit)
+{
+    // Encodes the bytes from start to end, matches may reach back before start. Positions in
+    // the table are offset by base. Returns zero if the sequences would take limit bytes or more.
+    size_t ip = start;
+    size_t anchor = start;
+    size_t op = 0;
+
+    while (ip + MIN_MATCH <= end)
+    {
+        const std::uint32_t value = LoadLittleEndian<std::uint32_t>(buffer + ip);
+        const std::uint32_t position = base + std::uint32_t(ip);
+        std::uint32_t& entry = table[Hash(value)];
+        const size_t distance = position - entry;
+        entry = position;
+
+        if (distance == 0 || distance > MAX_OFFSET || distance > ip ||
+            LoadLittleEndian<std::uint32_t>(buffer + ip - distance) != value)
+        {
+            ip += 1 + ((ip - anchor) >> SKIP_SHIFT);
+            continue;
+        }
+
+        size_t match = ip - distance;
+        size_t length = MIN_MATCH;
+        while (ip + length < end && buffer[match + length] == buffer[ip + length])
+        {
+            length++;
+        }
+
+        while (ip > anchor && match > 0 && buffer[ip - 1] == buffer[match - 1])
+        {
+            ip--;
+            match--;
+            length++;
+        }
+
+        const size_t literals = ip - anchor;
+        const size_t required = 1 + LengthBytes(literals) + literals + 2 + LengthBytes(length - MIN_MATCH);
+        if (op + required >= limit)
+        {
+            return 0;
+        }
+
+        dst[op++] = (unsigned char)((std::min<size_t>(literals, 15) << 4) | std::min<size_t>(length - MIN_MATCH, 15));
+        WriteLength(dst, op, literals);
+        std::memcpy(dst + op, buffer + anchor, literals);
+        op += literals;
+        dst[op++] = (unsigned char)(distance & 0xFF);
+        dst[op++] = (unsigned char)(distance >> 8);
+        WriteLength(dst, op, length - MIN_MATCH);
+
+        ip += length;
+        anchor = ip;
+
+        // The end of a match often starts the next one.
+        if (ip + 2 <= end && ip >= 2)
+        {
+            table[Hash(LoadLittleEndian<std::uint32_t>(buffer + ip - 2))] = base + std::uint32_t(ip - 2);
+        }
+    }
+
+    const size_t literals = end - anchor;
+    if (literals > 0)
+    {
+        if (op + 1 + LengthBytes(literals) + literals >= limit)
+        {
+            return 0;
+        }
+
+        dst[op++] = (unsigned char)(std::min<size_t>(literals, 15) << 4);
+        WriteLength(dst, op, literals);
+        std::memcpy(dst + op, buffer + anchor, literals);
+        op += literals;
+    }
+
+    return op;
+}
+
+static bool Decode(const unsigned char* data, size_t size, unsigned char* buffer, size_t start, size_t end)
+{
+    // Decodes the sequences which follow the size into buffer from start to end, matches may
+    // reach back before start. Returns false if they are malformed or do not end together.
+    size_t ip = 4;
+    size_t op = start;
+    while (op < end)
+    {
+        if (ip >= size)
+        {
+            return false;
+        }
+
+        const unsigned char token = data[ip++];
+
+        size_t literals = token >> 4;
+        if (literals == 15 && !ReadLength(data, size, ip, literals))
+        {
+            return false;
+        }
+
+        if (literals > size - ip || literals > end - op)
+        {
+            return false;
+        }
+
+        std::memcpy(buffer + op, data + ip, literals);
+        ip += literals;
+        op += literals;
+
+        if (op == end)
+        {
+            break;
+        }
+
+        if (size - ip < 2)
+        {
+            return false;
+        }
+
+        const size_t distance = data[ip] | (data[ip + 1] << 8);
+        ip += 2;
+
+        size_t length = token & 15;
+        if (length == 15 && !ReadLength(data, size, ip, length))
+        {
+            return false;
+        }
+        length += MIN_MATCH;
+
+        if (distance == 0 || distance > op || length > end - op)
+        {
+            return false;
+        }
+
+        // The match may overlap the bytes it produces, which repeats them.
+        const unsigned char* match = buffer + op - distance;
+        if (distance >= length)
+        {
+            std::memcpy(buffer + op, match, length);
+        }
+        else
+        {
+            for (size_t i = 0; i < length; i++)
+            {
+                buffer[op + i] = match[i];
+            }
+        }
+        op += length;
+    }
+
+    return ip == size;
+}
+
+size_t FrameCompressor::Compress(const unsigned char* data, size_t size, unsigned char* dst)
+{
+    // Positions in the table are offsets into the whole stream, so stay valid as the history slides.
+    _base += std::uint32_t(Slide(_history));
+
+    const size_t start = _history.size();
+    _history.insert(_history.end(), data, data + size);
+
+    const size_t written = Encode(_history.data(), start, _history.size(), _base, _table.data(), dst + 4, size);
+    if (written == 0)
+    {
+        StoreLittleEndian(dst, std::uint32_t(size) | STORED_PAYLOAD);
+        std::memcpy(dst + 4, data, size);
+        return size + 4;
+    }
+
+    StoreLittleEndian(dst, std::uint32_t(size));
+    return written + 4;
+}
+
+bool FrameDecompressor::RawSize(const unsigned char* data, size_t size, size_t& rawSize)
+{
+    if (size < 4)
+    {
+        return false;
+    }
+
+    rawSize = LoadLittleEndian<std::uint32_t>(data) & ~STORED_PAYLOAD;
+    return rawSize <= MAX_RAW_SIZE;
+}
+
+bool FrameDecompressor::Decompress(const unsigned char* data, size_t size, unsigned char* dst)
+{
+    size_t rawSize;
+    if (!RawSize(data, size, rawSize))
+    {
+        return false;
+    }
+
+    Slide(_history);
+
+    const size_t start = _history.size();
+    const size_t end = start + rawSize;
+    _history.resize(end);
+    unsigned char* buffer = _history.data();
+
+    if (LoadLittleEndian<std::uint32_t>(data) & STORED_PAYLOAD)
+    {
+        if (size - 4 != rawSize)
+        {
+            return false;
+        }
+
+        std::memcpy(buffer + start, data + 4, rawSize);
+        std::memcpy(dst, data + 4, rawSize);
+        return true;
+    }
+
+    if (!Decode(data, size, buffer, start, end))
+    {
+        return false;
+    }
+
+    std::memcpy(dst, buffer + start, rawSize);
+    return true;
+}
+
+size_t Oxygen::CompressBlock(const unsigned char* data, size_t size, unsigned char* dst, std::vector<std::uint32_t>& table)
+{
+    // Stale positions left in the table by other blocks are checked like any other.
+    table.resize(size_t(1) << HASH_BITS);
+
+    const size_t written = Encode(data, 0, size, 0, table.data(), dst + 4, size);
+    if (written == 0)
+    {
+        StoreLittleEndian(dst, std::uint32_t(size) | STORED_PAYLOAD);
+        std::memcpy(dst + 4, data, size);
+        return size + 4;
+    }
+
+    StoreLittleEndian(dst, std::uint32_t(size));
+    return written + 4;
+}
+
+bool Oxygen::DecompressBlock(const unsigned char* data, size_t size, unsigned char* dst, size_t rawSize)
+{
+    if (size < 4 || (LoadLittleEndian<std::uint32_t>(data) & ~STORED_PAYLOAD) != rawSize)
+    {
+        return false;
+    }
+
+    if (LoadLittleEndian<std::uint32_t>(data) & STORED_PAYLOAD)
+    {
+        if (size - 4 != rawSize)
+        {
+            return false;
+        }
+
+        std::memcpy(dst, data + 4, rawSize);
+        return true;
+    }
+
+    return Decode(data, size, dst, 0, rawSize);
+}
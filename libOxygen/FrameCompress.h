@@ -0,0 +1,62 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace Oxygen
+{
+    // Set in the length word of a frame whose payload is compressed.
+    constexpr std::uint32_t COMPRESSED_FRAME = 0x80000000u;
+
+    // Capabilities offered in the connection handshake.
+    constexpr int CAPABILITY_COMPRESSION = 1;
+
+    // A compressed payload starts with the size it decompresses to, then either the raw bytes,
+    // when the top bit of the size is set, or LZ4 style sequences: a token holding the literal
+    // and match lengths, the literals, and a two byte offset back to the match. The last
+    // sequence ends with its literals once the size is reached.
+    // Matches may reach back into the previous compressed frames in the same direction,
+    // so each connection keeps a compressor and a decompressor which must see the frames
+    // in the order they are sent.
+    class FrameCompressor
+    {
+    public:
+        FrameCompressor();
+
+        // The most bytes Compress writes for size bytes.
+        static inline size_t Bound(size_t size) { return size + 4; }
+
+        // Writes the compressed payload to dst and returns its size. Falls back to
+        // storing the raw bytes when they do not compress.
+        size_t Compress(const unsigned char* data, size_t size, unsigned char* dst);
+
+    private:
+        // Recent bytes, history[0] is at stream position base.
+        std::vector<unsigned char> _history;
+        std::uint32_t _base;
+        std::vector<std::uint32_t> _table;
+    };
+
+    class FrameDecompressor
+    {
+    public:
+        // Reads the size the payload decompresses to, returns false if it is malformed.
+        static bool RawSize(const unsigned char* data, size_t size, size_t& rawSize);
+
+        // Decompresses into dst, which has room for RawSize bytes. Returns false if the
+        // payload is malformed, after which the stream can not be decompressed any further.
+        bool Decompress(const unsigned char* data, size_t size, unsigned char* dst);
+
+    private:
+        std::vector<unsigned char> _history;
+    };
+
+    // Compresses a payload on its own in the same format, with no history, so it decompresses
+    // without the ones before it. The table is scratch space which can be kept between calls.
+    // dst has room for FrameCompressor::Bound bytes.
+    size_t CompressBlock(const unsigned char* data, size_t size, unsigned char* dst, std::vector<std::uint32_t>& table);
+
+    // Decompresses a payload from CompressBlock into dst, which has room for its rawSize bytes.
+    // Returns false if the payload is malformed or is not of that size.
+    bool DecompressBlock(const unsigned char* data, size_t size, unsigned char* dst, size_t rawSize);
+}
@@ -0,0 +1,139 @@
+#include "FramePool.h"
+#include <new>
+
+using namespace Oxygen;
+
+// Frames larger than the biggest size class are not pooled.
+constexpr size_t MIN_CLASS_SIZE = 1024;
+constexpr size_t MAX_CACHED_BYTES_PER_CLASS = 4 * 1024 * 1024;
+
+static int SizeClassOf(size_t size)
+{
+    int sizeClass = 0;
+    size_t classSize = MIN_CLASS_SIZE;
+    while (classSize < size)
+    {
+        classSize <<= 1;
+        sizeClass++;
+    }
+
+    return sizeClass < FRAME_POOL_SIZE_CLASSES ? sizeClass : -1;
+}
+
+static FrameBuffer* AllocateFrame(size_t capacity, int sizeClass)
+{
+    void* memory = ::operator new(sizeof(FrameBuffer) + capacity);
+    FrameBuffer* frame = new (memory) FrameBuffer();
+    frame->sizeClass = sizeClass;
+    frame->capacity = capacity;
+    frame->data = reinterpret_cast<unsigned char*>(frame + 1);
+    return frame;
+}
+
+static void FreeFrame(FrameBuffer* frame)
+{
+    frame->~FrameBuffer();
+    ::operator delete(frame);
+}
+
+FrameRef::FrameRef(const FrameRef& other)
+    : _frame(other._frame)
+{
+    if (_frame)
+    {
+        _frame->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+FrameRef& FrameRef::operator=(const FrameRef& other)
+{
+    if (other._frame)
+    {
+        other._frame->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    Release();
+    _frame = other._frame;
+    return *this;
+}
+
+FrameRef& FrameRef::operator=(FrameRef&& other) noexcept
+{
+    if (this != &other)
+    {
+        Release();
+        _frame = other._frame;
+        other._frame = nullptr;
+    }
+
+    return *this;
+}
+
+void FrameRef::Release()
+{
+    if (_frame && _frame->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        FramePool::Shared().Release(_frame);
+    }
+
+    _frame = nullptr;
+}
+
+FramePool::FramePool()
+    : _numAllocations(0), _numReuses(0), _bytesCached(0)
+{
+}
+
+FramePool& FramePool::Shared()
+{
+    // Frames can outlive the connection which received them, so a single pool is
+    // shared by every connection and is intentionally never destroyed.
+    static FramePool* pool = new FramePool();
+    return *pool;
+}
+
+FrameRef FramePool::Acquire(size_t size)
+{
+    const int sizeClass = SizeClassOf(size);
+
+    FrameBuffer* frame = nullptr;
+    if (sizeClass >= 0)
+    {
+        SizeClass& bin = _classes[sizeClass];
+        std::lock_guard<std::mutex> lock(bin.lock);
+        if (!bin.free.empty())
+        {
+            frame = bin.free.back();
+            bin.free.pop_back();
+            _bytesCached -= frame->capacity;
+            _numReuses++;
+        }
+    }
+
+    if (frame == nullptr)
+    {
+        const size_t capacity = sizeClass >= 0 ? MIN_CLASS_SIZE << sizeClass : size;
+        frame = AllocateFrame(capacity, sizeClass);
+        _numAllocations++;
+    }
+
+    frame->refs.store(1, std::memory_order_relaxed);
+    return FrameRef(frame);
+}
+
+void FramePool::Release(FrameBuffer* frame)
+{
+    if (frame->sizeClass >= 0)
+    {
+        SizeClass& bin = _classes[frame->sizeClass];
+        std::lock_guard<std::mutex> lock(bin.lock);
+        if ((bin.free.size() + 1) * frame->capacity <= MAX_CACHED_BYTES_PER_CLASS)
+        {
+            bin.free.push_back(frame);
+            _bytesCached += frame->capacity;
+            return;
+        }
+    }
+
+    FreeFrame(frame);
+}
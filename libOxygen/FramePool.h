@@ -0,0 +1,76 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <cstddef>
+
+namespace Oxygen
+{
+    // Size classes are powers of two from 1 KB to 4 MB.
+    constexpr int FRAME_POOL_SIZE_CLASSES = 13;
+
+    class FramePool;
+
+    struct FrameBuffer
+    {
+        std::atomic<int> refs;
+        int sizeClass;
+        size_t capacity;
+        unsigned char* data;
+    };
+
+    // A reference counted handle to a buffer owned by a FramePool.
+    // The buffer is returned to the pool when the last handle is released.
+    class FrameRef
+    {
+    public:
+        FrameRef() : _frame(nullptr) {}
+        explicit FrameRef(FrameBuffer* frame) : _frame(frame) {}
+        FrameRef(const FrameRef& other);
+        FrameRef(FrameRef&& other) noexcept : _frame(other._frame) { other._frame = nullptr; }
+        FrameRef& operator=(const FrameRef& other);
+        FrameRef& operator=(FrameRef&& other) noexcept;
+        ~FrameRef() { Release(); }
+
+        inline unsigned char* data() const { return _frame->data; }
+        inline size_t capacity() const { return _frame->capacity; }
+        inline bool unique() const { return _frame->refs.load(std::memory_order_acquire) == 1; }
+        inline explicit operator bool() const { return _frame != nullptr; }
+
+    private:
+        void Release();
+
+        FrameBuffer* _frame;
+    };
+
+    // Hands out frame buffers from per size class free lists so that
+    // received frames do not need a fresh heap allocation each time.
+    class FramePool
+    {
+    public:
+        static FramePool& Shared();
+
+        FrameRef Acquire(size_t size);
+
+        inline int NumAllocations() const { return _numAllocations; }
+        inline int NumReuses() const { return _numReuses; }
+        inline size_t BytesCached() const { return _bytesCached; }
+
+    private:
+        friend class FrameRef;
+
+        struct SizeClass
+        {
+            std::mutex lock;
+            std::vector<FrameBuffer*> free;
+        };
+
+        FramePool();
+        void Release(FrameBuffer* frame);
+
+        SizeClass _classes[FRAME_POOL_SIZE_CLASSES];
+        std::atomic<int> _numAllocations;
+        std::atomic<int> _numReuses;
+        std::atomic<size_t> _bytesCached;
+    };
+}
@@ -1,33 +1,63 @@
 #include "Message.h"
+#include "Endian.h"
+#include "FrameCompress.h"
+#include <cstring>
+#include <bit>
 
 using namespace Oxygen;
 
+Message::Message()
+    : _route(-1), _compact(false), _viewOffset(0), _viewSize(0), _pos(0), _id(-1), _coalesceKey(0)
+{
+}
 
 Message::Message(unsigned char* data, int size)
     :
+    _route(-1),
+    _compact(false),
     _data(data, data + size),
-    _it(_data.begin()),
-    _id(-1)
+    _viewOffset(0),
+    _viewSize(0),
+    _pos(0),
+    _id(-1),
+    _coalesceKey(0)
+{
+    ReadHeader();
+}
+
+Message::Message(const FrameRef& frame, size_t offset, int size)
+    :
+    _route(-1),
+    _compact(false),
+    _frame(frame),
+    _viewOffset(offset),
+    _viewSize(size),
+    _pos(0),
+    _id(-1),
+    _coalesceKey(0)
 {
-    _nodeName = ReadString();
-    _messageName = ReadString();
+    ReadHeader();
 }
 
 Message::Message(const std::string& nodeName, const std::string& messageName)
-    : _nodeName(nodeName), _messageName(messageName), _id(-1)
+    : Message(nodeName, messageName, 0)
 {
-    // Reverse space for the header bytes.
-    // Size
-    _data.push_back(0);
-    _data.push_back(0);
-    _data.push_back(0);
-    _data.push_back(0);
+}
 
-    // Id
-    _data.push_back(0);
-    _data.push_back(0);
-    _data.push_back(0);
-    _data.push_back(0);
+Message::Message(const std::string& nodeName, const std::string& messageName, size_t sizeHint)
+    : _route(Routes::Find(nodeName, messageName)), _compact(false), _viewOffset(0), _viewSize(0), _pos(0), _id(-1), _coalesceKey(0)
+{
+    if (_route < 0)
+    {
+        _nodeName = nodeName;
+        _messageName = messageName;
+    }
+
+    // The hint is the number of bytes the caller expects to write after the names.
+    _data.reserve(16 + nodeName.size() + messageName.size() + sizeHint);
+
+    // Reverse space for the header bytes, the size and the id are filled in by Prepare.
+    _data.resize(8);
 
     WriteString(nodeName);
     WriteString(messageName);
@@ -35,65 +65,133 @@ Message::Message(const std::string& nodeName, const std::string& messageName)
 
 Message::Message(const Message& msg)
     :
-    _data(msg._data),
     _nodeName(msg._nodeName),
     _messageName(msg._messageName),
-    _id(msg._id)
+    _route(msg._route),
+    _compact(msg._compact),
+    _data(msg._data),
+    _frame(msg._frame),
+    _viewOffset(msg._viewOffset),
+    _viewSize(msg._viewSize),
+    _pos(msg._pos),
+    _id(msg._id),
+    _coalesceKey(msg._coalesceKey)
 {
-    if (msg._it._Ptr)
-    {
-        _it = _data.begin() + (msg._it - msg._data.begin());
-    }
+}
+
+Message::Message(Message&& msg) noexcept
+    :
+    _nodeName(std::move(msg._nodeName)),
+    _messageName(std::move(msg._messageName)),
+    _route(msg._route),
+    _compact(msg._compact),
+    _data(std::move(msg._data)),
+    _frame(std::move(msg._frame)),
+    _viewOffset(msg._viewOffset),
+    _viewSize(msg._viewSize),
+    _pos(msg._pos),
+    _id(msg._id),
+    _coalesceKey(msg._coalesceKey)
+{
+    msg._pos = 0;
+}
+
+Message& Message::operator=(const Message& msg)
+{
+    _data = msg._data;
+    _nodeName = msg._nodeName;
+    _messageName = msg._messageName;
+    _route = msg._route;
+    _compact = msg._compact;
+    _frame = msg._frame;
+    _viewOffset = msg._viewOffset;
+    _viewSize = msg._viewSize;
+    _pos = msg._pos;
+    _id = msg._id;
+    _coalesceKey = msg._coalesceKey;
+    return *this;
+}
+
+Message& Message::operator=(Message&& msg) noexcept
+{
+    _data = std::move(msg._data);
+    _nodeName = std::move(msg._nodeName);
+    _messageName = std::move(msg._messageName);
+    _route = msg._route;
+    _compact = msg._compact;
+    _frame = std::move(msg._frame);
+    _viewOffset = msg._viewOffset;
+    _viewSize = msg._viewSize;
+    _pos = msg._pos;
+    _id = msg._id;
+    _coalesceKey = msg._coalesceKey;
+    msg._pos = 0;
+    return *this;
 }
 
 void Message::WriteString(const std::string& str)
 {
-    const unsigned int length = str.size();
+    const int length = int(str.size());
 
-    _data.push_back(length & 0xFF);
-    _data.push_back((length >> 8) & 0xFF);
-    _data.push_back((length >> 16) & 0xFF);
-    _data.push_back((length >> 24) & 0xFF);
-    for (int i = 0; i < length; i++)
-    {
-        _data.push_back(str[i] & 0xff);
-    }
+    unsigned char* dst = Append(4 + length);
+    StoreLittleEndian(dst, length);
+    std::memcpy(dst + 4, str.data(), length);
 }
 
 void Message::WriteBytes(int numBytes, const unsigned char* bytes)
 {
-    _data.push_back(numBytes & 0xFF);
-    _data.push_back((numBytes >> 8) & 0xFF);
-    _data.push_back((numBytes >> 16) & 0xFF);
-    _data.push_back((numBytes >> 24) & 0xFF);
-    for (int i = 0; i < numBytes; i++)
+    unsigned char* dst = Append(4 + numBytes);
+    StoreLittleEndian(dst, numBytes);
+    if (numBytes > 0)
     {
-        _data.push_back(bytes[i] & 0xff);
+        std::memcpy(dst + 4, bytes, numBytes);
     }
 }
 
 const std::string Message::ReadString()
 {
-    int a = *(_it++);
-    int b = *(_it++);
-    int c = *(_it++);
-    int d = *(_it++);
+    return std::string(ReadStringView());
+}
 
-    int numChars = a |
-        (b << 8) |
-        (c << 16) |
-        (d << 24);
-    char* str = (char*) _it._Ptr;
-    _it += numChars;
-    return std::string(str, numChars);
+std::string_view Message::ReadStringView()
+{
+    const int numChars = ReadInt32();
+    const char* str = (const char*) Buffer() + _pos;
+    _pos += numChars;
+    return std::string_view(str, numChars);
+}
+
+void Message::ReadHeader()
+{
+    const int value = ReadInt32();
+    if (value < 0)
+    {
+        // A negotiated connection sends the route id in place of the names.
+        const int route = ~value;
+        _route = route < Routes::Count() ? route : -1;
+        _compact = true;
+        return;
+    }
+
+    _pos -= 4;
+    const std::string_view nodeName = ReadStringView();
+    const std::string_view messageName = ReadStringView();
+
+    _route = Routes::Find(nodeName, messageName);
+    if (_route < 0)
+    {
+        _nodeName.assign(nodeName);
+        _messageName.assign(messageName);
+    }
 }
 
 int Message::ReadInt32()
 {
-    int a = *(_it++);
-    int b = *(_it++);
-    int c = *(_it++);
-    int d = *(_it++);
+    const unsigned char* buffer = Buffer();
+    int a = buffer[_pos++];
+    int b = buffer[_pos++];
+    int c = buffer[_pos++];
+    int d = buffer[_pos++];
 
     return a |
         (b << 8) |
@@ -103,14 +201,15 @@ int Message::ReadInt32()
 
 std::int64_t Message::ReadInt64()
 {
-    std::int64_t a = *(_it++);
-    std::int64_t b = *(_it++);
-    std::int64_t c = *(_it++);
-    std::int64_t d = *(_it++);
-    std::int64_t e = *(_it++);
-    std::int64_t f = *(_it++);
-    std::int64_t g = *(_it++);
-    std::int64_t h = *(_it++);
+    const unsigned char* buffer = Buffer();
+    std::int64_t a = buffer[_pos++];
+    std::int64_t b = buffer[_pos++];
+    std::int64_t c = buffer[_pos++];
+    std::int64_t d = buffer[_pos++];
+    std::int64_t e = buffer[_pos++];
+    std::int64_t f = buffer[_pos++];
+    std::int64_t g = buffer[_pos++];
+    std::int64_t h = buffer[_pos++];
 
     return a |
         (b << 8) |
@@ -124,14 +223,15 @@ std::int64_t Message::ReadInt64()
 
 double Message::ReadDouble()
 {
-    std::int64_t a = *(_it++);
-    std::int64_t b = *(_it++);
-    std::int64_t c = *(_it++);
-    std::int64_t d = *(_it++);
-    std::int64_t e = *(_it++);
-    std::int64_t f = *(_it++);
-    std::int64_t g = *(_it++);
-    std::int64_t h = *(_it++);
+    const unsigned char* buffer = Buffer();
+    std::int64_t a = buffer[_pos++];
+    std::int64_t b = buffer[_pos++];
+    std::int64_t c = buffer[_pos++];
+    std::int64_t d = buffer[_pos++];
+    std::int64_t e = buffer[_pos++];
+    std::int64_t f = buffer[_pos++];
+    std::int64_t g = buffer[_pos++];
+    std::int64_t h = buffer[_pos++];
 
     const std::int64_t val = a |
         (b << 8) |
@@ -147,42 +247,130 @@ double Message::ReadDouble()
 
 void Message::ReadBytes(int numBytes, unsigned char* bytes)
 {
-    std::memcpy(bytes, _it._Ptr, numBytes);
-    _it += numBytes;
+    std::memcpy(bytes, Buffer() + _pos, numBytes);
+    _pos += numBytes;
 }
 
 void Message::WriteInt32(int value)
 {
-    _data.push_back(value & 0xFF);
-    _data.push_back((value >> 8) & 0xFF);
-    _data.push_back((value >> 16) & 0xFF);
-    _data.push_back((value >> 24) & 0xFF);
+    StoreLittleEndian(Append(4), value);
 }
 
 void Message::WriteDouble(double value)
 {
-    std::int64_t* val = reinterpret_cast<std::int64_t*>(&value);
-    _data.push_back(*val & 0xFF);
-    _data.push_back((*val >> 8) & 0xFF);
-    _data.push_back((*val >> 16) & 0xFF);
-    _data.push_back((*val >> 24) & 0xFF);
-    _data.push_back((*val >> 32) & 0xFF);
-    _data.push_back((*val >> 40) & 0xFF);
-    _data.push_back((*val >> 48) & 0xFF);
-    _data.push_back((*val >> 56) & 0xFF);
+    StoreLittleEndian(Append(8), std::bit_cast<std::uint64_t>(value));
+}
+
+void Message::Reserve(size_t numBytes)
+{
+    Detach();
+
+    _data.reserve(_data.size() + numBytes);
+}
+
+unsigned char* Message::WriteSpan(size_t numBytes)
+{
+    return Append(numBytes);
+}
+
+const unsigned char* Message::ReadSpan(size_t numBytes)
+{
+    const unsigned char* span = Buffer() + _pos;
+    _pos += numBytes;
+    return span;
+}
+
+unsigned char* Message::Append(size_t numBytes)
+{
+    Detach();
+
+    // resize grows the capacity geometrically so appends stay amortized constant time.
+    const size_t size = _data.size();
+    _data.resize(size + numBytes);
+    return _data.data() + size;
 }
 
 void Message::Prepare()
 {
-    const int payloadSize = _data.size() - 8;
-    _data[0] = (payloadSize & 0xFF);
-    _data[1] = ((payloadSize >> 8) & 0xFF);
-    _data[2] = ((payloadSize >> 16) & 0xFF);
-    _data[3] = ((payloadSize >> 24) & 0xFF);
+    Detach();
 
-    _data[4] = (_id & 0xFF);
-    _data[5] = ((_id >> 8) & 0xFF);
-    _data[6] = ((_id >> 16) & 0xFF);
-    _data[7] = ((_id >> 24) & 0xFF);
+    const int payloadSize = int(_data.size() - 8);
+    StoreLittleEndian(_data.data(), payloadSize);
+    StoreLittleEndian(_data.data() + 4, _id);
 }
 
+void Message::CoalesceBy(int value)
+{
+    // Routed pairs are keyed by the id, others by a hash of the names.
+    // The top bit keeps the key from ever being zero.
+    std::uint32_t pair;
+    if (_route >= 0)
+    {
+        pair = std::uint32_t(_route);
+    }
+    else
+    {
+        pair = 2166136261u;
+        for (const std::string* name : { &_nodeName, &_messageName })
+        {
+            for (const char c : *name)
+            {
+                pair ^= (unsigned char)c;
+                pair *= 16777619u;
+            }
+            pair ^= 0xFF;
+            pair *= 16777619u;
+        }
+        pair |= 0x80000000u;
+    }
+
+    _coalesceKey = (std::uint64_t(1) << 63) | (std::uint64_t(pair) << 31) | (std::uint32_t(value) & 0x7FFFFFFFu);
+}
+
+Message Message::Compact() const
+{
+    // Replaces the two names after the header with the negated route id.
+    const size_t namesSize = 8 + Routes::NodeName(_route).size() + Routes::MessageName(_route).size();
+    const size_t bodyOffset = 8 + namesSize;
+    const size_t bodySize = _data.size() - bodyOffset;
+    const int value = -_route - 1;
+
+    Message msg;
+    msg._route = _route;
+    msg._compact = true;
+    msg._id = _id;
+    msg._coalesceKey = _coalesceKey;
+    msg._data.resize(12 + bodySize);
+    StoreLittleEndian(msg._data.data() + 8, value);
+    std::memcpy(msg._data.data() + 12, _data.data() + bodyOffset, bodySize);
+    msg.Prepare();
+    return msg;
+}
+
+Message Message::Compress(FrameCompressor& compressor) const
+{
+    // The payload after the header is compressed whole, the top bit of the length marks it.
+    const size_t payloadSize = _data.size() - 8;
+
+    Message msg;
+    msg._route = _route;
+    msg._compact = _compact;
+    msg._id = _id;
+    msg._coalesceKey = _coalesceKey;
+    msg._data.resize(8 + FrameCompressor::Bound(payloadSize));
+
+    const size_t compressedSize = compressor.Compress(_data.data() + 8, payloadSize, msg._data.data() + 8);
+    msg._data.resize(8 + compressedSize);
+    StoreLittleEndian(msg._data.data(), std::uint32_t(compressedSize) | COMPRESSED_FRAME);
+    std::memcpy(msg._data.data() + 4, _data.data() + 4, 4);
+    return msg;
+}
+
+void Message::Materialize()
+{
+    const unsigned char* buffer = Buffer();
+    _data.assign(buffer, buffer + _viewSize);
+    _frame = FrameRef();
+    _viewOffset = 0;
+    _viewSize = 0;
+}
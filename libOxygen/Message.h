@@ -1,37 +1,86 @@
 #pragma once
 #include <string>
 #include <vector>
+#include <cstdint>
+#include <string_view>
+#include "FramePool.h"
+#include "Routes.h"
 
 namespace Oxygen
 {
+    class FrameCompressor;
+
     class Message
     {
     public:
         Message(unsigned char* data, int size);
+        Message(const FrameRef& frame, size_t offset, int size);
         Message(const std::string& nodeName, const std::string& messageName);
+        Message(const std::string& nodeName, const std::string& messageName, size_t sizeHint);
         Message(const Message& msg);
+        Message(Message&& msg) noexcept;
+        Message& operator=(const Message& msg);
+        Message& operator=(Message&& msg) noexcept;
         void WriteString(const std::string& str);
         void WriteBytes(int numBytes, const unsigned char* bytes);
         void WriteInt32(int value);
         void WriteDouble(double value);
+        void Reserve(size_t numBytes);
+        // Adds numBytes to the end of the message for the caller to fill in.
+        unsigned char* WriteSpan(size_t numBytes);
+        // Skips numBytes and returns where they start.
+        const unsigned char* ReadSpan(size_t numBytes);
         const std::string ReadString();
         int ReadInt32();
         std::int64_t ReadInt64();
         double ReadDouble();
         void ReadBytes(int numBytes, unsigned char* bytes);
         void Prepare();
-        const unsigned char* const data() const { return _data.data(); }
-        const size_t size() const { return _data.size(); }
-        inline const std::string& NodeName() const { return _nodeName; }
-        inline const std::string& MessageName() const { return _messageName; }
+        Message Compact() const;
+        // A copy of the prepared frame with its payload compressed, see FrameCompress.h.
+        Message Compress(FrameCompressor& compressor) const;
+        const unsigned char* const data() const { return Buffer(); }
+        const size_t size() const { return _frame ? _viewSize : _data.size(); }
+        inline bool IsView() const { return bool(_frame); }
+        inline const std::string& NodeName() const { return _route >= 0 ? Routes::NodeName(_route) : _nodeName; }
+        inline const std::string& MessageName() const { return _route >= 0 ? Routes::MessageName(_route) : _messageName; }
+        inline int Route() const { return _route; }
+        inline bool CanCompact() const { return _route >= 0 && !_compact && !_frame; }
+        inline size_t BytesRemaining() const { return size() - _pos; }
         inline void SetId(int id) { _id = id; };
         inline int Id() const { return _id; }
 
+        // A newer message with the same key replaces this one in the write queue
+        // if it has not been sent yet. Zero, the default, never coalesces.
+        inline void SetCoalesceKey(std::uint64_t key) { _coalesceKey = key; }
+        inline std::uint64_t CoalesceKey() const { return _coalesceKey; }
+        // Keys the message on its node/message pair and a value such as an object id.
+        void CoalesceBy(int value = 0);
+
     private:
+        Message();
+        void ReadHeader();
+        std::string_view ReadStringView();
+        inline const unsigned char* Buffer() const { return _frame ? _frame.data() + _viewOffset : _data.data(); }
+        inline void Detach() { if (_frame) { Materialize(); } }
+        void Materialize();
+        unsigned char* Append(size_t numBytes);
+
+        // The names are only stored for pairs which are not in the route table.
         std::string _nodeName;
         std::string _messageName;
+        int _route;
+        bool _compact;
         std::vector<unsigned char> _data;
-        std::vector<unsigned char>::iterator _it;
+
+        // Received messages read from a shared immutable frame instead of
+        // owning a copy, the first write makes a private copy.
+        FrameRef _frame;
+        size_t _viewOffset;
+        size_t _viewSize;
+
+        size_t _pos;
         int _id;
+        std::uint64_t _coalesceKey;
     };
 }
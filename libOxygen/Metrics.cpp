@@ -120,18 +120,7 @@ void Metrics::ReportPosMetric(std::shared_ptr<Metrics_Pos>& metric)
     Message msg("METRIC_SVR", "REPORT_METRIC");
     metric->Write(msg);
 
-    std::shared_ptr<Subscriber> sub = std::make_shared<Subscriber>(msg);
-    sub->Signal([this, sub2 = std::shared_ptr<Subscriber>(sub)](Message& response)
-        {
-            _conn->RemoveSubscriber(sub2);
-
-            if (response.ReadString() == "NACK")
-            {
-                // Error
-            }
-        });
-
-    _conn->AddSubscriber(sub);
+    Report(std::move(msg));
 }
 
 void Metrics::ReportGaugeMetric(std::shared_ptr<Metrics_Gauge>& metric)
@@ -139,18 +128,7 @@ void Metrics::ReportGaugeMetric(std::shared_ptr<Metrics_Gauge>& metric)
     Message msg("METRIC_SVR", "REPORT_METRIC");
     metric->Write(msg);
 
-    std::shared_ptr<Subscriber> sub = std::make_shared<Subscriber>(msg);
-    sub->Signal([this, sub2 = std::shared_ptr<Subscriber>(sub)](Message& response)
-        {
-            _conn->RemoveSubscriber(sub2);
-
-            if (response.ReadString() == "NACK")
-            {
-                // Error
-            }
-        });
-
-    _conn->AddSubscriber(sub);
+    Report(std::move(msg));
 }
 
 void Metrics::ReportCounterMetric(std::shared_ptr<Metrics_Counter>& metric)
@@ -158,16 +136,14 @@ void Metrics::ReportCounterMetric(std::shared_ptr<Metrics_Counter>& metric)
     Message msg("METRIC_SVR", "REPORT_METRIC");
     metric->Write(msg);
 
-    std::shared_ptr<Subscriber> sub = std::make_shared<Subscriber>(msg);
-    sub->Signal([this, sub2 = std::shared_ptr<Subscriber>(sub)](Message& response)
-        {
-            _conn->RemoveSubscriber(sub2);
-
-            if (response.ReadString() == "NACK")
-            {
-                // Error
-            }
-        });
+    Report(std::move(msg));
+}
 
-    _conn->AddSubscriber(sub);
+Task<void> Metrics::Report(Message msg)
+{
+    Response response = co_await _conn->Request(std::move(msg));
+    if (response.Completed() && response.Reply().ReadString() == "NACK")
+    {
+        // Error
+    }
 }
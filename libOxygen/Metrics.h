@@ -2,6 +2,7 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include "AsyncRequest.h"
 
 namespace Oxygen
 {
@@ -67,6 +68,7 @@ namespace Oxygen
         void ReportPosMetric(std::shared_ptr<Metrics_Pos>& metric);
         void ReportGaugeMetric(std::shared_ptr<Metrics_Gauge>& metric);
         void ReportCounterMetric(std::shared_ptr<Metrics_Counter>& metric);
+        Task<void> Report(Message msg);
 
         ClientConnection* _conn;
         std::vector<std::shared_ptr<Metrics_Pos>> _posMetrics;
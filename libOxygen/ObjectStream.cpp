@@ -1,5 +1,8 @@
 #include "ObjectStream.h"
 #include "DeltaCompress.h"
+#include "Endian.h"
+#include <algorithm>
+#include <cstring>
 
 constexpr int NEW_OBJECT = 0;
 constexpr int UPDATE_OBJECT = 1;
@@ -8,6 +11,99 @@ constexpr int END_STREAM = 255;
 
 using namespace Oxygen;
 
+static unsigned char* WriteName(unsigned char* dst, const std::string& name)
+{
+    const int numChars = int(name.size());
+    dst[0] = (numChars & 0xFF);
+    dst[1] = ((numChars >> 8) & 0xFF);
+    dst[2] = ((numChars >> 16) & 0xFF);
+    dst[3] = ((numChars >> 24) & 0xFF);
+    std::memcpy(dst + 4, name.data(), name.size());
+    return dst + 4 + name.size();
+}
+
+static void StoreState(StateCache& states, int id, const Message& msg)
+{
+    // The state is kept with the names, as the server computes its deltas from, even when a
+    // negotiated connection sent the route id in their place. That id is a negative int32.
+    const unsigned char* data = msg.data();
+    if (msg.size() < 4 || (data[3] & 0x80) == 0)
+    {
+        std::memcpy(states.Assign(id, msg.size()), data, msg.size());
+        return;
+    }
+
+    const std::string& nodeName = msg.NodeName();
+    const std::string& messageName = msg.MessageName();
+
+    unsigned char* dst = states.Assign(id, 8 + nodeName.size() + messageName.size() + msg.size() - 4);
+    dst = WriteName(dst, nodeName);
+    dst = WriteName(dst, messageName);
+    std::memcpy(dst, data + 4, msg.size() - 4);
+}
+
+static int CustomDataOffset(const StateView& state)
+{
+    // The names, the stream message type and the object header come before the custom data.
+    size_t pos = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        if (state.size - pos < 4)
+        {
+            return -1;
+        }
+
+        const int length = LoadLittleEndian<int>(state.data + pos);
+        if (length < 0 || size_t(length) > state.size - pos - 4)
+        {
+            return -1;
+        }
+        pos += 4 + size_t(length);
+    }
+
+    pos += 4 + ObjectSchema::Size;
+    return pos <= state.size ? int(pos) : -1;
+}
+
+static void AddEdit(std::map<int, std::vector<unsigned char>>& edits, int offset, const unsigned char* data, int size)
+{
+    // Merges with the edits it overlaps or touches, its bytes replace theirs.
+    if (size == 0)
+    {
+        return;
+    }
+
+    auto first = edits.upper_bound(offset);
+    if (first != edits.begin())
+    {
+        auto previous = std::prev(first);
+        if (previous->first + int(previous->second.size()) >= offset)
+        {
+            first = previous;
+        }
+    }
+
+    int start = offset;
+    int end = offset + size;
+    auto last = first;
+    while (last != edits.end() && last->first <= end)
+    {
+        start = std::min(start, last->first);
+        end = std::max(end, last->first + int(last->second.size()));
+        ++last;
+    }
+
+    std::vector<unsigned char> merged(end - start);
+    for (auto edit = first; edit != last; ++edit)
+    {
+        std::memcpy(merged.data() + (edit->first - start), edit->second.data(), edit->second.size());
+    }
+    std::memcpy(merged.data() + (offset - start), data, size);
+
+    edits.erase(first, last);
+    edits.emplace(start, std::move(merged));
+}
+
 ObjectStream::ObjectStream()
     : 
     Subscriber(Oxygen::Message("LEVEL_SVR", "OBJECT_STREAM")),
@@ -30,7 +126,9 @@ void ObjectStream::OnNewMessage(Message& msg)
         DeleteObject(msg);
         break;
     case END_STREAM: // END
-        state.clear();
+        _states.Clear();
+        _edits.clear();
+        _wholeUpdateSizes.clear();
         OnStreamEnded();
         break;
     }
@@ -39,23 +137,12 @@ void ObjectStream::OnNewMessage(Message& msg)
 void ObjectStream::NewObject(Message& msg)
 {
     Object ev = {};
+    ObjectSchema::Read(msg, ev);
 
-    ev.id = msg.ReadInt32();
-    ev.pos[0] = msg.ReadDouble();
-    ev.pos[1] = msg.ReadDouble();
-    ev.pos[2] = msg.ReadDouble();
-    ev.scale[0] = msg.ReadDouble();
-    ev.scale[1] = msg.ReadDouble();
-    ev.scale[2] = msg.ReadDouble();
-    ev.rot[0] = msg.ReadDouble();
-    ev.rot[1] = msg.ReadDouble();
-    ev.rot[2] = msg.ReadDouble();
-
-    const auto& data = msg.data();
-    std::vector<unsigned char> initialData(data, data + msg.size());
-    state.insert(std::pair<int, std::vector<unsigned char>>(ev.id, initialData));
-
-    ev.numCustomDataBytes = msg.ReadInt32();
+    // A repeated add for an object replaces its state.
+    StoreState(_states, ev.id, msg);
+    _edits.erase(ev.id);
+    _wholeUpdateSizes.erase(ev.id);
 
     OnNewObject(ev, msg);
 }
@@ -66,41 +153,92 @@ void ObjectStream::UpdateObject(Message& msg)
     const int version = msg.ReadInt32();
 
     const int numBytes = msg.ReadInt32();
-    unsigned char* data = new unsigned char[numBytes];
-    msg.ReadBytes(numBytes, data);
+    if (numBytes < 0 || size_t(numBytes) > msg.BytesRemaining())
+    {
+        return;
+    }
+    const unsigned char* data = msg.ReadSpan(numBytes);
 
-    std::vector<unsigned char> newData;
-    std::vector<unsigned char>& initialData = state[id];
-    Oxygen::Decompress(initialData.data(), initialData.size(), data, numBytes, newData);
+    const StateView initialData = _states.Find(id);
+    const int newSize = Oxygen::DecompressedSize(int(initialData.size), data, numBytes);
+    if (newSize < 0)
+    {
+        return;
+    }
 
-    delete[] data;
+    // Decoded into a pooled frame which the message reads in place. The frame is kept
+    // for the next update unless the handler held on to the message.
+    if (!_scratch || !_scratch.unique() || _scratch.capacity() < size_t(newSize))
+    {
+        _scratch = FramePool::Shared().Acquire(newSize);
+    }
+    Oxygen::Decompress(initialData.data, int(initialData.size), data, numBytes, _scratch.data(), newSize);
 
-    Oxygen::Message decompressedMessage(newData.data(), newData.size());
-    state[id] = newData;
+    // The state is patched in place when its block still fits it.
+    Oxygen::Message decompressedMessage(_scratch, 0, newSize);
+    const size_t previousSize = initialData.size;
+    std::memcpy(_states.Assign(id, newSize), _scratch.data(), newSize);
+    PruneEdits(id, previousSize);
 
     const int msgType = decompressedMessage.ReadInt32();
 
     Object ev = { };
     ev.version = version;
-    ev.id = decompressedMessage.ReadInt32();
-    ev.pos[0] = decompressedMessage.ReadDouble();
-    ev.pos[1] = decompressedMessage.ReadDouble();
-    ev.pos[2] = decompressedMessage.ReadDouble();
-    ev.scale[0] = decompressedMessage.ReadDouble();
-    ev.scale[1] = decompressedMessage.ReadDouble();
-    ev.scale[2] = decompressedMessage.ReadDouble();
-    ev.rot[0] = decompressedMessage.ReadDouble();
-    ev.rot[1] = decompressedMessage.ReadDouble();
-    ev.rot[2] = decompressedMessage.ReadDouble();
-
-    ev.numCustomDataBytes = decompressedMessage.ReadInt32();
+    ObjectSchema::Read(decompressedMessage, ev);
 
     OnUpdateObject(ev, decompressedMessage);
 }
 
 void ObjectStream::DeleteObject(Message& msg)
 {
-    OnDeleteObject(msg.ReadInt32());
+    const int id = msg.ReadInt32();
+    _states.Erase(id);
+    _edits.erase(id);
+    _wholeUpdateSizes.erase(id);
+
+    OnDeleteObject(id);
+}
+
+void ObjectStream::PruneEdits(int id, size_t previousSize)
+{
+    // Edits the stream has sent back are dropped. If the layout changed the offsets no longer
+    // apply, so all of them are. While a whole update is still to be sent back the edits are
+    // in its layout rather than the previous state's.
+    const StateView stateData = _states.Find(id);
+    size_t layoutSize = previousSize;
+    auto whole = _wholeUpdateSizes.find(id);
+    if (whole != _wholeUpdateSizes.end())
+    {
+        layoutSize = whole->second;
+        if (stateData.size == whole->second)
+        {
+            _wholeUpdateSizes.erase(whole);
+        }
+    }
+
+    auto it = _edits.find(id);
+    if (it == _edits.end())
+    {
+        return;
+    }
+
+    auto& edits = it->second;
+    if (stateData.size != layoutSize)
+    {
+        edits.clear();
+    }
+
+    for (auto edit = edits.begin(); edit != edits.end();)
+    {
+        const bool sent = edit->first + edit->second.size() <= stateData.size &&
+            std::memcmp(stateData.data + edit->first, edit->second.data(), edit->second.size()) == 0;
+        edit = sent ? edits.erase(edit) : std::next(edit);
+    }
+
+    if (edits.empty())
+    {
+        _edits.erase(it);
+    }
 }
 
 void ObjectStream::OnNewObject(const Object& ev, Message& msg)
@@ -126,16 +264,11 @@ void ObjectStream::OnStreamEnded()
 Message ObjectStream::BuildAddMessage(const Object& obj)
 {
     Oxygen::Message msg("LEVEL_SVR", "ADD_OBJECT");
-    msg.WriteDouble(obj.pos[0]); // Pos X
-    msg.WriteDouble(obj.pos[1]); // Pos Y
-    msg.WriteDouble(obj.pos[2]); // Pos Z
-    msg.WriteDouble(obj.scale[0]); // Scale X
-    msg.WriteDouble(obj.scale[1]); // Scale Y
-    msg.WriteDouble(obj.scale[2]); // Scale Z
-    msg.WriteDouble(obj.rot[0]); // Rot X
-    msg.WriteDouble(obj.rot[1]); // Rot Y
-    msg.WriteDouble(obj.rot[2]); // Rot Z
-    msg.WriteInt32(0);    // custom
+
+    // The custom data size is filled in by PrepareAddMessage.
+    Object header = obj;
+    header.numCustomDataBytes = 0;
+    ObjectAddSchema::Write(msg, header);
     _customDataPos = msg.size() - 4;
 
     return msg;
@@ -156,17 +289,11 @@ Message ObjectStream::BuildUpdateMessage(const Object& obj)
     Message msg("LEVEL_SVR", "OBJECT_STREAM");
 
     msg.WriteInt32(NEW_OBJECT);
-    msg.WriteInt32(obj.id);
-    msg.WriteDouble(obj.pos[0]); // Pos X
-    msg.WriteDouble(obj.pos[1]); // Pos Y
-    msg.WriteDouble(obj.pos[2]); // Pos Z
-    msg.WriteDouble(obj.scale[0]); // Scale X
-    msg.WriteDouble(obj.scale[1]); // Scale Y
-    msg.WriteDouble(obj.scale[2]); // Scale Z
-    msg.WriteDouble(obj.rot[0]); // Rot X
-    msg.WriteDouble(obj.rot[1]); // Rot Y
-    msg.WriteDouble(obj.rot[2]); // Rot Z
-    msg.WriteInt32(0);    // custom
+
+    // The custom data size is filled in by PrepareUpdateMessage.
+    Object header = obj;
+    header.numCustomDataBytes = 0;
+    ObjectSchema::Write(msg, header);
     _customDataPos = msg.size() - 4;
 
     return msg;
@@ -179,23 +306,111 @@ void ObjectStream::PrepareUpdateMessage(Message* msg, const Object& obj)
     int* customData = (int*) (msg->data() + _customDataPos);
     *customData = dataSize;
 
-    std::vector<unsigned char>& stateData = state[obj.id];
+    const StateView stateData = _states.Find(obj.id);
 
-    unsigned char* newData;
-    int numBytes = Oxygen::Compress(stateData.data(), stateData.size(), msg->data() + 8, msg->size() - 8, &newData);
+    // A whole update carries every edit. Its custom data is kept as the only edit, so a range
+    // update which replaces it before it is sent carries it on.
+    const int newSize = int(msg->size() - 8);
+    const StateView newState = { msg->data() + 8, size_t(newSize) };
+    const int newCustomDataPos = CustomDataOffset(newState);
+    auto& edits = _edits[obj.id];
+    edits.clear();
+    if (newCustomDataPos >= 0)
+    {
+        AddEdit(edits, newCustomDataPos, newState.data + newCustomDataPos, newSize - newCustomDataPos);
+    }
+    if (edits.empty())
+    {
+        _edits.erase(obj.id);
+    }
+    _wholeUpdateSizes[obj.id] = size_t(newSize);
+
+    // The delta is encoded into a buffer kept between updates, so only the message is allocated.
+    _delta.resize(Oxygen::CompressBound(int(stateData.size), newSize));
+    int numBytes = Oxygen::Compress(stateData.data, int(stateData.size), msg->data() + 8, newSize, _delta.data());
     if (numBytes > 0)
     {
-        Oxygen::Message msg2("LEVEL_SVR", "UPDATE_OBJECT");
+        Oxygen::Message msg2("LEVEL_SVR", "UPDATE_OBJECT", 12 + size_t(numBytes));
         msg2.WriteInt32(obj.id);
         msg2.WriteInt32(obj.version);
-        msg2.WriteBytes(numBytes, newData);
-        delete[] newData;
+        msg2.WriteBytes(numBytes, _delta.data());
 
+        // Deltas are taken against the last state the server sent, so a newer
+        // update for the object makes one which has not been sent yet redundant.
+        msg2.CoalesceBy(obj.id);
         msg2.Prepare();
-        *msg = msg2;
+        *msg = std::move(msg2);
     }
 }
 
+bool ObjectStream::PrepareUpdateMessage(Message* msg, const Object& obj, const DeltaRange* ranges, int numRanges)
+{
+    const StateView stateData = _states.Find(obj.id);
+    if (!stateData.data)
+    {
+        return false;
+    }
+
+    // The edits of a whole update which resized the object are not in the layout of the state.
+    const auto whole = _wholeUpdateSizes.find(obj.id);
+    if (whole != _wholeUpdateSizes.end() && whole->second != stateData.size)
+    {
+        return false;
+    }
+
+    const int customDataPos = CustomDataOffset(stateData);
+    if (customDataPos < 0)
+    {
+        return false;
+    }
+
+    const int numCustomDataBytes = int(stateData.size) - customDataPos;
+    for (int i = 0; i < numRanges; i++)
+    {
+        if (ranges[i].offset < 0 || ranges[i].size < 0 || ranges[i].offset > numCustomDataBytes - ranges[i].size)
+        {
+            return false;
+        }
+    }
+
+    auto& edits = _edits[obj.id];
+    for (int i = 0; i < numRanges; i++)
+    {
+        AddEdit(edits, customDataPos + ranges[i].offset, ranges[i].data, ranges[i].size);
+    }
+
+    // The header is always sent, it is small and holds the position. Its size is unchanged.
+    Object header = obj;
+    header.numCustomDataBytes = LoadLittleEndian<int>(stateData.data + customDataPos - 4);
+    unsigned char headerData[ObjectSchema::Size];
+    ObjectSchema::Encode(headerData, header);
+
+    _ranges.clear();
+    _ranges.push_back({ customDataPos - int(ObjectSchema::Size), int(ObjectSchema::Size), headerData });
+    for (const auto& edit : edits)
+    {
+        _ranges.push_back({ edit.first, int(edit.second.size()), edit.second.data() });
+    }
+
+    _delta.resize(Oxygen::CompressRangesBound(_ranges.data(), int(_ranges.size())));
+    const int numBytes = Oxygen::CompressRanges(stateData.data, int(stateData.size), _ranges.data(), int(_ranges.size()), _delta.data());
+    if (numBytes < 0)
+    {
+        return false;
+    }
+
+    Oxygen::Message msg2("LEVEL_SVR", "UPDATE_OBJECT", 12 + size_t(numBytes));
+    msg2.WriteInt32(obj.id);
+    msg2.WriteInt32(obj.version);
+    msg2.WriteBytes(numBytes, _delta.data());
+
+    // The pending edits are all in this update, so it can replace an older one.
+    msg2.CoalesceBy(obj.id);
+    msg2.Prepare();
+    *msg = std::move(msg2);
+    return true;
+}
+
 ObjectStream::~ObjectStream()
 {
 
@@ -1,5 +1,9 @@
 #pragma once
 #include "Subscriber.h"
+#include "Schema.h"
+#include "DeltaCompress.h"
+#include "StateCache.h"
+#include <map>
 
 namespace Oxygen
 {
@@ -13,6 +17,14 @@ namespace Oxygen
         int numCustomDataBytes;
     };
 
+    // The object header sent on the object stream, the custom data follows it.
+    using ObjectSchema = Schema<"OBJECT",
+        &Object::id, &Object::pos, &Object::scale, &Object::rot, &Object::numCustomDataBytes>;
+
+    // Objects are added without an id, the server assigns one.
+    using ObjectAddSchema = Schema<"OBJECT_ADD",
+        &Object::pos, &Object::scale, &Object::rot, &Object::numCustomDataBytes>;
+
     class ObjectStream : public Subscriber
     {
     public:
@@ -31,14 +43,45 @@ namespace Oxygen
         Message BuildUpdateMessage(const Object& obj);
         void PrepareUpdateMessage(Message* msg, const Object& obj);
 
+        // Builds the update for a change to only the given ranges of the object's custom data,
+        // offset from its start. The rest is copied from the state the stream last sent, so
+        // the cost is in the size of the ranges rather than of the object. msg need not come
+        // from BuildUpdateMessage. Returns false if the object has not been streamed, a range
+        // is outside its custom data or a whole update which resized the object has not been
+        // sent back yet, the caller should then send a whole update.
+        bool PrepareUpdateMessage(Message* msg, const Object& obj, const DeltaRange* ranges, int numRanges);
+
+        // The last state of each object, with its memory statistics.
+        inline const StateCache& States() const { return _states; }
+
+        // Keeps at most this many bytes of object states raw and the rest compressed, for
+        // clients short of memory. Updates to a compressed object cost a decompression.
+        inline void SetStateHotLimit(size_t maxHotBytes) { _states.SetHotLimit(maxHotBytes); }
+
         virtual ~ObjectStream();
 
     private:
         void NewObject(Message& msg);
         void UpdateObject(Message& msg);
         void DeleteObject(Message& msg);
+        void PruneEdits(int id, size_t previousSize);
 
-        std::unordered_map<int, std::vector<unsigned char>> state;
+        StateCache _states;
         int _customDataPos;
+
+        // The ranges sent by range updates which the stream has not sent back yet, keyed by their
+        // offset in the state. They are sent again with each range update for the object, as
+        // a newer update may replace an older one before it is sent. A whole update
+        // leaves its custom data as the only edit.
+        std::unordered_map<int, std::map<int, std::vector<unsigned char>>> _edits;
+
+        // The state size of the last whole update for each object, until the stream sends
+        // back a state of that size.
+        std::unordered_map<int, size_t> _wholeUpdateSizes;
+
+        // Reused by each update, see UpdateObject and PrepareUpdateMessage.
+        FrameRef _scratch;
+        std::vector<unsigned char> _delta;
+        std::vector<DeltaRange> _ranges;
     };
 }
@@ -0,0 +1,257 @@
+#include "Reactor.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+
+using namespace Oxygen;
+
+constexpr int MAX_EVENTS = 64;
+
+Reactor::Reactor()
+    :
+    _epoll(epoll_create1(EPOLL_CLOEXEC)),
+    _wakeFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    _running(true)
+{
+    // The wake descriptor is registered with a null pointer so it
+    // can be told apart from the handlers.
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    epoll_ctl(_epoll, EPOLL_CTL_ADD, _wakeFd, &ev);
+
+    _thread = std::thread(&Reactor::Run, this);
+}
+
+bool Reactor::Add(int fd, ReactorHandler* handler)
+{
+    std::lock_guard<std::recursive_mutex> lock(_lock);
+
+    epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = handler;
+    if (epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &ev) != 0)
+    {
+        return false;
+    }
+
+    Registration reg = {};
+    reg.fd = fd;
+    reg.readable = true;
+    _handlers[handler] = reg;
+    return true;
+}
+
+void Reactor::Remove(ReactorHandler* handler)
+{
+    {
+        // Acquiring the lock waits for any callbacks in flight to complete.
+        std::lock_guard<std::recursive_mutex> lock(_lock);
+
+        const auto& it = _handlers.find(handler);
+        if (it != _handlers.end())
+        {
+            epoll_ctl(_epoll, EPOLL_CTL_DEL, it->second.fd, nullptr);
+            _handlers.erase(it);
+            _timers.Cancel(TimerWheel::Key(reinterpret_cast<std::uintptr_t>(handler)));
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(_notifyLock);
+    _notify.erase(std::remove(_notify.begin(), _notify.end(), handler), _notify.end());
+}
+
+void Reactor::Update(ReactorHandler* handler, Registration& reg)
+{
+    epoll_event ev = {};
+    ev.events = (reg.readable ? uint32_t(EPOLLIN | EPOLLRDHUP) : 0) | (reg.writable ? uint32_t(EPOLLOUT) : 0);
+    ev.data.ptr = handler;
+    epoll_ctl(_epoll, EPOLL_CTL_MOD, reg.fd, &ev);
+}
+
+void Reactor::SetReadable(ReactorHandler* handler, bool readable)
+{
+    std::lock_guard<std::recursive_mutex> lock(_lock);
+
+    const auto& it = _handlers.find(handler);
+    if (it != _handlers.end() && it->second.readable != readable)
+    {
+        it->second.readable = readable;
+        Update(handler, it->second);
+    }
+}
+
+void Reactor::SetWritable(ReactorHandler* handler, bool writable)
+{
+    std::lock_guard<std::recursive_mutex> lock(_lock);
+
+    const auto& it = _handlers.find(handler);
+    if (it != _handlers.end() && it->second.writable != writable)
+    {
+        it->second.writable = writable;
+        Update(handler, it->second);
+    }
+}
+
+void Reactor::SetTimer(ReactorHandler* handler, Clock::time_point deadline)
+{
+    {
+        std::lock_guard<std::recursive_mutex> lock(_lock);
+
+        if (_handlers.find(handler) == _handlers.end())
+        {
+            return;
+        }
+
+        _timers.Schedule(TimerWheel::Key(reinterpret_cast<std::uintptr_t>(handler)), deadline);
+    }
+
+    // The loop may be sleeping with a longer timeout.
+    if (std::this_thread::get_id() != _thread.get_id())
+    {
+        Wake();
+    }
+}
+
+void Reactor::Notify(ReactorHandler* handler)
+{
+    bool wake = false;
+    {
+        std::lock_guard<std::mutex> lock(_notifyLock);
+        if (std::find(_notify.begin(), _notify.end(), handler) == _notify.end())
+        {
+            wake = _notify.empty();
+            _notify.push_back(handler);
+        }
+    }
+
+    if (wake)
+    {
+        Wake();
+    }
+}
+
+void Reactor::Wake()
+{
+    const std::uint64_t value = 1;
+    const ssize_t written = write(_wakeFd, &value, sizeof(value));
+    (void)written;
+}
+
+int Reactor::NextTimeout()
+{
+    std::lock_guard<std::recursive_mutex> lock(_lock);
+
+    if (_timers.Empty())
+    {
+        return -1;
+    }
+
+    const auto earliest = _timers.NextDeadline();
+    const auto now = Clock::now();
+    if (earliest <= now)
+    {
+        return 0;
+    }
+
+    // Round up so the loop does not wake just before the deadline.
+    const auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(earliest - now).count() + 1;
+    return (int)std::min<long long>(wait, 60000);
+}
+
+void Reactor::DispatchTimers()
+{
+    _timers.Expire(Clock::now(), _expired);
+
+    for (auto key : _expired)
+    {
+        // An earlier callback may have removed the handler.
+        ReactorHandler* handler = reinterpret_cast<ReactorHandler*>(std::uintptr_t(key));
+        if (_handlers.find(handler) != _handlers.end())
+        {
+            handler->OnTimer();
+        }
+    }
+
+    _expired.clear();
+}
+
+void Reactor::DispatchNotifications()
+{
+    {
+        std::lock_guard<std::mutex> lock(_notifyLock);
+        _notifyScratch.swap(_notify);
+    }
+
+    for (auto handler : _notifyScratch)
+    {
+        if (_handlers.find(handler) != _handlers.end())
+        {
+            handler->OnNotify();
+        }
+    }
+
+    _notifyScratch.clear();
+}
+
+void Reactor::Run()
+{
+    epoll_event events[MAX_EVENTS];
+
+    while (_running)
+    {
+        const int timeout = NextTimeout();
+        const int count = epoll_wait(_epoll, events, MAX_EVENTS, timeout);
+        if (count < 0 && errno != EINTR)
+        {
+            break;
+        }
+
+        std::lock_guard<std::recursive_mutex> lock(_lock);
+
+        for (int i = 0; i < count; i++)
+        {
+            ReactorHandler* handler = static_cast<ReactorHandler*>(events[i].data.ptr);
+            if (handler == nullptr)
+            {
+                std::uint64_t value;
+                const ssize_t consumed = read(_wakeFd, &value, sizeof(value));
+                (void)consumed;
+                continue;
+            }
+
+            const std::uint32_t flags = events[i].events;
+            if ((flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) &&
+                _handlers.find(handler) != _handlers.end())
+            {
+                handler->OnReadable();
+            }
+
+            if ((flags & EPOLLOUT) &&
+                _handlers.find(handler) != _handlers.end())
+            {
+                handler->OnWritable();
+            }
+        }
+
+        DispatchNotifications();
+        DispatchTimers();
+    }
+}
+
+Reactor::~Reactor()
+{
+    _running = false;
+    Wake();
+
+    if (_thread.joinable())
+    {
+        _thread.join();
+    }
+
+    close(_wakeFd);
+    close(_epoll);
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include "TimerWheel.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+
+namespace Oxygen
+{
+    // Receives the events for a single file descriptor registered with a Reactor.
+    // All callbacks are invoked on the reactor's thread.
+    class ReactorHandler
+    {
+    public:
+        virtual void OnReadable() = 0;
+        virtual void OnWritable() = 0;
+        virtual void OnNotify() = 0;
+        virtual void OnTimer() = 0;
+
+        virtual ~ReactorHandler() {}
+    };
+
+    // An epoll based event loop running on a single thread.
+    // Handlers may be added, removed and notified from any thread,
+    // once Remove returns the handler will receive no further callbacks.
+    class Reactor
+    {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        Reactor();
+
+        bool Add(int fd, ReactorHandler* handler);
+        void Remove(ReactorHandler* handler);
+        void SetReadable(ReactorHandler* handler, bool readable);
+        void SetWritable(ReactorHandler* handler, bool writable);
+        void SetTimer(ReactorHandler* handler, Clock::time_point deadline);
+        void Notify(ReactorHandler* handler);
+
+        ~Reactor();
+
+    private:
+        struct Registration
+        {
+            int fd;
+            bool readable;
+            bool writable;
+        };
+
+        void Run();
+        void Wake();
+        void Update(ReactorHandler* handler, Registration& reg);
+        int NextTimeout();
+        void DispatchTimers();
+        void DispatchNotifications();
+
+        int _epoll;
+        int _wakeFd;
+        std::atomic<bool> _running;
+        std::thread _thread;
+        std::recursive_mutex _lock;
+        std::unordered_map<ReactorHandler*, Registration> _handlers;
+
+        // Each handler has at most one timer, keyed by its address.
+        TimerWheel _timers;
+        std::vector<TimerWheel::Key> _expired;
+        std::mutex _notifyLock;
+        std::vector<ReactorHandler*> _notify;
+        std::vector<ReactorHandler*> _notifyScratch;
+    };
+}
@@ -0,0 +1,97 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <cstddef>
+
+namespace Oxygen
+{
+    // A bounded lock-free queue for exactly one producer thread and one consumer thread.
+    // Items are moved in and out, the capacity is rounded up to a power of two.
+    template<typename T>
+    class RingBuffer
+    {
+    public:
+        explicit RingBuffer(size_t capacity)
+            : _head(0), _tail(0), _highWaterMark(0)
+        {
+            size_t size = 1;
+            while (size < capacity)
+            {
+                size <<= 1;
+            }
+
+            _mask = size - 1;
+            _items.reset(new std::optional<T>[size]);
+        }
+
+        // Producer only. The item is left untouched when the ring is full.
+        inline bool TryPush(T&& item)
+        {
+            const size_t tail = _tail.load(std::memory_order_relaxed);
+            const size_t head = _head.load(std::memory_order_acquire);
+            if (tail - head > _mask)
+            {
+                return false;
+            }
+
+            _items[tail & _mask].emplace(std::move(item));
+            _tail.store(tail + 1, std::memory_order_release);
+
+            const size_t size = tail + 1 - head;
+            if (size > _highWaterMark.load(std::memory_order_relaxed))
+            {
+                _highWaterMark.store(size, std::memory_order_relaxed);
+            }
+
+            return true;
+        }
+
+        // Consumer only.
+        inline std::optional<T> TryPop()
+        {
+            const size_t head = _head.load(std::memory_order_relaxed);
+            const size_t tail = _tail.load(std::memory_order_acquire);
+            if (head == tail)
+            {
+                return std::nullopt;
+            }
+
+            std::optional<T>& slot = _items[head & _mask];
+            std::optional<T> item(std::move(slot));
+            slot.reset();
+            _head.store(head + 1, std::memory_order_release);
+
+            return item;
+        }
+
+        // Consumer only, the item is left in the queue.
+        inline T* Front()
+        {
+            const size_t head = _head.load(std::memory_order_relaxed);
+            if (head == _tail.load(std::memory_order_acquire))
+            {
+                return nullptr;
+            }
+
+            return &*_items[head & _mask];
+        }
+
+        inline size_t Size() const
+        {
+            return _tail.load(std::memory_order_acquire) - _head.load(std::memory_order_acquire);
+        }
+
+        inline size_t Capacity() const { return _mask + 1; }
+        inline size_t HighWaterMark() const { return _highWaterMark.load(std::memory_order_relaxed); }
+
+    private:
+        std::unique_ptr<std::optional<T>[]> _items;
+        size_t _mask;
+
+        // Keep the consumer and producer indices on separate cache lines.
+        alignas(64) std::atomic<size_t> _head;
+        alignas(64) std::atomic<size_t> _tail;
+        std::atomic<size_t> _highWaterMark;
+    };
+}
@@ -0,0 +1,99 @@
+#include "Routes.h"
+#include "ClientConnection.h"
+#include <unordered_map>
+#include <utility>
+
+using namespace Oxygen;
+
+struct Route
+{
+    std::string nodeName;
+    std::string messageName;
+    WritePriority priority;
+};
+
+// The order defines the ids, new pairs must only be appended.
+// Messages in different lanes can overtake each other, so all the messages of a
+// stream, and the object edits which must arrive in order, share a lane.
+static const Route ROUTES[] =
+{
+    { "ASSET_SVR", "ASSET_LIST", WritePriority::Normal },
+    { "ASSET_SVR", "ASSET_DOWNLOAD_STREAM", WritePriority::Bulk },
+    { "ASSET_SVR", "ASSET_UPLOAD_STREAM", WritePriority::Bulk },
+    { "BUILD_SVR", "ARTEFACT_DOWNLOAD_STREAM", WritePriority::Bulk },
+    { "HEARTBEAT", "", WritePriority::Normal },
+    { "LEVEL_SVR", "ADD_OBJECT", WritePriority::Interactive },
+    { "LEVEL_SVR", "CLOSE_LEVEL", WritePriority::Normal },
+    { "LEVEL_SVR", "DELETE_LEVEL", WritePriority::Normal },
+    { "LEVEL_SVR", "DELETE_OBJECT", WritePriority::Interactive },
+    { "LEVEL_SVR", "EVENT_STREAM", WritePriority::Normal },
+    { "LEVEL_SVR", "LIST_LEVELS", WritePriority::Normal },
+    { "LEVEL_SVR", "LOAD_LEVEL", WritePriority::Normal },
+    { "LEVEL_SVR", "NEW_LEVEL", WritePriority::Normal },
+    { "LEVEL_SVR", "OBJECT_STREAM", WritePriority::Normal },
+    { "LEVEL_SVR", "UPDATE_CURSOR", WritePriority::Interactive },
+    { "LEVEL_SVR", "UPDATE_OBJECT", WritePriority::Interactive },
+    { "LOGIN_SVR", "LOGIN", WritePriority::Normal },
+    { "LOGIN_SVR", "LOGIN_API_KEY", WritePriority::Normal },
+    { "METRIC_SVR", "METRIC_COLLECTION", WritePriority::Normal },
+    { "METRIC_SVR", "REPORT_METRIC", WritePriority::Normal },
+    { "PLUGIN_SVR", "CLOSE_NOTIFICATION_STREAM", WritePriority::Normal },
+    { "PLUGIN_SVR", "NOTIFICATION_STREAM", WritePriority::Normal },
+    { "PLUGIN_SVR", "SCHEDULE_PLUGIN", WritePriority::Normal },
+};
+
+constexpr int NUM_ROUTES = sizeof(ROUTES) / sizeof(ROUTES[0]);
+
+using RouteKey = std::pair<std::string_view, std::string_view>;
+
+struct RouteKeyHash
+{
+    size_t operator()(const RouteKey& key) const
+    {
+        const size_t h = std::hash<std::string_view>()(key.first);
+        return h ^ (std::hash<std::string_view>()(key.second) + 0x9e3779b9 + (h << 6) + (h >> 2));
+    }
+};
+
+// The keys view the strings in ROUTES so a lookup never allocates.
+static const std::unordered_map<RouteKey, int, RouteKeyHash>& Lookup()
+{
+    static const std::unordered_map<RouteKey, int, RouteKeyHash> lookup = []()
+    {
+        std::unordered_map<RouteKey, int, RouteKeyHash> map;
+        for (int i = 0; i < NUM_ROUTES; i++)
+        {
+            map.emplace(RouteKey(ROUTES[i].nodeName, ROUTES[i].messageName), i);
+        }
+        return map;
+    }();
+
+    return lookup;
+}
+
+int Routes::Count()
+{
+    return NUM_ROUTES;
+}
+
+int Routes::Find(std::string_view nodeName, std::string_view messageName)
+{
+    const auto& lookup = Lookup();
+    const auto& it = lookup.find(RouteKey(nodeName, messageName));
+    return it != lookup.end() ? it->second : -1;
+}
+
+const std::string& Routes::NodeName(int route)
+{
+    return ROUTES[route].nodeName;
+}
+
+const std::string& Routes::MessageName(int route)
+{
+    return ROUTES[route].messageName;
+}
+
+WritePriority Routes::Priority(int route)
+{
+    return ROUTES[route].priority;
+}
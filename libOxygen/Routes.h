@@ -0,0 +1,23 @@
+#pragma once
+#include <string>
+#include <string_view>
+
+namespace Oxygen
+{
+    enum class WritePriority : int;
+
+    // The node/message pairs known to both the client and the server.
+    // Once a connection has negotiated the table a pair is sent as its
+    // index instead of the two names.
+    class Routes
+    {
+    public:
+        static int Count();
+        static int Find(std::string_view nodeName, std::string_view messageName);
+        static const std::string& NodeName(int route);
+        static const std::string& MessageName(int route);
+
+        // The write queue lane used for the route when no priority is given.
+        static WritePriority Priority(int route);
+    };
+}
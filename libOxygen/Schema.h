@@ -0,0 +1,191 @@
+#pragma once
+#include "Message.h"
+#include "Endian.h"
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <type_traits>
+
+namespace Oxygen
+{
+    // A string literal usable as a template argument.
+    template<size_t N>
+    struct SchemaName
+    {
+        constexpr SchemaName(const char (&str)[N])
+        {
+            for (size_t i = 0; i < N; i++)
+            {
+                value[i] = str[i];
+            }
+        }
+
+        char value[N];
+    };
+
+    // The wire encoding of a single field. Type is part of the schema hash
+    // and must match the codes used by the server.
+    template<typename T, typename Enable = void>
+    struct SchemaField;
+
+    template<>
+    struct SchemaField<int>
+    {
+        static constexpr size_t Size = 4;
+        static constexpr unsigned char Type = 1;
+        static constexpr std::uint32_t Count = 1;
+
+        static inline void Encode(unsigned char* dst, int value) { StoreLittleEndian(dst, value); }
+        static inline void Decode(const unsigned char* src, int& value) { value = LoadLittleEndian<int>(src); }
+    };
+
+    template<>
+    struct SchemaField<double>
+    {
+        static constexpr size_t Size = 8;
+        static constexpr unsigned char Type = 2;
+        static constexpr std::uint32_t Count = 1;
+
+        static inline void Encode(unsigned char* dst, double value) { StoreLittleEndian(dst, std::bit_cast<std::uint64_t>(value)); }
+        static inline void Decode(const unsigned char* src, double& value) { value = std::bit_cast<double>(LoadLittleEndian<std::uint64_t>(src)); }
+    };
+
+    // Enums are sent as an int.
+    template<typename T>
+    struct SchemaField<T, std::enable_if_t<std::is_enum_v<T>>>
+    {
+        static constexpr size_t Size = 4;
+        static constexpr unsigned char Type = 1;
+        static constexpr std::uint32_t Count = 1;
+
+        static inline void Encode(unsigned char* dst, T value) { StoreLittleEndian(dst, int(value)); }
+        static inline void Decode(const unsigned char* src, T& value) { value = T(LoadLittleEndian<int>(src)); }
+    };
+
+    // Fixed size arrays are laid out back to back, so on little-endian targets
+    // the whole array is a single copy.
+    template<typename T, size_t N>
+    struct SchemaField<T[N]>
+    {
+        using Element = SchemaField<T>;
+
+        static constexpr size_t Size = Element::Size * N;
+        static constexpr unsigned char Type = Element::Type;
+        static constexpr std::uint32_t Count = Element::Count * N;
+
+        static inline void Encode(unsigned char* dst, const T (&values)[N])
+        {
+            if constexpr (std::endian::native == std::endian::little && Element::Size == sizeof(T) && std::is_arithmetic_v<T>)
+            {
+                std::memcpy(dst, values, Size);
+            }
+            else
+            {
+                for (size_t i = 0; i < N; i++)
+                {
+                    Element::Encode(dst + i * Element::Size, values[i]);
+                }
+            }
+        }
+
+        static inline void Decode(const unsigned char* src, T (&values)[N])
+        {
+            if constexpr (std::endian::native == std::endian::little && Element::Size == sizeof(T) && std::is_arithmetic_v<T>)
+            {
+                std::memcpy(values, src, Size);
+            }
+            else
+            {
+                for (size_t i = 0; i < N; i++)
+                {
+                    Element::Decode(src + i * Element::Size, values[i]);
+                }
+            }
+        }
+    };
+
+    template<typename T>
+    struct SchemaMember;
+
+    template<typename Class, typename T>
+    struct SchemaMember<T Class::*>
+    {
+        using Field = SchemaField<T>;
+    };
+
+    // Describes a fixed size payload as a sequence of data members, e.g.
+    //
+    //     using PointSchema = Schema<"POINT", &Point::x, &Point::y>;
+    //     PointSchema::Write(msg, point);
+    //
+    // The size of the payload is known at compile time, so writing a record
+    // reserves its space once and reading or writing has no branches.
+    // The hash covers the name and the field types and is checked by the server
+    // during the connection handshake.
+    template<SchemaName Label, auto... Members>
+    class Schema
+    {
+    public:
+        static constexpr std::string_view Name = std::string_view(Label.value, sizeof(Label.value) - 1);
+        static constexpr size_t Size = (SchemaMember<decltype(Members)>::Field::Size + ... + 0);
+
+        static constexpr std::uint32_t ComputeHash()
+        {
+            // FNV-1a over the name followed by the type and count of each field.
+            std::uint32_t hash = 2166136261u;
+            auto mix = [&hash](unsigned char value)
+            {
+                hash ^= value;
+                hash *= 16777619u;
+            };
+
+            for (const char c : Name)
+            {
+                mix((unsigned char)c);
+            }
+
+            auto mixField = [&mix](unsigned char type, std::uint32_t count)
+            {
+                mix(type);
+                mix(count & 0xFF);
+                mix((count >> 8) & 0xFF);
+                mix((count >> 16) & 0xFF);
+                mix((count >> 24) & 0xFF);
+            };
+
+            (mixField(SchemaMember<decltype(Members)>::Field::Type, SchemaMember<decltype(Members)>::Field::Count), ...);
+            return hash;
+        }
+
+        static constexpr std::uint32_t Hash = ComputeHash();
+
+        template<typename T>
+        static inline void Encode(unsigned char* dst, const T& record)
+        {
+            size_t offset = 0;
+            ((SchemaMember<decltype(Members)>::Field::Encode(dst + offset, record.*Members),
+                offset += SchemaMember<decltype(Members)>::Field::Size), ...);
+        }
+
+        template<typename T>
+        static inline void Decode(const unsigned char* src, T& record)
+        {
+            size_t offset = 0;
+            ((SchemaMember<decltype(Members)>::Field::Decode(src + offset, record.*Members),
+                offset += SchemaMember<decltype(Members)>::Field::Size), ...);
+        }
+
+        template<typename T>
+        static inline void Write(Message& msg, const T& record)
+        {
+            Encode(msg.WriteSpan(Size), record);
+        }
+
+        template<typename T>
+        static inline void Read(Message& msg, T& record)
+        {
+            Decode(msg.ReadSpan(Size), record);
+        }
+    };
+}
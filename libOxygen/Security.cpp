@@ -1,5 +1,5 @@
 #include "Security.h"
-#include "openssl\crypto.h"
+#include <openssl/crypto.h>
 
 #include <openssl/conf.h>
 #include <openssl/evp.h>
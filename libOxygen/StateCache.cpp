@@ -0,0 +1,421 @@
+#include "StateCache.h"
+#include "FrameCompress.h"
+#include <cstdint>
+#include <cstring>
+
+using namespace Oxygen;
+
+constexpr size_t MIN_CLASS_SIZE = 64;
+constexpr int CLASSES_PER_DOUBLING = 4;
+
+// Blocks are carved from slabs of about this size, larger classes have a slab per block.
+constexpr size_t SLAB_SIZE = 64 * 1024;
+
+// States larger than the biggest size class are allocated on their own.
+constexpr int LARGE_STATE = -1;
+
+constexpr size_t MIN_INDEX_SIZE = 16;
+constexpr int NO_RECORD = -1;
+
+static size_t ClassSize(int sizeClass)
+{
+    // Splitting each doubling keeps a block at most a quarter larger than the state in it.
+    if (sizeClass == 0)
+    {
+        return MIN_CLASS_SIZE;
+    }
+
+    const int doubling = (sizeClass - 1) / CLASSES_PER_DOUBLING;
+    const int step = (sizeClass - 1) % CLASSES_PER_DOUBLING + 1;
+    return (MIN_CLASS_SIZE << doubling) + step * ((MIN_CLASS_SIZE / CLASSES_PER_DOUBLING) << doubling);
+}
+
+static int SizeClassOf(size_t size)
+{
+    int sizeClass = 0;
+    while (sizeClass < STATE_CACHE_SIZE_CLASSES && ClassSize(sizeClass) < size)
+    {
+        sizeClass++;
+    }
+
+    return sizeClass < STATE_CACHE_SIZE_CLASSES ? sizeClass : LARGE_STATE;
+}
+
+StateCache::StateCache()
+    :
+    _index(MIN_INDEX_SIZE, Slot{ 0, NO_RECORD }),
+    _numObjects(0),
+    _numCold(0),
+    _head(NO_RECORD),
+    _tail(NO_RECORD),
+    _maxHotBytes(SIZE_MAX),
+    _free(),
+    _bytesCached(0),
+    _bytesHot(0),
+    _bytesStored(0),
+    _bytesReserved(0)
+{
+}
+
+size_t StateCache::Home(int id) const
+{
+    // The server hands out ids in sequence, so the id itself spreads them over the index
+    // and keeps the states of neighbouring objects together.
+    return std::uint32_t(id) & (_index.size() - 1);
+}
+
+bool StateCache::FindSlot(int id, size_t& slot) const
+{
+    // Returns false with slot at the empty slot which ends the probe.
+    for (slot = Home(id); _index[slot].record != NO_RECORD; slot = (slot + 1) & (_index.size() - 1))
+    {
+        if (_index[slot].id == id)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void StateCache::Allocate(Record& record, size_t size)
+{
+    const int sizeClass = SizeClassOf(size);
+    record.sizeClass = sizeClass;
+
+    if (sizeClass == LARGE_STATE)
+    {
+        record.capacity = std::uint32_t(size);
+        record.data = new unsigned char[size];
+        _bytesReserved += size;
+        return;
+    }
+
+    const size_t blockSize = ClassSize(sizeClass);
+    record.capacity = std::uint32_t(blockSize);
+
+    if (!_free[sizeClass])
+    {
+        // The new slab is split into blocks which are all put on the free list.
+        const size_t slabSize = blockSize < SLAB_SIZE ? SLAB_SIZE / blockSize * blockSize : blockSize;
+        _slabs.emplace_back(new unsigned char[slabSize]);
+        _bytesReserved += slabSize;
+
+        unsigned char* slab = _slabs.back().get();
+        for (size_t offset = slabSize; offset >= blockSize; offset -= blockSize)
+        {
+            unsigned char* block = slab + offset - blockSize;
+            std::memcpy(block, &_free[sizeClass], sizeof(unsigned char*));
+            _free[sizeClass] = block;
+        }
+    }
+
+    record.data = _free[sizeClass];
+    std::memcpy(&_free[sizeClass], record.data, sizeof(unsigned char*));
+}
+
+void StateCache::Free(Record& record)
+{
+    if (record.sizeClass == LARGE_STATE)
+    {
+        delete[] record.data;
+        _bytesReserved -= record.capacity;
+    }
+    else
+    {
+        // Slabs are kept until the cache is cleared, their blocks are reused for the class.
+        std::memcpy(record.data, &_free[record.sizeClass], sizeof(unsigned char*));
+        _free[record.sizeClass] = record.data;
+    }
+
+    record.data = nullptr;
+}
+
+void StateCache::Unlink(int index)
+{
+    Record& record = _records[index];
+    (record.prev != NO_RECORD ? _records[record.prev].next : _head) = record.next;
+    (record.next != NO_RECORD ? _records[record.next].prev : _tail) = record.prev;
+}
+
+void StateCache::PushFront(int index)
+{
+    Record& record = _records[index];
+    record.prev = NO_RECORD;
+    record.next = _head;
+    (_head != NO_RECORD ? _records[_head].prev : _tail) = index;
+    _head = index;
+}
+
+bool StateCache::Warm(int index)
+{
+    // The state is decompressed into a block for its raw size, then the compressed block
+    // is given back.
+    Record& record = _records[index];
+    Record compressed = record;
+
+    Allocate(record, record.size);
+    if (!DecompressBlock(compressed.data, compressed.stored, record.data, record.size))
+    {
+        Free(record);
+        record = compressed;
+        return false;
+    }
+
+    Free(compressed);
+
+    record.cold = false;
+    record.stored = record.size;
+    _numCold--;
+    _bytesHot += record.size;
+    _bytesStored -= compressed.stored;
+    _bytesStored += record.size;
+    return true;
+}
+
+void StateCache::Cool(int index)
+{
+    // The state is compressed into scratch space and moved to a block for its compressed
+    // size, so cold states share the slabs with the raw ones.
+    Record& record = _records[index];
+    Unlink(index);
+
+    _compressed.resize(FrameCompressor::Bound(record.size));
+    const size_t size = CompressBlock(record.data, record.size, _compressed.data(), _table);
+
+    Record raw = record;
+    Allocate(record, size);
+    std::memcpy(record.data, _compressed.data(), size);
+    Free(raw);
+
+    record.cold = true;
+    record.stored = std::uint32_t(size);
+    _numCold++;
+    _bytesHot -= record.size;
+    _bytesStored += size - record.size;
+
+    // Scratch space for states larger than the biggest class is not kept.
+    if (_compressed.capacity() > FrameCompressor::Bound(ClassSize(STATE_CACHE_SIZE_CLASSES - 1)))
+    {
+        std::vector<unsigned char>().swap(_compressed);
+    }
+}
+
+void StateCache::Evict(int keep)
+{
+    while (_bytesHot > _maxHotBytes && _tail != NO_RECORD && _tail != keep)
+    {
+        Cool(_tail);
+    }
+}
+
+void StateCache::Grow()
+{
+    std::vector<Slot> index(_index.size() * 2, Slot{ 0, NO_RECORD });
+    index.swap(_index);
+
+    for (const Slot& entry : index)
+    {
+        if (entry.record != NO_RECORD)
+        {
+            size_t slot = Home(entry.id);
+            while (_index[slot].record != NO_RECORD)
+            {
+                slot = (slot + 1) & (_index.size() - 1);
+            }
+            _index[slot] = entry;
+        }
+    }
+}
+
+StateView StateCache::Find(int id)
+{
+    size_t slot;
+    if (!FindSlot(id, slot))
+    {
+        return StateView{ nullptr, 0 };
+    }
+
+    const int index = _index[slot].record;
+    if (!_records[index].cold)
+    {
+        Unlink(index);
+    }
+    else if (!Warm(index))
+    {
+        // A state which does not decompress is dropped, as if the object had no state.
+        Erase(id);
+        return StateView{ nullptr, 0 };
+    }
+
+    PushFront(index);
+    Evict(index);
+
+    const Record& record = _records[index];
+    return StateView{ record.data, record.size };
+}
+
+unsigned char* StateCache::Assign(int id, size_t size)
+{
+    size_t slot;
+    if (FindSlot(id, slot))
+    {
+        const int index = _index[slot].record;
+        Record& record = _records[index];
+        _bytesCached += size - record.size;
+        _bytesStored -= record.stored;
+
+        if (record.cold)
+        {
+            // The old state is not kept, so there is nothing to decompress.
+            Free(record);
+            Allocate(record, size);
+            record.cold = false;
+            _numCold--;
+        }
+        else
+        {
+            // A state stays in its block unless it no longer fits or has shrunk to a quarter of
+            // the block, so a state which changes size back and forth does not move each time.
+            Unlink(index);
+            _bytesHot -= record.size;
+            if (size > record.capacity || (record.sizeClass != 0 && size <= record.capacity / 4))
+            {
+                Free(record);
+                Allocate(record, size);
+            }
+        }
+
+        record.size = std::uint32_t(size);
+        record.stored = std::uint32_t(size);
+        _bytesHot += size;
+        _bytesStored += size;
+
+        // The state is written after this returns, so it is never the one compressed.
+        PushFront(index);
+        Evict(index);
+        return record.data;
+    }
+
+    // The index is kept at most half full so probes stay short.
+    if (size_t(_numObjects + 1) * 2 > _index.size())
+    {
+        Grow();
+        FindSlot(id, slot);
+    }
+
+    int index;
+    if (!_freeRecords.empty())
+    {
+        index = _freeRecords.back();
+        _freeRecords.pop_back();
+    }
+    else
+    {
+        index = int(_records.size());
+        _records.emplace_back();
+    }
+
+    Record& record = _records[index];
+    record.cold = false;
+    record.size = std::uint32_t(size);
+    record.stored = std::uint32_t(size);
+    Allocate(record, size);
+    _index[slot] = Slot{ id, index };
+
+    _numObjects++;
+    _bytesCached += size;
+    _bytesHot += size;
+    _bytesStored += size;
+
+    PushFront(index);
+    Evict(index);
+    return record.data;
+}
+
+void StateCache::Erase(int id)
+{
+    size_t gap;
+    if (!FindSlot(id, gap))
+    {
+        return;
+    }
+
+    const int index = _index[gap].record;
+    Record& record = _records[index];
+    if (record.cold)
+    {
+        _numCold--;
+    }
+    else
+    {
+        Unlink(index);
+        _bytesHot -= record.size;
+    }
+
+    _bytesCached -= record.size;
+    _bytesStored -= record.stored;
+    _numObjects--;
+    Free(record);
+    _freeRecords.push_back(index);
+    _index[gap].record = NO_RECORD;
+
+    // The entries after it in the run are moved back into the gap if their probe passed
+    // over it, so no entry is left behind an empty slot.
+    const size_t mask = _index.size() - 1;
+    for (size_t slot = (gap + 1) & mask; _index[slot].record != NO_RECORD; slot = (slot + 1) & mask)
+    {
+        const size_t home = Home(_index[slot].id);
+        if (((slot - home) & mask) >= ((slot - gap) & mask))
+        {
+            _index[gap] = _index[slot];
+            _index[slot].record = NO_RECORD;
+            gap = slot;
+        }
+    }
+}
+
+void StateCache::SetHotLimit(size_t maxHotBytes)
+{
+    _maxHotBytes = maxHotBytes;
+    Evict(_head);
+}
+
+StateCache::~StateCache()
+{
+    Clear();
+}
+
+void StateCache::Clear()
+{
+    for (const Slot& slot : _index)
+    {
+        if (slot.record != NO_RECORD && _records[slot.record].sizeClass == LARGE_STATE)
+        {
+            delete[] _records[slot.record].data;
+        }
+    }
+
+    _index.assign(MIN_INDEX_SIZE, Slot{ 0, NO_RECORD });
+    _records.clear();
+    _freeRecords.clear();
+    _numObjects = 0;
+    _numCold = 0;
+    _head = NO_RECORD;
+    _tail = NO_RECORD;
+
+    for (unsigned char*& block : _free)
+    {
+        block = nullptr;
+    }
+    _slabs.clear();
+
+    _bytesCached = 0;
+    _bytesHot = 0;
+    _bytesStored = 0;
+    _bytesReserved = 0;
+}
+
+double StateCache::Fragmentation() const
+{
+    return _bytesReserved ? 1.0 - double(_bytesStored) / double(_bytesReserved) : 0.0;
+}
@@ -0,0 +1,123 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace Oxygen
+{
+    // Size classes run from 64 bytes to 1 MB, four to each doubling.
+    constexpr int STATE_CACHE_SIZE_CLASSES = 57;
+
+    // The bytes of a cached state, empty if there is none.
+    struct StateView
+    {
+        const unsigned char* data;
+        size_t size;
+    };
+
+    // Holds the last state of each object of a stream. The states are blocks of size classes
+    // carved from shared slabs, found by an open addressing index from the object id, so a
+    // level with thousands of objects is a few large allocations rather than one each. A
+    // state which changes size stays in its block while it fits, and larger states than the
+    // biggest class are allocated on their own. Not thread safe.
+    // States are raw unless a hot limit is set. Past it the least recently used states are
+    // compressed, and decompressed again when they are next found.
+    class StateCache
+    {
+    public:
+        StateCache();
+
+        // The view is valid until the cache is next changed. Finding a state may decompress
+        // it and compress others.
+        StateView Find(int id);
+
+        // Returns where to write the object's new state of size bytes. The old state is not
+        // kept, the block is the same one if it still fits.
+        unsigned char* Assign(int id, size_t size);
+
+        void Erase(int id);
+        void Clear();
+
+        // Keeps at most this many bytes of states raw, the rest are compressed. SIZE_MAX, the
+        // default, keeps them all raw. The most recently used state is always raw.
+        void SetHotLimit(size_t maxHotBytes);
+        inline size_t HotLimit() const { return _maxHotBytes; }
+
+        inline int NumObjects() const { return _numObjects; }
+        inline int NumCold() const { return _numCold; }
+
+        // The bytes of the states, and of those which are raw.
+        inline size_t BytesCached() const { return _bytesCached; }
+        inline size_t BytesHot() const { return _bytesHot; }
+
+        // The bytes the states take as they are kept, and the bytes held for them including
+        // unused blocks and the unused end of each block.
+        inline size_t BytesStored() const { return _bytesStored; }
+        inline size_t BytesReserved() const { return _bytesReserved; }
+
+        // The share of the bytes held which do not hold state.
+        double Fragmentation() const;
+
+        StateCache(const StateCache&) = delete;
+        StateCache& operator=(const StateCache&) = delete;
+
+        ~StateCache();
+
+    private:
+        // Records stay put as the index grows and entries move, so they can be linked.
+        struct Record
+        {
+            int sizeClass;
+            bool cold;
+            std::uint32_t size;
+            std::uint32_t stored;
+            std::uint32_t capacity;
+            int prev;
+            int next;
+            unsigned char* data;
+        };
+
+        struct Slot
+        {
+            int id;
+            int record;
+        };
+
+        size_t Home(int id) const;
+        bool FindSlot(int id, size_t& slot) const;
+        void Grow();
+        void Allocate(Record& record, size_t size);
+        void Free(Record& record);
+        void Unlink(int index);
+        void PushFront(int index);
+        bool Warm(int index);
+        void Cool(int index);
+        void Evict(int keep);
+
+        // A slot with no record is empty.
+        std::vector<Slot> _index;
+        std::vector<Record> _records;
+        std::vector<int> _freeRecords;
+        int _numObjects;
+        int _numCold;
+
+        // The raw states, most recently used first.
+        int _head;
+        int _tail;
+        size_t _maxHotBytes;
+
+        // Each free block starts with a pointer to the next one.
+        unsigned char* _free[STATE_CACHE_SIZE_CLASSES];
+        std::vector<std::unique_ptr<unsigned char[]>> _slabs;
+
+        // Scratch space for compressing a state.
+        std::vector<unsigned char> _compressed;
+        std::vector<std::uint32_t> _table;
+
+        size_t _bytesCached;
+        size_t _bytesHot;
+        size_t _bytesStored;
+        size_t _bytesReserved;
+    };
+}
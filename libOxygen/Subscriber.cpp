@@ -3,7 +3,13 @@
 using namespace Oxygen;
 
 Subscriber::Subscriber(const Message& msg)
-    : _request(msg), _id(-1)
+    : _request(msg), _timeout(0), _retryInterval(0), _retries(0), _id(-1)
+{
+
+}
+
+Subscriber::Subscriber(Message&& msg)
+    : _request(std::move(msg)), _timeout(0), _retryInterval(0), _retries(0), _id(-1)
 {
 
 }
@@ -39,6 +45,57 @@ void Subscriber::OnNewMessage(Message& msg)
     // By default this does nothing.
 }
 
+void Subscriber::SetTimeout(std::chrono::milliseconds timeout)
+{
+    _timeout = timeout;
+}
+
+void Subscriber::SetRetry(std::chrono::milliseconds interval, int retries)
+{
+    _retryInterval = interval;
+    _retries = retries;
+}
+
+void Subscriber::SignalTimeout(const std::function<void()>& callback)
+{
+    _timeoutCallback.push_back(callback);
+}
+
+void Subscriber::Expire()
+{
+    OnTimeout();
+
+    for (auto& callback : _timeoutCallback)
+    {
+        callback();
+    }
+}
+
+void Subscriber::OnTimeout()
+{
+    // By default this does nothing.
+}
+
+void Subscriber::SignalSuperseded(const std::function<void()>& callback)
+{
+    _supersededCallback.push_back(callback);
+}
+
+void Subscriber::Supersede()
+{
+    OnSuperseded();
+
+    for (auto& callback : _supersededCallback)
+    {
+        callback();
+    }
+}
+
+void Subscriber::OnSuperseded()
+{
+    // By default this does nothing.
+}
+
 Subscriber::~Subscriber()
 {
     // By default this does nothing.
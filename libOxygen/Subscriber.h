@@ -1,6 +1,7 @@
 #pragma once
 #include <string>
 #include <functional>
+#include <chrono>
 #include "Message.h"
 
 namespace Oxygen
@@ -10,6 +11,7 @@ namespace Oxygen
     public:
 
         Subscriber(const Message& msg);
+        Subscriber(Message&& msg);
 
         void SetId(int id);
         int Id() const { return _id; }
@@ -18,6 +20,27 @@ namespace Oxygen
         void NewMessage(const Message& msg);
         virtual void OnNewMessage(Message& msg);
 
+        // The request fails if no response has arrived within the timeout, in which case
+        // the subscriber is removed and signalled with a timeout instead. Zero waits forever.
+        void SetTimeout(std::chrono::milliseconds timeout);
+        inline std::chrono::milliseconds Timeout() const { return _timeout; }
+
+        // Sends the request again after each interval until the first response arrives.
+        // Only for requests which are safe to repeat, the server may see each copy.
+        void SetRetry(std::chrono::milliseconds interval, int retries);
+        inline std::chrono::milliseconds RetryInterval() const { return _retryInterval; }
+        inline int Retries() const { return _retries; }
+
+        void SignalTimeout(const std::function<void()>& callback);
+        void Expire();
+        virtual void OnTimeout();
+
+        // Signalled instead of a response when the request was replaced in the write queue
+        // by a newer one with the same coalesce key, see Message::SetCoalesceKey.
+        void SignalSuperseded(const std::function<void()>& callback);
+        void Supersede();
+        virtual void OnSuperseded();
+
         virtual ~Subscriber();
     
     protected:
@@ -26,6 +49,11 @@ namespace Oxygen
     private:
         Message _request;
         std::vector<std::function<void(Message&)>> _callback;
+        std::vector<std::function<void()>> _timeoutCallback;
+        std::vector<std::function<void()>> _supersededCallback;
+        std::chrono::milliseconds _timeout;
+        std::chrono::milliseconds _retryInterval;
+        int _retries;
         int _id;
     };
 }
@@ -0,0 +1,280 @@
+#include "TimerWheel.h"
+#include <algorithm>
+#include <bit>
+
+using namespace Oxygen;
+
+TimerWheel::TimerWheel(Clock::duration resolution)
+    :
+    _origin(Clock::now()),
+    _resolution(std::max(resolution, Clock::duration(1))),
+    _now(0),
+    _due(-1)
+{
+    for (int level = 0; level < LEVELS; level++)
+    {
+        std::fill(_slots[level], _slots[level] + SLOTS, -1);
+        _occupied[level] = 0;
+    }
+}
+
+std::uint64_t TimerWheel::ToTick(Clock::time_point time, bool roundUp) const
+{
+    // Deadlines are rounded up and the current time down, so a timer never fires early.
+    if (time <= _origin)
+    {
+        return 0;
+    }
+
+    const auto elapsed = (time - _origin).count();
+    const auto resolution = _resolution.count();
+    std::uint64_t tick = std::uint64_t(elapsed / resolution);
+    if (roundUp && elapsed % resolution != 0)
+    {
+        tick++;
+    }
+    return tick;
+}
+
+int& TimerWheel::Head(int level, int slot)
+{
+    return level == DUE ? _due : _slots[level][slot];
+}
+
+void TimerWheel::Link(int index, int level, int slot)
+{
+    Node& node = _nodes[index];
+    int& head = Head(level, slot);
+
+    node.level = level;
+    node.slot = slot;
+    node.prev = -1;
+    node.next = head;
+    if (head != -1)
+    {
+        _nodes[head].prev = index;
+    }
+    head = index;
+
+    if (level != DUE)
+    {
+        _occupied[level] |= std::uint64_t(1) << slot;
+    }
+}
+
+void TimerWheel::Unlink(int index)
+{
+    Node& node = _nodes[index];
+    if (node.prev != -1)
+    {
+        _nodes[node.prev].next = node.next;
+    }
+    else
+    {
+        Head(node.level, node.slot) = node.next;
+    }
+
+    if (node.next != -1)
+    {
+        _nodes[node.next].prev = node.prev;
+    }
+
+    if (node.level != DUE && _slots[node.level][node.slot] == -1)
+    {
+        _occupied[node.level] &= ~(std::uint64_t(1) << node.slot);
+    }
+}
+
+void TimerWheel::Insert(int index)
+{
+    const std::uint64_t tick = _nodes[index].tick;
+    if (tick <= _now)
+    {
+        Link(index, DUE, 0);
+        return;
+    }
+
+    // Each level covers SLOTS times the range of the one below it. A timer is
+    // moved down a level each time the wheel reaches the slot it is in.
+    const std::uint64_t delta = tick - _now;
+    for (int level = 0; level < LEVELS; level++)
+    {
+        const int shift = SLOT_BITS * level;
+        if (delta < (std::uint64_t(1) << (shift + SLOT_BITS)))
+        {
+            Link(index, level, int((tick >> shift) & (SLOTS - 1)));
+            return;
+        }
+    }
+
+    // Timers beyond the range of the wheel wait in the last slot of the top level
+    // and are placed again when it is reached.
+    const int shift = SLOT_BITS * (LEVELS - 1);
+    const std::uint64_t last = _now + (std::uint64_t(1) << (shift + SLOT_BITS)) - 1;
+    Link(index, LEVELS - 1, int((last >> shift) & (SLOTS - 1)));
+}
+
+void TimerWheel::Schedule(Key key, Clock::time_point deadline)
+{
+    int index;
+    const auto& it = _keys.find(key);
+    if (it != _keys.end())
+    {
+        index = it->second;
+        Unlink(index);
+    }
+    else
+    {
+        if (_free.empty())
+        {
+            index = int(_nodes.size());
+            _nodes.emplace_back();
+        }
+        else
+        {
+            index = _free.back();
+            _free.pop_back();
+        }
+
+        _keys.emplace(key, index);
+    }
+
+    _nodes[index].key = key;
+    _nodes[index].tick = ToTick(deadline, true);
+    Insert(index);
+}
+
+bool TimerWheel::Cancel(Key key)
+{
+    const auto& it = _keys.find(key);
+    if (it == _keys.end())
+    {
+        return false;
+    }
+
+    Unlink(it->second);
+    _free.push_back(it->second);
+    _keys.erase(it);
+    return true;
+}
+
+bool TimerWheel::Contains(Key key) const
+{
+    return _keys.find(key) != _keys.end();
+}
+
+TimerWheel::Clock::time_point TimerWheel::NextDeadline() const
+{
+    if (_keys.empty())
+    {
+        return Clock::time_point::max();
+    }
+
+    if (_due != -1)
+    {
+        return _origin + _resolution * _now;
+    }
+
+    // The first occupied slot after the current position of each level gives the
+    // earliest tick it can expire at, which is exact for the lowest level.
+    std::uint64_t earliest = ~std::uint64_t(0);
+    for (int level = 0; level < LEVELS; level++)
+    {
+        const int shift = SLOT_BITS * level;
+        const std::uint64_t position = _now >> shift;
+        const std::uint64_t ahead = std::rotr(_occupied[level], int((position + 1) & (SLOTS - 1)));
+        if (ahead != 0)
+        {
+            const std::uint64_t distance = std::uint64_t(std::countr_zero(ahead)) + 1;
+            earliest = std::min(earliest, (position + distance) << shift);
+        }
+    }
+
+    return _origin + _resolution * earliest;
+}
+
+void TimerWheel::Release(int index, std::vector<Key>& expired)
+{
+    const Key key = _nodes[index].key;
+    expired.push_back(key);
+    _keys.erase(key);
+    _free.push_back(index);
+}
+
+void TimerWheel::Cascade(int level)
+{
+    const int slot = int((_now >> (SLOT_BITS * level)) & (SLOTS - 1));
+    int index = _slots[level][slot];
+    _slots[level][slot] = -1;
+    _occupied[level] &= ~(std::uint64_t(1) << slot);
+
+    while (index != -1)
+    {
+        const int next = _nodes[index].next;
+        Insert(index);
+        index = next;
+    }
+}
+
+void TimerWheel::Expire(Clock::time_point now, std::vector<Key>& expired)
+{
+    const std::uint64_t target = ToTick(now, false);
+    while (true)
+    {
+        while (_due != -1)
+        {
+            const int index = _due;
+            _due = _nodes[index].next;
+            Release(index, expired);
+        }
+
+        if (_now >= target)
+        {
+            break;
+        }
+
+        if (_keys.empty())
+        {
+            _now = target;
+            break;
+        }
+
+        // Jumps straight to the next occupied slot of the lowest level, stopping
+        // at the end of its rotation where the levels above are cascaded down.
+        const int position = int(_now & (SLOTS - 1));
+        std::uint64_t next = (_now | (SLOTS - 1)) + 1;
+        if (position != SLOTS - 1)
+        {
+            const std::uint64_t ahead = _occupied[0] & (~std::uint64_t(0) << (position + 1));
+            if (ahead != 0)
+            {
+                next = (_now & ~std::uint64_t(SLOTS - 1)) + std::uint64_t(std::countr_zero(ahead));
+            }
+        }
+        _now = std::min(next, target);
+
+        if ((_now & (SLOTS - 1)) == 0)
+        {
+            // Higher levels first, they can fill the slot the next level down is about to empty.
+            for (int level = LEVELS - 1; level > 0; level--)
+            {
+                if ((_now & ((std::uint64_t(1) << (SLOT_BITS * level)) - 1)) == 0)
+                {
+                    Cascade(level);
+                }
+            }
+        }
+
+        const int slot = int(_now & (SLOTS - 1));
+        int index = _slots[0][slot];
+        _slots[0][slot] = -1;
+        _occupied[0] &= ~(std::uint64_t(1) << slot);
+
+        while (index != -1)
+        {
+            const int next = _nodes[index].next;
+            Release(index, expired);
+            index = next;
+        }
+    }
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace Oxygen
+{
+    // A hierarchical timing wheel. Scheduling and cancelling a timer is O(1) and
+    // advancing the clock only visits the slots which hold timers, so a loop with
+    // thousands of pending timeouts pays the same as one with a single timer.
+    // Timers are identified by a caller chosen key, the wheel is not thread safe.
+    class TimerWheel
+    {
+    public:
+        using Clock = std::chrono::steady_clock;
+        using Key = std::uint64_t;
+
+        explicit TimerWheel(Clock::duration resolution = std::chrono::milliseconds(1));
+
+        // Replaces any deadline already set for the key.
+        void Schedule(Key key, Clock::time_point deadline);
+        bool Cancel(Key key);
+        bool Contains(Key key) const;
+        inline bool Empty() const { return _keys.empty(); }
+
+        // The earliest time a timer can expire, which may be before the actual
+        // deadline of a distant timer. Returns time_point::max() when empty.
+        Clock::time_point NextDeadline() const;
+
+        // Removes the timers which are due and appends their keys to expired.
+        void Expire(Clock::time_point now, std::vector<Key>& expired);
+
+    private:
+        static constexpr int LEVELS = 4;
+        static constexpr int SLOT_BITS = 6;
+        static constexpr int SLOTS = 1 << SLOT_BITS;
+        static constexpr int DUE = -1;
+
+        struct Node
+        {
+            Key key;
+            std::uint64_t tick;
+            int level;
+            int slot;
+            int prev;
+            int next;
+        };
+
+        std::uint64_t ToTick(Clock::time_point time, bool roundUp) const;
+        void Insert(int index);
+        void Unlink(int index);
+        void Link(int index, int level, int slot);
+        void Cascade(int level);
+        void Release(int index, std::vector<Key>& expired);
+        int& Head(int level, int slot);
+
+        Clock::time_point _origin;
+        Clock::duration _resolution;
+        std::uint64_t _now;
+
+        // Each slot is a linked list through _nodes, the bitmaps mark the
+        // slots which are not empty so empty ticks can be skipped.
+        int _slots[LEVELS][SLOTS];
+        std::uint64_t _occupied[LEVELS];
+        int _due;
+
+        std::vector<Node> _nodes;
+        std::vector<int> _free;
+        std::unordered_map<Key, int> _keys;
+    };
+}
@@ -0,0 +1,562 @@
+#include "Transport.h"
+#include "ClientConnection.h"
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#endif
+
+#include <cstdlib>
+
+using namespace Oxygen;
+
+static bool ParsePort(const std::string& text, int& port)
+{
+    char* end = nullptr;
+    const long value = std::strtol(text.c_str(), &end, 10);
+    if (text.empty() || *end != '\0' || value <= 0 || value > 65535)
+    {
+        return false;
+    }
+
+    port = int(value);
+    return true;
+}
+
+bool Endpoint::Parse(const std::string& url, int defaultPort, Endpoint& endpoint)
+{
+    endpoint = Endpoint();
+    endpoint.port = defaultPort;
+
+    const size_t separator = url.find("://");
+    if (separator == std::string::npos)
+    {
+        endpoint.host = url;
+        return !endpoint.host.empty();
+    }
+
+    const std::string scheme = url.substr(0, separator);
+    std::string address = url.substr(separator + 3);
+
+    if (scheme == "unix" || scheme == "shm")
+    {
+        endpoint.scheme = scheme == "unix" ? Scheme::Unix : Scheme::SharedMemory;
+        endpoint.path = address;
+        return !endpoint.path.empty();
+    }
+    else if (scheme != "tcp")
+    {
+        return false;
+    }
+
+    if (!address.empty() && address.back() == '/')
+    {
+        address.pop_back();
+    }
+
+    if (!address.empty() && address.front() == '[')
+    {
+        // An IPv6 address, which has colons of its own.
+        const size_t end = address.find(']');
+        if (end == std::string::npos)
+        {
+            return false;
+        }
+
+        endpoint.host = address.substr(1, end - 1);
+        if (end + 1 < address.size())
+        {
+            return address[end + 1] == ':' && ParsePort(address.substr(end + 2), endpoint.port);
+        }
+        return !endpoint.host.empty();
+    }
+
+    const size_t colon = address.find(':');
+    if (colon != std::string::npos && colon == address.rfind(':'))
+    {
+        endpoint.host = address.substr(0, colon);
+        return !endpoint.host.empty() && ParsePort(address.substr(colon + 1), endpoint.port);
+    }
+
+    endpoint.host = address;
+    return !endpoint.host.empty();
+}
+
+#ifndef _WIN32
+
+namespace
+{
+    using namespace Oxygen;
+
+    class SocketTransport : public Transport
+    {
+    public:
+        SocketTransport(int sock, bool tcp) : _sock(sock), _tcp(tcp) {}
+
+        virtual int Fd() const { return _sock; }
+
+        virtual ssize_t Read(unsigned char* data, size_t size)
+        {
+            return recv(_sock, data, size, 0);
+        }
+
+        virtual ssize_t Write(const iovec* buffers, int count)
+        {
+            msghdr header = {};
+            header.msg_iov = const_cast<iovec*>(buffers);
+            header.msg_iovlen = count;
+            return sendmsg(_sock, &header, MSG_NOSIGNAL);
+        }
+
+        virtual void Cork(bool cork)
+        {
+#ifdef TCP_CORK
+            if (_tcp)
+            {
+                int value = cork ? 1 : 0;
+                setsockopt(_sock, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+            }
+#endif
+        }
+
+        virtual ~SocketTransport()
+        {
+            close(_sock);
+        }
+
+    private:
+        int _sock;
+        bool _tcp;
+    };
+
+    //============================================================
+
+    // The mapping shared with the server starts with a file header, followed by the
+    // ring the client writes and then the ring the server writes. Each ring has a
+    // header of its own in front of its data:
+    //   0    head, the position the consumer has read up to
+    //   64   tail, the position the producer has written up to
+    //   128  waiting, set by the consumer before it sleeps on the socket
+    // Positions only ever increase, the offset into the data is the position modulo
+    // the capacity. The O2Core server maps the same layout, see SharedMemoryStream.cs.
+    constexpr std::uint32_t SHARED_MEMORY_MAGIC = 0x4D53584F; // "OXSM"
+    constexpr std::uint32_t SHARED_MEMORY_VERSION = 2;
+    constexpr size_t FILE_HEADER_SIZE = 64;
+    constexpr size_t RING_HEADER_SIZE = 256;
+    constexpr size_t MIN_RING_CAPACITY = 64 * 1024;
+
+    // The server replies to the handshake once it has created and mapped the file.
+    constexpr int HANDSHAKE_TIMEOUT_SECONDS = 5;
+    constexpr std::uint32_t MAX_PATH_LENGTH = 4096;
+
+    class SharedRing
+    {
+    public:
+        SharedRing() : _base(nullptr), _data(nullptr), _capacity(0) {}
+
+        void Attach(unsigned char* base, size_t capacity)
+        {
+            _base = base;
+            _data = base + RING_HEADER_SIZE;
+            _capacity = capacity;
+        }
+
+        // Producer only.
+        size_t Write(const iovec* buffers, int count)
+        {
+            const std::uint64_t tail = Tail().load(std::memory_order_relaxed);
+            const std::uint64_t head = Head().load(std::memory_order_acquire);
+
+            size_t space = _capacity - size_t(tail - head);
+            size_t written = 0;
+            for (int i = 0; i < count && space > 0; i++)
+            {
+                const size_t size = std::min(buffers[i].iov_len, space);
+                Copy(tail + written, static_cast<const unsigned char*>(buffers[i].iov_base), size);
+                written += size;
+                space -= size;
+            }
+
+            if (written > 0)
+            {
+                Tail().store(tail + written, std::memory_order_release);
+            }
+            return written;
+        }
+
+        // Consumer only.
+        size_t Read(unsigned char* data, size_t size)
+        {
+            const std::uint64_t head = Head().load(std::memory_order_relaxed);
+            const std::uint64_t tail = Tail().load(std::memory_order_acquire);
+
+            const size_t count = std::min(size, size_t(tail - head));
+            if (count > 0)
+            {
+                const size_t offset = size_t(head & (_capacity - 1));
+                const size_t first = std::min(count, _capacity - offset);
+                std::memcpy(data, _data + offset, first);
+                std::memcpy(data + first, _data, count - first);
+                Head().store(head + count, std::memory_order_release);
+            }
+            return count;
+        }
+
+        // The consumer flags itself before checking the ring a final time and the
+        // producer checks the flag after publishing, so one of them sees the other.
+        void SetWaiting()
+        {
+            Waiting().store(1, std::memory_order_seq_cst);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+
+        bool TakeWaiting()
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            return Waiting().load(std::memory_order_seq_cst) != 0 && Waiting().exchange(0) != 0;
+        }
+
+    private:
+        std::atomic_ref<std::uint64_t> Head() const { return std::atomic_ref<std::uint64_t>(*reinterpret_cast<std::uint64_t*>(_base)); }
+        std::atomic_ref<std::uint64_t> Tail() const { return std::atomic_ref<std::uint64_t>(*reinterpret_cast<std::uint64_t*>(_base + 64)); }
+        std::atomic_ref<std::uint32_t> Waiting() const { return std::atomic_ref<std::uint32_t>(*reinterpret_cast<std::uint32_t*>(_base + 128)); }
+
+        void Copy(std::uint64_t position, const unsigned char* data, size_t size)
+        {
+            const size_t offset = size_t(position & (_capacity - 1));
+            const size_t first = std::min(size, _capacity - offset);
+            std::memcpy(_data + offset, data, first);
+            std::memcpy(_data, data + first, size - first);
+        }
+
+        unsigned char* _base;
+        unsigned char* _data;
+        size_t _capacity;
+    };
+
+    // Frames are copied through two rings in a mapping shared with the server. The
+    // Unix socket the mapping was set up over stays open to carry doorbells, a byte
+    // sent when the other side is waiting for data, and to detect either side closing.
+    class SharedMemoryTransport : public Transport
+    {
+    public:
+        SharedMemoryTransport(int sock, unsigned char* mapping, size_t mappingSize, size_t capacity)
+            :
+            _sock(sock),
+            _mapping(mapping),
+            _mappingSize(mappingSize)
+        {
+            _out.Attach(mapping + FILE_HEADER_SIZE, capacity);
+            _in.Attach(mapping + FILE_HEADER_SIZE + RING_HEADER_SIZE + capacity, capacity);
+        }
+
+        virtual int Fd() const { return _sock; }
+
+        virtual ssize_t Read(unsigned char* data, size_t size)
+        {
+            size_t count = _in.Read(data, size);
+            if (count > 0)
+            {
+                return ssize_t(count);
+            }
+
+            // Doorbells only wake the reactor, the data is always taken from the ring.
+            bool closed = false;
+            unsigned char doorbells[64];
+            while (true)
+            {
+                const ssize_t received = recv(_sock, doorbells, sizeof(doorbells), MSG_DONTWAIT);
+                if (received > 0)
+                {
+                    continue;
+                }
+                else if (received == 0)
+                {
+                    closed = true;
+                }
+                else if (errno == EINTR)
+                {
+                    continue;
+                }
+                else if (errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    return -1;
+                }
+                break;
+            }
+
+            if (!closed)
+            {
+                _in.SetWaiting();
+            }
+
+            count = _in.Read(data, size);
+            if (count > 0 || closed)
+            {
+                return ssize_t(count);
+            }
+
+            errno = EAGAIN;
+            return -1;
+        }
+
+        virtual ssize_t Write(const iovec* buffers, int count)
+        {
+            const size_t written = _out.Write(buffers, count);
+            if (written == 0)
+            {
+                errno = EAGAIN;
+                return -1;
+            }
+
+            if (_out.TakeWaiting())
+            {
+                // A full socket buffer already holds a doorbell for the server.
+                const unsigned char doorbell = 1;
+                if (send(_sock, &doorbell, 1, MSG_NOSIGNAL | MSG_DONTWAIT) < 0 &&
+                    errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                {
+                    return -1;
+                }
+            }
+
+            return ssize_t(written);
+        }
+
+        virtual bool PollsWritable() const { return false; }
+
+        virtual ~SharedMemoryTransport()
+        {
+            munmap(_mapping, _mappingSize);
+            close(_sock);
+        }
+
+    private:
+        int _sock;
+        unsigned char* _mapping;
+        size_t _mappingSize;
+        SharedRing _out;
+        SharedRing _in;
+    };
+
+    //============================================================
+
+    int ConnectTcp(const Endpoint& endpoint, const ConnectionOptions& options)
+    {
+        addrinfo hint;
+        std::memset(&hint, 0, sizeof(hint));
+        hint.ai_family = AF_UNSPEC;
+        hint.ai_socktype = SOCK_STREAM;
+        hint.ai_protocol = IPPROTO_TCP;
+
+        int sock = -1;
+        addrinfo* addresses = nullptr;
+        if (getaddrinfo(endpoint.host.c_str(), std::to_string(endpoint.port).c_str(), &hint, &addresses) == 0)
+        {
+            for (addrinfo* info = addresses; info; info = info->ai_next)
+            {
+                sock = socket(info->ai_family, info->ai_socktype | SOCK_CLOEXEC, info->ai_protocol);
+                if (sock == -1)
+                {
+                    continue;
+                }
+
+                if (connect(sock, info->ai_addr, info->ai_addrlen) == 0)
+                {
+                    break;
+                }
+
+                close(sock);
+                sock = -1;
+            }
+
+            freeaddrinfo(addresses);
+        }
+
+        if (sock != -1)
+        {
+            int noDelay = options.tcpNoDelay ? 1 : 0;
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        }
+
+        return sock;
+    }
+
+    int ConnectUnix(const std::string& path)
+    {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path))
+        {
+            return -1;
+        }
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+        int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock != -1 && connect(sock, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+        {
+            close(sock);
+            sock = -1;
+        }
+        return sock;
+    }
+
+    void WriteLE32(unsigned char* data, std::uint32_t value)
+    {
+        data[0] = (unsigned char)(value & 0xFF);
+        data[1] = (unsigned char)((value >> 8) & 0xFF);
+        data[2] = (unsigned char)((value >> 16) & 0xFF);
+        data[3] = (unsigned char)((value >> 24) & 0xFF);
+    }
+
+    std::uint32_t ReadLE32(const unsigned char* data)
+    {
+        return std::uint32_t(data[0]) | (std::uint32_t(data[1]) << 8) | (std::uint32_t(data[2]) << 16) | (std::uint32_t(data[3]) << 24);
+    }
+
+    bool SendAll(int sock, const unsigned char* data, size_t size)
+    {
+        while (size > 0)
+        {
+            const ssize_t sent = send(sock, data, size, MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            else if (sent <= 0)
+            {
+                return false;
+            }
+
+            data += sent;
+            size -= size_t(sent);
+        }
+        return true;
+    }
+
+    std::unique_ptr<Transport> ConnectSharedMemory(const Endpoint& endpoint, const ConnectionOptions& options)
+    {
+        size_t capacity = MIN_RING_CAPACITY;
+        while (capacity < size_t(std::max(options.sharedMemoryCapacity, 0)))
+        {
+            capacity <<= 1;
+        }
+        const size_t mappingSize = FILE_HEADER_SIZE + 2 * (RING_HEADER_SIZE + capacity);
+
+        const int sock = ConnectUnix(endpoint.path);
+        if (sock == -1)
+        {
+            return nullptr;
+        }
+
+        // The server creates the file and sends back its path, which it removes once the client
+        // has mapped it too. A path the server has not created is never mapped.
+        unsigned char handshake[12];
+        WriteLE32(handshake, SHARED_MEMORY_MAGIC);
+        WriteLE32(handshake + 4, SHARED_MEMORY_VERSION);
+        WriteLE32(handshake + 8, std::uint32_t(capacity));
+
+        timeval timeout = {};
+        timeout.tv_sec = HANDSHAKE_TIMEOUT_SECONDS;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        unsigned char reply[5] = {};
+        std::string path;
+        if (SendAll(sock, handshake, sizeof(handshake)) &&
+            recv(sock, reply, sizeof(reply), MSG_WAITALL) == ssize_t(sizeof(reply)) && reply[0] == 1 &&
+            ReadLE32(reply + 1) <= MAX_PATH_LENGTH)
+        {
+            path.resize(ReadLE32(reply + 1));
+            if (recv(sock, path.data(), path.size(), MSG_WAITALL) != ssize_t(path.size()))
+            {
+                path.clear();
+            }
+        }
+
+        unsigned char* mapping = nullptr;
+        const int fd = path.empty() ? -1 : open(path.c_str(), O_RDWR | O_CLOEXEC | O_NOFOLLOW);
+        if (fd != -1)
+        {
+            struct stat info;
+            if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && size_t(info.st_size) >= mappingSize)
+            {
+                void* address = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                mapping = address == MAP_FAILED ? nullptr : static_cast<unsigned char*>(address);
+            }
+            close(fd);
+        }
+
+        const unsigned char mapped = 1;
+        const bool accepted = mapping &&
+            ReadLE32(mapping) == SHARED_MEMORY_MAGIC && ReadLE32(mapping + 8) == std::uint32_t(capacity) &&
+            SendAll(sock, &mapped, 1);
+
+        if (!accepted)
+        {
+            if (mapping)
+            {
+                munmap(mapping, mappingSize);
+            }
+            close(sock);
+            return nullptr;
+        }
+
+        return std::unique_ptr<Transport>(new SharedMemoryTransport(sock, mapping, mappingSize, capacity));
+    }
+}
+
+std::unique_ptr<Transport> Transport::Connect(const Endpoint& endpoint, const ConnectionOptions& options)
+{
+    std::unique_ptr<Transport> transport;
+    switch (endpoint.scheme)
+    {
+    case Endpoint::Scheme::Tcp:
+    {
+        const int sock = ConnectTcp(endpoint, options);
+        if (sock != -1)
+        {
+            transport.reset(new SocketTransport(sock, true));
+        }
+        break;
+    }
+    case Endpoint::Scheme::Unix:
+    {
+        const int sock = ConnectUnix(endpoint.path);
+        if (sock != -1)
+        {
+            transport.reset(new SocketTransport(sock, false));
+        }
+        break;
+    }
+    case Endpoint::Scheme::SharedMemory:
+        transport = ConnectSharedMemory(endpoint, options);
+        break;
+    }
+
+    if (transport)
+    {
+        // Everything after the connect runs on the reactor thread.
+        const int fd = transport->Fd();
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+        if (options.sendBufferSize > 0)
+        {
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &options.sendBufferSize, sizeof(options.sendBufferSize));
+        }
+    }
+
+    return transport;
+}
+
+#endif
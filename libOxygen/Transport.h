@@ -0,0 +1,63 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/uio.h>
+#endif
+
+namespace Oxygen
+{
+    struct ConnectionOptions;
+
+    // Where a connection goes, parsed from a URL:
+    //   tcp://host:port          or just a host name, using the default port
+    //   unix:///path/to/socket   a Unix domain socket on the same host
+    //   shm:///path/to/socket    shared memory rings, set up through the Unix socket
+    struct Endpoint
+    {
+        enum class Scheme
+        {
+            Tcp,
+            Unix,
+            SharedMemory
+        };
+
+        Scheme scheme = Scheme::Tcp;
+        std::string host;
+        int port = 0;
+        std::string path;
+
+        // Returns false if the scheme is unknown or the address is empty.
+        static bool Parse(const std::string& url, int defaultPort, Endpoint& endpoint);
+    };
+
+#ifndef _WIN32
+    // The byte stream under a ClientConnection. Read and Write behave like recv and
+    // sendmsg on a non-blocking socket: they return the number of bytes moved, zero
+    // from Read once the peer has closed, and -1 with errno set to EAGAIN when no
+    // progress can be made. The reactor waits on Fd for the transport to become readable.
+    class Transport
+    {
+    public:
+        // Connects to the endpoint, blocking until it is established. Returns null on failure.
+        static std::unique_ptr<Transport> Connect(const Endpoint& endpoint, const ConnectionOptions& options);
+
+        virtual int Fd() const = 0;
+        virtual ssize_t Read(unsigned char* data, size_t size) = 0;
+        virtual ssize_t Write(const iovec* buffers, int count) = 0;
+
+        // Whether Fd polls writable once a Write which failed with EAGAIN can be retried.
+        // Otherwise the connection retries on a short timer.
+        virtual bool PollsWritable() const { return true; }
+
+        // Holds back partial segments while a batch is written, where supported.
+        virtual void Cork(bool /*cork*/) {}
+
+        virtual ~Transport() {}
+    };
+#endif
+}
@@ -1,6 +1,7 @@
 #include "UploadStream.h"
 #include <algorithm>
 #include <codecvt>
+#include <locale>
 
 constexpr int STREAM_METADATA = 0;
 constexpr int STREAM_TRANSFER = 1;
@@ -30,6 +31,16 @@ static int GetFileSize(const std::wstring& filepath)
     return 0;
 }
 
+#else
+#include <filesystem>
+
+static int GetFileSize(const std::wstring& filepath)
+{
+    std::error_code error;
+    const std::uintmax_t size = std::filesystem::file_size(std::filesystem::path(filepath), error);
+    return error ? 0 : (int)size;
+}
+
 #endif
 
 using namespace Oxygen;
@@ -60,7 +71,7 @@ void UploadStream::UploadThread()
     transfer.WriteInt32(chunkSize);
     transfer.SetId(_sub->Id());
     transfer.Prepare();
-    _conn->WriteMessage(transfer);
+    _conn->WriteMessage(std::move(transfer));
 
     while (_sent > 0 && !_error)
     {
@@ -68,12 +79,12 @@ void UploadStream::UploadThread()
 
         const int numBytes = std::min(chunkSize, size);
 
-        Message msg(_nodeName, _messageName);
+        Message msg(_nodeName, _messageName, 8 + numBytes);
         msg.WriteInt32(STREAM_DATA);
         msg.WriteBytes(numBytes, buffer);
         msg.SetId(_sub->Id());
         msg.Prepare();
-        _conn->WriteMessage(msg);
+        _conn->WriteMessage(std::move(msg));
 
         _sent -= numBytes;
     }
@@ -84,7 +95,7 @@ void UploadStream::UploadThread()
         close.WriteInt32(STREAM_END);
         close.SetId(_sub->Id());
         close.Prepare();
-        _conn->WriteMessage(close);
+        _conn->WriteMessage(std::move(close));
 
         _isUploading = false;
         _uploadStream.close();
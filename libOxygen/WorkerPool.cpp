@@ -0,0 +1,114 @@
+#include "WorkerPool.h"
+#include <algorithm>
+
+using namespace Oxygen;
+
+// The shared pool is kept small, it only helps with the occasional large payload.
+constexpr int MAX_SHARED_THREADS = 3;
+
+WorkerPool& WorkerPool::Shared()
+{
+    // Like the frame pool it is never destroyed, so it can be used until the process exits.
+    static WorkerPool* pool = new WorkerPool(
+        std::clamp(int(std::thread::hardware_concurrency()) - 1, 0, MAX_SHARED_THREADS));
+    return *pool;
+}
+
+WorkerPool::WorkerPool(int numThreads)
+    : _stopping(false)
+{
+    for (int i = 0; i < numThreads; i++)
+    {
+        _threads.emplace_back(&WorkerPool::Run, this);
+    }
+}
+
+void WorkerPool::Work(Job& job)
+{
+    int index;
+    while ((index = job.next.fetch_add(1, std::memory_order_relaxed)) < job.count)
+    {
+        (*job.task)(index);
+    }
+}
+
+void WorkerPool::ForEach(int count, const std::function<void(int)>& task)
+{
+    if (count <= 1 || _threads.empty())
+    {
+        for (int i = 0; i < count; i++)
+        {
+            task(i);
+        }
+        return;
+    }
+
+    Job job;
+    job.task = &task;
+    job.count = count;
+    job.next = 0;
+    job.workers = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _jobs.push_back(&job);
+    }
+    _wake.notify_all();
+
+    Work(job);
+
+    // Every index has been taken, so once no thread is still on the job it is done.
+    std::unique_lock<std::mutex> lock(_lock);
+    auto it = std::find(_jobs.begin(), _jobs.end(), &job);
+    if (it != _jobs.end())
+    {
+        _jobs.erase(it);
+    }
+    _finished.wait(lock, [&job] { return job.workers == 0; });
+}
+
+void WorkerPool::Run()
+{
+    std::unique_lock<std::mutex> lock(_lock);
+    while (true)
+    {
+        _wake.wait(lock, [this] { return _stopping || !_jobs.empty(); });
+        if (_stopping)
+        {
+            return;
+        }
+
+        Job* job = _jobs.front();
+        job->workers++;
+
+        lock.unlock();
+        Work(*job);
+        lock.lock();
+
+        // Only the front job is worked on, so a job with no indices left is still there
+        // unless another thread or its caller has removed it.
+        if (!_jobs.empty() && _jobs.front() == job)
+        {
+            _jobs.pop_front();
+        }
+
+        if (--job->workers == 0)
+        {
+            _finished.notify_all();
+        }
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _stopping = true;
+    }
+    _wake.notify_all();
+
+    for (std::thread& thread : _threads)
+    {
+        thread.join();
+    }
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Oxygen
+{
+    // A few threads which share out the indices of a loop. The calling thread works on
+    // its own loop too, so a pool with no threads runs it serially. Loops may be started
+    // from several threads at once, each is finished before ForEach returns.
+    class WorkerPool
+    {
+    public:
+        static WorkerPool& Shared();
+
+        explicit WorkerPool(int numThreads);
+
+        // Calls task with each index from 0 to count - 1, in no particular order.
+        void ForEach(int count, const std::function<void(int)>& task);
+
+        inline int NumThreads() const { return int(_threads.size()); }
+
+        ~WorkerPool();
+
+    private:
+        struct Job
+        {
+            const std::function<void(int)>* task;
+            int count;
+            std::atomic<int> next;
+            int workers;
+        };
+
+        void Run();
+        static void Work(Job& job);
+
+        std::mutex _lock;
+        std::condition_variable _wake;
+        std::condition_variable _finished;
+        std::deque<Job*> _jobs;
+        bool _stopping;
+        std::vector<std::thread> _threads;
+    };
+}